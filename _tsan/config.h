@@ -0,0 +1,38 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* Build version details */
+#define BUILDID ""
+
+/* Build year */
+#define BUILD_YEAR "2026"
+
+/* Name of package */
+#define PACKAGE "vdagent-win"
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT ""
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "vdagent-win"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "vdagent-win UNKNOWN"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "vdagent-win"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "UNKNOWN"
+
+/* Resource product version */
+#define RC_PRODUCTVERSION UNKNOWN, UNKNOWN, UNKNOWN, 0
+
+/* Resource product version */
+#define RC_PRODUCTVERSION_STR "UNKNOWN, UNKNOWN, UNKNOWN, 0"
+
+/* Version number of package */
+#define VERSION "UNKNOWN"
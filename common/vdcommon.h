@@ -23,10 +23,16 @@
 #endif
 
 #include <errno.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <stdint.h>
+#endif
 #include "spice/vd_agent.h"
 #include "vdlog.h"
 
+#ifdef _WIN32
 class Mutex {
 public:
     Mutex() {
@@ -47,6 +53,34 @@ private:
     Mutex(const Mutex&);
     void operator=(const Mutex&);
 };
+#else
+// Portable builds (e.g. the chunk transport on Linux). Recursive, like a
+// CRITICAL_SECTION.
+class Mutex {
+public:
+    Mutex() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_mtx, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    ~Mutex() {
+        pthread_mutex_destroy(&_mtx);
+    }
+    void lock() {
+        pthread_mutex_lock(&_mtx);
+    }
+    void unlock() {
+        pthread_mutex_unlock(&_mtx);
+    }
+private:
+    pthread_mutex_t _mtx;
+    // no copy
+    Mutex(const Mutex&);
+    void operator=(const Mutex&);
+};
+#endif
 
 class MutexLocker {
 public:
@@ -64,8 +98,61 @@ private:
 };
 typedef Mutex mutex_t;
 
+// Pointer atomics for the lock-free queues, a counter add that returns the
+// new value, and a load of a counter that other threads change. All are full
+// barriers on Windows; on GCC the exchange is an acquire barrier.
+#ifdef _WIN32
+static inline void *vd_atomic_cas_ptr(void *volatile *ptr, void *oldval, void *newval)
+{
+    return InterlockedCompareExchangePointer(ptr, newval, oldval);
+}
+
+static inline void *vd_atomic_xchg_ptr(void *volatile *ptr, void *val)
+{
+    return InterlockedExchangePointer(ptr, val);
+}
+
+static inline long vd_atomic_add(volatile long *ptr, long val)
+{
+    return InterlockedExchangeAdd(ptr, val) + val;
+}
+
+static inline long vd_atomic_load(volatile long *ptr)
+{
+    return InterlockedCompareExchange(ptr, 0, 0);
+}
+#else
+static inline void *vd_atomic_cas_ptr(void *volatile *ptr, void *oldval, void *newval)
+{
+    return __sync_val_compare_and_swap(ptr, oldval, newval);
+}
+
+static inline void *vd_atomic_xchg_ptr(void *volatile *ptr, void *val)
+{
+    return __sync_lock_test_and_set(ptr, val);
+}
+
+static inline long vd_atomic_add(volatile long *ptr, long val)
+{
+    return __sync_add_and_fetch(ptr, val);
+}
+
+static inline long vd_atomic_load(volatile long *ptr)
+{
+    return __sync_fetch_and_add(ptr, 0);
+}
+#endif
+
+// A segment of a gathered write
+struct VDIOVec {
+    const void *base;
+    size_t len;
+};
+
 #define VD_AGENT_REGISTRY_KEY "SOFTWARE\\Red Hat\\Spice\\vdagent\\"
 #define VD_AGENT_STOP_EVENT   TEXT("Global\\vdagent_stop_event")
+// Signaled to log the port forwarding metrics
+#define VD_AGENT_METRICS_EVENT TEXT("Global\\vdagent_metrics_event")
 
 #if defined __GNUC__
 #define ALIGN_GCC __attribute__ ((packed))
@@ -75,6 +162,25 @@ typedef Mutex mutex_t;
 #define ALIGN_VC __declspec (align(1))
 #endif
 
+// Compression of port forwarding data, an extension of spice/vd_agent.h. A
+// side that announces the capability takes DATA_COMPRESSED messages, whose
+// data is an LZ4 block of original_size bytes. Windows and ACKs count the
+// original bytes. The capability is in the first word of the bitmap, below
+// the sign bit, and past the ones spice-protocol defines.
+#define VD_AGENT_CAP_PORT_FORWARD_COMPRESSION 30
+#define VD_AGENT_PORT_FORWARD_DATA_COMPRESSED (VD_AGENT_PORT_FORWARD_SHUTDOWN + 1)
+
+typedef char vd_agent_compression_cap_is_free[
+    VD_AGENT_END_CAP <= VD_AGENT_CAP_PORT_FORWARD_COMPRESSION ? 1 : -1];
+
+typedef struct ALIGN_VC VDAgentPortForwardCompressedDataMessage {
+    uint32_t id;
+    uint32_t size;
+    uint32_t original_size;
+    uint8_t data[0];
+} ALIGN_GCC VDAgentPortForwardCompressedDataMessage;
+
+#ifdef _WIN32
 /*
  * Note: OLDMSVCRT, which is defined (in the Makefile) for mingw builds, and
  * is not defined for Visual Studio builds.
@@ -137,6 +243,7 @@ enum SystemVersion {
 };
 
 SystemVersion supported_system_version();
+#endif /* _WIN32 */
 
 #endif
 
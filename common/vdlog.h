@@ -19,14 +19,19 @@
 #define _H_VDLOG
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
 #include <crtdbg.h>
 #include <windows.h>
 #include <time.h>
 #include <sys/timeb.h>
+#else
+#include <assert.h>
+#endif
 
 #include "vdcommon.h"
 
+#ifdef _WIN32
 class VDLog {
 public:
     ~VDLog();
@@ -40,6 +45,7 @@ private:
     static VDLog* _log;
     FILE* _handle;
 };
+#endif
 
 enum {
   LOG_DEBUG,
@@ -49,18 +55,23 @@ enum {
   LOG_FATAL
 };
 
+// A function, so that files that do not log have no unused copy of it
+static inline unsigned int log_level()
+{
 #ifdef _DEBUG
-static unsigned int log_level = LOG_DEBUG;
+    return LOG_DEBUG;
 #else
-static unsigned int log_level = LOG_INFO;
+    return LOG_INFO;
 #endif
+}
 
 #define PRINT_LINE(type, format, datetime, ms, ...)                     \
     printf("%lu::%s::%s,%.3d::%s::" format "\n", GetCurrentThreadId(), type, datetime, ms, \
            __FUNCTION__, ## __VA_ARGS__);
 
+#ifdef _WIN32
 #define LOG(type, format, ...) do {                                     \
-    if (type >= log_level && type <= LOG_FATAL) {                       \
+    if (type >= log_level() && type <= LOG_FATAL) {                       \
         VDLog* log = VDLog::get();                                      \
         const char *type_as_char[] = { "DEBUG", "INFO", "WARN", "ERROR", "FATAL" }; \
         struct _timeb now;                                              \
@@ -76,6 +87,16 @@ static unsigned int log_level = LOG_INFO;
         }                                                               \
     }                                                                   \
 } while(0)
+#else
+// Portable builds have no log file, everything goes to stderr
+#define LOG(type, format, ...) do {                                     \
+    if (type >= log_level() && type <= LOG_FATAL) {                       \
+        const char *type_as_char[] = { "DEBUG", "INFO", "WARN", "ERROR", "FATAL" }; \
+        fprintf(stderr, "%s::%s::" format "\n", type_as_char[type],    \
+                __FUNCTION__, ## __VA_ARGS__);                          \
+    }                                                                   \
+} while(0)
+#endif
 
 
 #define vd_printf(format, ...) LOG(LOG_INFO, format, ## __VA_ARGS__)
@@ -91,8 +112,12 @@ static unsigned int log_level = LOG_INFO;
     }                                           \
 } while(0)
 
+#ifdef _WIN32
 #define ASSERT(x) _ASSERTE(x)
 
 void log_version();
+#else
+#define ASSERT(x) assert(x)
+#endif
 
 #endif
@@ -0,0 +1,371 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <list>
+#include <queue>
+#include <sys/socket.h>
+#include "chunk_transport.h"
+#include "test_util.h"
+
+/*
+ * Benchmarks of ChunkTransport over a socketpair. Run with the name of a
+ * case, or none for all of them.
+ */
+
+struct Counter : ChunkTransport::Handler {
+    volatile long messages;
+    uint64_t bytes;
+
+    Counter() : messages(0), bytes(0) {}
+    void handle_message(VDAgentMessage *msg, uint32_t port) {
+        bytes += msg->size;
+        messages++;
+    }
+    void handle_transport_error() {
+        fprintf(stderr, "transport error\n");
+        exit(1);
+    }
+};
+
+static void make_socketpair(int fds[2])
+{
+    int size = 4 << 20;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+// Writes the stream repeatedly until the transport has read count messages.
+// Returns the seconds it took.
+static double pump(const ChunkStream &stream, long count, ChunkTransport::ReadMode mode,
+                   Counter &counter)
+{
+    long per_stream = (long)stream.messages.size();
+    long written = 0;
+    size_t pos = 0;
+    int fds[2];
+
+    make_socketpair(fds);
+    ChunkTransport transport(counter, mode);
+    FdStream fd_stream(transport, fds[1], fds[1]);
+    transport.set_stream(&fd_stream);
+    CHECK(transport.start());
+    double start = test_now();
+    while (counter.messages < count) {
+        if (written < count) {
+            ssize_t n = write(fds[0], &stream.bytes[pos], stream.bytes.size() - pos);
+            CHECK(n > 0 || errno == EAGAIN);
+            if (n > 0 && (pos += n) == stream.bytes.size()) {
+                pos = 0;
+                written += per_stream;
+            }
+        }
+        CHECK(fd_stream.poll(0));
+    }
+    double elapsed = test_now() - start;
+    close(fds[0]);
+    close(fds[1]);
+    return elapsed;
+}
+
+static const char *mode_name(ChunkTransport::ReadMode mode)
+{
+    return mode == ChunkTransport::READ_BATCHED ? "batched" : "exact";
+}
+
+// Mouse state sized messages, one chunk each
+static void bench_reads()
+{
+    static const long COUNT = 2000000;
+    ChunkStream stream;
+
+    for (int i = 0; i < 1000; ++i) {
+        stream.message(VDP_CLIENT_PORT, VD_AGENT_MOUSE_STATE, i, 13);
+    }
+    for (int m = 0; m < 2; ++m) {
+        ChunkTransport::ReadMode mode = m ? ChunkTransport::READ_BATCHED :
+                                            ChunkTransport::READ_EXACT;
+        Counter counter;
+        double elapsed = pump(stream, COUNT, mode, counter);
+        printf("reads %-8s %10.0f chunks/s\n", mode_name(mode), COUNT / elapsed);
+    }
+}
+
+// Multi-chunk messages, read into place in batched mode
+static void bench_messages()
+{
+    for (uint32_t mb = 1; mb <= 64; mb *= 4) {
+        uint32_t size = mb << 20;
+        long count = std::max<long>(1, 256 / mb);
+        ChunkStream stream;
+        stream.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, mb, size);
+        for (int m = 0; m < 2; ++m) {
+            ChunkTransport::ReadMode mode = m ? ChunkTransport::READ_BATCHED :
+                                                ChunkTransport::READ_EXACT;
+            Counter counter;
+            double elapsed = pump(stream, count, mode, counter);
+            printf("messages %2u MB %-8s %6.0f MB/s\n", mb, mode_name(mode),
+                   counter.bytes / elapsed / (1 << 20));
+        }
+    }
+}
+
+// N threads enqueue small messages while the owner thread takes them,
+// against the mutex and std::queue that enqueue_message() used before. Only
+// the queue is timed: the stream writes nothing, and both sides make the
+// same wakeup call when they find the queue empty. The owner thread frees
+// what it takes, through the transport's own write path on the lock-free
+// side. The rate is that of the producers, until the last one is done and
+// the queue is empty.
+static const uint32_t PRODUCER_MESSAGES = 200000;
+static ChunkTransport *producer_transport;
+static mutex_t producer_mutex;
+static std::queue<VDIMessage *> producer_queue;
+static volatile long producers_done;
+
+// Completes every write at once, when the owner thread calls complete()
+struct NullStream : ChunkTransport::Stream {
+    ChunkTransport &transport;
+    size_t pending;
+    volatile long wakeups;
+
+    NullStream(ChunkTransport &transport) : transport(transport), pending(0), wakeups(0) {}
+    bool post_read(void *buf, size_t size) {
+        return true;
+    }
+    bool post_write(const VDIOVec *iov, int count) {
+        for (int i = 0; i < count; ++i) {
+            pending += iov[i].len;
+        }
+        return true;
+    }
+    void wakeup() {
+        vd_atomic_add(&wakeups, 1);
+    }
+    void complete() {
+        transport.send_queued();
+        while (pending) {
+            size_t bytes = pending;
+            pending = 0;
+            transport.write_done(bytes);
+        }
+    }
+};
+
+static NullStream *producer_stream;
+
+static void *produce(void *)
+{
+    for (uint32_t i = 0; i < PRODUCER_MESSAGES; ++i) {
+        producer_transport->enqueue_message(
+            producer_transport->new_message(VDP_CLIENT_PORT, VD_AGENT_PORT_FORWARD_DATA, 64));
+    }
+    vd_atomic_add(&producers_done, 1);
+    return NULL;
+}
+
+static void *produce_locked(void *)
+{
+    for (uint32_t i = 0; i < PRODUCER_MESSAGES; ++i) {
+        VDIMessage *msg = producer_transport->new_message(VDP_CLIENT_PORT,
+                                                          VD_AGENT_PORT_FORWARD_DATA, 64);
+        bool was_empty;
+        {
+            MutexLocker lock(producer_mutex);
+            was_empty = producer_queue.empty();
+            producer_queue.push(msg);
+        }
+        if (was_empty) {
+            producer_stream->wakeup();
+        }
+    }
+    vd_atomic_add(&producers_done, 1);
+    return NULL;
+}
+
+static void bench_producers()
+{
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        long count = (long)threads * PRODUCER_MESSAGES;
+        pthread_t ids[8];
+        Counter counter;
+        double start, elapsed[2];
+
+        for (int locked = 0; locked < 2; ++locked) {
+            ChunkTransport sender(counter);
+            NullStream stream(sender);
+            sender.set_stream(&stream);
+            CHECK(sender.start());
+            producer_transport = &sender;
+            producer_stream = &stream;
+            producers_done = 0;
+            start = test_now();
+            for (int i = 0; i < threads; ++i) {
+                pthread_create(&ids[i], NULL, locked ? produce_locked : produce, NULL);
+            }
+            for (;;) {
+                bool done = vd_atomic_load(&producers_done) == threads;
+                if (locked) {
+                    MutexLocker lock(producer_mutex);
+                    while (!producer_queue.empty()) {
+                        sender.free_message(producer_queue.front());
+                        producer_queue.pop();
+                    }
+                } else {
+                    stream.complete();
+                }
+                if (done) {
+                    break;
+                }
+            }
+            elapsed[locked] = test_now() - start;
+            for (int i = 0; i < threads; ++i) {
+                pthread_join(ids[i], NULL);
+            }
+            CHECK(sender.queued_bytes(ChunkTransport::PRIO_PORT_FORWARD) == 0);
+        }
+        printf("producers %d lock-free %6.2f M msgs/s, mutex %6.2f M msgs/s\n", threads,
+               count / elapsed[0] / 1e6, count / elapsed[1] / 1e6);
+    }
+}
+
+// Time from when a port forwarding thread sends a message until it is read
+// at the other end, straight into the transport and through the old hop: the
+// command list, the control event queue and an event that wakes up the owner
+// thread, which then enqueues it.
+static const int LATENCY_MESSAGES = 20000;
+static bool latency_hop;
+static mutex_t hop_commands_mutex, hop_control_mutex;
+static std::list<VDIMessage *> hop_commands;
+static std::queue<int> hop_control;
+static int hop_event[2];
+
+struct LatencyCounter : ChunkTransport::Handler {
+    volatile long messages;
+    double total;
+
+    LatencyCounter() : messages(0), total(0) {}
+    void handle_message(VDAgentMessage *msg, uint32_t port) {
+        double sent;
+        memcpy(&sent, msg->data, sizeof(sent));
+        total += test_now() - sent;
+        messages++;
+    }
+    void handle_transport_error() {
+        fprintf(stderr, "transport error\n");
+        exit(1);
+    }
+};
+
+static void *produce_timed(void *)
+{
+    for (int i = 0; i < LATENCY_MESSAGES; ++i) {
+        VDIMessage *msg = producer_transport->new_message(VDP_CLIENT_PORT,
+                                                          VD_AGENT_PORT_FORWARD_DATA, 2000);
+        double now = test_now();
+        memcpy(msg->payload(), &now, sizeof(now));
+        if (latency_hop) {
+            char c = 0;
+            {
+                MutexLocker lock(hop_commands_mutex);
+                hop_commands.push_back(msg);
+            }
+            MutexLocker lock(hop_control_mutex);
+            hop_control.push(0);
+            CHECK(write(hop_event[1], &c, 1) == 1);
+        } else {
+            producer_transport->enqueue_message(msg);
+        }
+        usleep(50);
+    }
+    return NULL;
+}
+
+static void bench_latency()
+{
+    CHECK(pipe(hop_event) == 0);
+    fcntl(hop_event[0], F_SETFL, O_NONBLOCK);
+    for (int hop = 0; hop < 2; ++hop) {
+        Counter sender_counter;
+        LatencyCounter counter;
+        pthread_t id;
+        int fds[2];
+
+        make_socketpair(fds);
+        ChunkTransport sender(sender_counter), transport(counter);
+        FdStream sender_stream(sender, fds[0], fds[0]), stream(transport, fds[1], fds[1]);
+        sender.set_stream(&sender_stream);
+        transport.set_stream(&stream);
+        CHECK(sender.start());
+        CHECK(transport.start());
+        producer_transport = &sender;
+        latency_hop = hop;
+        pthread_create(&id, NULL, produce_timed, NULL);
+        while (counter.messages < LATENCY_MESSAGES) {
+            if (hop) {
+                char buf[64];
+                struct pollfd event = {hop_event[0], POLLIN, 0};
+                poll(&event, 1, 0);
+                while (read(hop_event[0], buf, sizeof(buf)) > 0);
+                for (;;) {
+                    {
+                        MutexLocker lock(hop_control_mutex);
+                        if (hop_control.empty()) {
+                            break;
+                        }
+                        hop_control.pop();
+                    }
+                    MutexLocker lock(hop_commands_mutex);
+                    sender.enqueue_message(hop_commands.front());
+                    hop_commands.pop_front();
+                }
+            }
+            CHECK(sender_stream.poll(0));
+            CHECK(stream.poll(0));
+        }
+        pthread_join(id, NULL);
+        printf("latency %-13s %6.1f us\n", hop ? "control hop" : "direct",
+               counter.total / LATENCY_MESSAGES * 1e6);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    close(hop_event[0]);
+    close(hop_event[1]);
+}
+
+struct Bench {
+    const char *name;
+    void (*run)();
+};
+
+static const Bench benches[] = {
+    {"reads", bench_reads},
+    {"messages", bench_messages},
+    {"producers", bench_producers},
+    {"latency", bench_latency},
+};
+
+int main(int argc, char **argv)
+{
+    bool found = false;
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        if (argc < 2 || !strcmp(argv[1], benches[i].name)) {
+            benches[i].run();
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
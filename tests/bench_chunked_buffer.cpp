@@ -0,0 +1,191 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "chunk_transport.h"
+#include "chunked_buffer.h"
+#include "test_util.h"
+
+/*
+ * Memory held while a big clipboard message is sent: made by a source as it
+ * is written, like a bitmap, built in a ChunkedBuffer, or built in one
+ * buffer that is sent whole. A host thread reads the other end of a
+ * socketpair and checks the data. The resident set is given above what it
+ * was before each message.
+ */
+
+struct NullHandler : ChunkTransport::Handler {
+    void handle_message(VDAgentMessage *msg, uint32_t port) {}
+    void handle_transport_error() {
+        CHECK(!"transport error");
+    }
+};
+
+static long status_kb(const char *key)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long value = 0;
+    CHECK(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, strlen(key))) {
+            value = atol(line + strlen(key));
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Starts VmHWM again from the current resident set
+static void reset_peak()
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+struct Host {
+    int fd;
+    volatile long messages;
+    volatile long bytes;
+};
+
+static bool read_all(int fd, void *buf, size_t size)
+{
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = read(fd, (uint8_t *)buf + done, size - done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Chunks of one message at a time; the data after the message header and
+// the 4 inline bytes is test_byte(0, i)
+static void *host_thread(void *param)
+{
+    Host &host = *(Host *)param;
+    std::vector<uint8_t> body(VD_AGENT_MAX_DATA_SIZE);
+    uint64_t pos = 0, end = 0;
+    VDIChunkHeader chunk;
+
+    while (read_all(host.fd, &chunk, sizeof(chunk))) {
+        CHECK(chunk.size <= body.size() && read_all(host.fd, &body[0], chunk.size));
+        size_t i = 0;
+        if (!pos) {
+            VDAgentMessage *msg = (VDAgentMessage *)&body[0];
+            end = sizeof(VDAgentMessage) + msg->size;
+            i = sizeof(VDAgentMessage) + sizeof(uint32_t);
+        }
+        for (; i < chunk.size; ++i) {
+            CHECK(body[i] == test_byte(0, pos + i - sizeof(VDAgentMessage) - sizeof(uint32_t)));
+        }
+        pos += chunk.size;
+        vd_atomic_add(&host.bytes, chunk.size);
+        if (pos == end) {
+            pos = 0;
+            vd_atomic_add(&host.messages, 1);
+        }
+    }
+    return NULL;
+}
+
+static void release_array(void *opaque)
+{
+    delete[] (uint8_t *)opaque;
+}
+
+static uint32_t read_generated(void *opaque, uint8_t *buf, uint32_t size)
+{
+    size_t &pos = *(size_t *)opaque;
+    for (uint32_t i = 0; i < size; ++i) {
+        buf[i] = test_byte(0, pos + i);
+    }
+    pos += size;
+    return size;
+}
+
+enum Mode {
+    MODE_SOURCE,
+    MODE_CHUNKED,
+    MODE_CONTIGUOUS,
+    MODE_COUNT
+};
+
+static const char *const MODE_NAMES[] = {"source", "chunked", "contiguous"};
+
+int main()
+{
+    static const int SIZES_MB[] = {1, 16, 64, 200};
+    NullHandler handler;
+    ChunkTransport transport(handler);
+    int fds[2];
+    pthread_t thread;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    FdStream stream(transport, fds[0], fds[0]);
+    transport.set_stream(&stream);
+    CHECK(transport.start());
+    Host host = {fds[1], 0, 0};
+    pthread_create(&thread, NULL, host_thread, &host);
+
+    std::vector<uint8_t> slice(ChunkedBuffer::BLOCK_SIZE * 3 / 2);
+    for (int mode = 0; mode < MODE_COUNT; ++mode) {
+        for (size_t s = 0; s < sizeof(SIZES_MB) / sizeof(SIZES_MB[0]); ++s) {
+            size_t size = (size_t)SIZES_MB[s] << 20;
+            reset_peak();
+            long base = status_kb("VmRSS:");
+            VDIMessage *msg = transport.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD,
+                                                    sizeof(uint32_t));
+            *(uint32_t *)msg->payload() = VD_AGENT_CLIPBOARD_UTF8_TEXT;
+            size_t generated = 0;
+            if (mode == MODE_SOURCE) {
+                msg->set_source(size, read_generated, NULL, &generated);
+            } else if (mode == MODE_CHUNKED) {
+                // Appended in slices, like converted clipboard text
+                ChunkedBuffer *buffer = new ChunkedBuffer;
+                for (size_t pos = 0; pos < size; pos += slice.size()) {
+                    size_t n = std::min(slice.size(), size - pos);
+                    for (size_t i = 0; i < n; ++i) {
+                        slice[i] = test_byte(0, pos + i);
+                    }
+                    CHECK(buffer->append(&slice[0], n));
+                }
+                buffer->attach(msg);
+            } else {
+                uint8_t *data = new uint8_t[size];
+                for (size_t i = 0; i < size; ++i) {
+                    data[i] = test_byte(0, i);
+                }
+                msg->set_data(data, size, release_array, data);
+            }
+            long messages = host.messages, start_bytes = host.bytes, halfway = 0;
+            double start = test_now();
+            transport.enqueue_message(msg);
+            while (host.messages == messages) {
+                CHECK(stream.poll(10));
+                if (!halfway && (size_t)(host.bytes - start_bytes) > size / 2) {
+                    halfway = status_kb("VmRSS:");
+                }
+            }
+            double elapsed = test_now() - start;
+            printf("%-10s %4d MB: peak +%7ld KB, halfway +%7ld KB, after +%6ld KB, %5.0f MB/s\n",
+                   MODE_NAMES[mode], SIZES_MB[s], status_kb("VmHWM:") - base,
+                   halfway - base, status_kb("VmRSS:") - base, size / 1048576.0 / elapsed);
+        }
+    }
+    shutdown(fds[1], SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+// ConnectionTable is private to the forwarder
+#include "port_forward.cpp"
+#include "test_util.h"
+
+/*
+ * Lookups of connections by id in the slot table, against the std::map that
+ * held them before.
+ */
+
+int main()
+{
+    static const int SIZES[] = {10, 1000, 50000};
+    static const int ROUNDS = 8;
+
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); ++s) {
+        int count = SIZES[s];
+        ConnectionTable table(0, 1);
+        std::map<PortForwarder::conn_id_t, Connection> map;
+        std::vector<PortForwarder::conn_id_t> ids, order(1 << 20);
+        TestRandom random(count);
+        volatile uint64_t sink = 0;
+
+        for (int i = 0; i < count; ++i) {
+            Connection *conn = table.add();
+            ids.push_back(conn->id);
+            map[conn->id].id = conn->id;
+        }
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = ids[random.below(count)];
+        }
+        double start = test_now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            for (size_t i = 0; i < order.size(); ++i) {
+                sink += table.find(order[i])->data_sent;
+            }
+        }
+        double table_time = test_now() - start;
+        start = test_now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            for (size_t i = 0; i < order.size(); ++i) {
+                sink += map.find(order[i])->second.data_sent;
+            }
+        }
+        double map_time = test_now() - start;
+        printf("%6d connections: table %6.1f M lookups/s, map %6.1f M lookups/s\n", count,
+               ROUNDS * order.size() / table_time / 1e6, ROUNDS * order.size() / map_time / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,502 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <algorithm>
+#include <map>
+#include "port_forward_util.h"
+
+/*
+ * Benchmarks of PortForwarder on loopback sockets. Run with the name of a
+ * case, or none for all of them.
+ */
+
+// Guest connections to a forwarded port, acked by the client and ready for
+// data
+struct Guests {
+    std::vector<int> socks;
+    std::map<uint32_t, uint32_t> unacked;
+    uint32_t ack_interval;
+    volatile bool stop;
+
+    Guests() : ack_interval(0), stop(false) {}
+
+    void open(PortForwarder &pf, TestSender &sender, uint16_t port, int count) {
+        for (int i = 0; i < count; ++i) {
+            int sock;
+            uint32_t id = accept_forwarded(sender, port, &sock, &ack_interval);
+            fcntl(sock, F_SETFL, O_NONBLOCK);
+            socks.push_back(sock);
+            client_ack(pf, id, ack_interval);
+            unacked[id] = 0;
+        }
+    }
+
+    ~Guests() {
+        for (size_t i = 0; i < socks.size(); ++i) {
+            close(socks[i]);
+        }
+    }
+};
+
+// Writes to every guest socket as fast as it takes data
+static void *guest_writer(void *param)
+{
+    Guests &guests = *(Guests *)param;
+    std::vector<char> block(65536, 'x');
+    std::vector<pollfd> fds(guests.socks.size());
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        fds[i].fd = guests.socks[i];
+        fds[i].events = POLLOUT;
+    }
+    while (!guests.stop) {
+        poll(&fds[0], fds.size(), 10);
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents & POLLOUT) {
+                ssize_t n = write(fds[i].fd, &block[0], block.size());
+                (void)n;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Acks the data of the guests for the given seconds, returns the MB/s that
+// the client got
+static double stream_guests(PortForwarder &pf, TestSender &sender, Guests &guests,
+                            double seconds)
+{
+    std::deque<SentMessage> messages;
+    pthread_t writer;
+    long start_bytes = sender.data_bytes;
+
+    pthread_create(&writer, NULL, guest_writer, &guests);
+    double start = test_now();
+    double end = start + seconds;
+    while (test_now() < end) {
+        sender.take(messages);
+        if (messages.empty()) {
+            usleep(50);
+            continue;
+        }
+        for (size_t i = 0; i < messages.size(); ++i) {
+            const SentMessage &msg = messages[i];
+            if (msg.type != VD_AGENT_PORT_FORWARD_DATA) {
+                continue;
+            }
+            VDAgentPortForwardDataMessage *hdr = (VDAgentPortForwardDataMessage *)&msg.data[0];
+            uint32_t &unacked = guests.unacked[hdr->id];
+            unacked += hdr->size;
+            if (unacked >= guests.ack_interval) {
+                client_ack(pf, hdr->id, unacked);
+                unacked = 0;
+            }
+        }
+        messages.clear();
+    }
+    double elapsed = test_now() - start;
+    guests.stop = true;
+    pthread_join(writer, NULL);
+    return (sender.data_bytes - start_bytes) / elapsed / (1 << 20);
+}
+
+// Guest connections accepted and closed by the client, one at a time
+static void bench_connections()
+{
+    static const int COUNT = 2000;
+    TestSender sender;
+    PortForwarder pf(sender, test_options(1));
+    uint16_t port = free_port();
+
+    client_listen(pf, port, "127.0.0.1");
+    double start = test_now();
+    for (int i = 0; i < COUNT; ++i) {
+        int sock;
+        uint32_t id = accept_forwarded(sender, port, &sock);
+        client_close(pf, id);
+        close(sock);
+    }
+    printf("connections %8.0f conn/s\n", COUNT / (test_now() - start));
+}
+
+// Data from one guest connection to the client
+static void bench_throughput()
+{
+    TestSender sender;
+    sender.headers_only = true;
+    PortForwarder pf(sender, test_options(1));
+    uint16_t port = free_port();
+    Guests guests;
+
+    client_listen(pf, port, "127.0.0.1");
+    guests.open(pf, sender, port, 1);
+    printf("throughput %8.0f MB/s\n", stream_guests(pf, sender, guests, 3));
+}
+
+// 128 MB through one connection with each number of reads posted, written
+// by the same thread that acks it
+static void bench_depth()
+{
+    static const size_t TOTAL = 128 << 20;
+    for (int depth = 1; depth <= PFIOBackend::MAX_READS; depth *= 2) {
+        TestSender sender;
+        sender.headers_only = true;
+        PortForwarder::Options options = test_options(1);
+        options.read_depth = depth;
+        PortForwarder pf(sender, options);
+        uint16_t port = free_port();
+        std::vector<char> block(65536, 'x');
+        std::deque<SentMessage> messages;
+        uint32_t ack_interval, unacked = 0;
+        size_t written = 0;
+        int sock;
+
+        client_listen(pf, port, "127.0.0.1");
+        uint32_t id = accept_forwarded(sender, port, &sock, &ack_interval);
+        client_ack(pf, id, ack_interval);
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        double start = test_now();
+        while ((size_t)sender.data_bytes < TOTAL) {
+            if (written < TOTAL) {
+                ssize_t n = write(sock, &block[0], std::min(block.size(), TOTAL - written));
+                if (n > 0) {
+                    written += n;
+                }
+            }
+            sender.take(messages);
+            for (size_t i = 0; i < messages.size(); ++i) {
+                if (messages[i].type == VD_AGENT_PORT_FORWARD_DATA) {
+                    unacked += ((VDAgentPortForwardDataMessage *)&messages[i].data[0])->size;
+                }
+            }
+            messages.clear();
+            if (unacked >= ack_interval) {
+                client_ack(pf, id, unacked);
+                unacked = 0;
+            }
+        }
+        printf("depth %2d %8.0f MB/s\n", depth, TOTAL / (test_now() - start) / (1 << 20));
+        close(sock);
+    }
+}
+
+// Bursts of concurrent guest connections, timed until each is accepted. A
+// backlog that is too short for the burst, like the old 5, makes the kernel
+// drop handshakes, which stalls connections for seconds.
+struct AcceptCase {
+    int backlog;
+    int accept_depth;
+    int burst;
+};
+
+static void bench_accepts()
+{
+    static const AcceptCase CASES[] = {
+        {128, 1, 30},
+        {128, 8, 30},
+        {128, 1, 100},
+        {128, 8, 100},
+    };
+    static const int ROUNDS = 20;
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); ++c) {
+        TestSender sender;
+        PortForwarder::Options options = test_options(1);
+        options.listen_backlog = CASES[c].backlog;
+        options.accept_depth = CASES[c].accept_depth;
+        PortForwarder pf(sender, options);
+        uint16_t port = free_port();
+        sockaddr_in addr = loopback_addr(port);
+        std::vector<double> latencies;
+        int sock;
+
+        client_listen(pf, port, "127.0.0.1");
+        client_close(pf, accept_forwarded(sender, port, &sock));
+        close(sock);
+        double start = test_now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            std::vector<int> socks;
+            double burst_start = test_now();
+            for (int i = 0; i < CASES[c].burst; ++i) {
+                sock = socket(AF_INET, SOCK_STREAM, 0);
+                fcntl(sock, F_SETFL, O_NONBLOCK);
+                connect(sock, (sockaddr *)&addr, sizeof(addr));
+                socks.push_back(sock);
+            }
+            for (int i = 0; i < CASES[c].burst; ++i) {
+                SentMessage msg = sender.next(VD_AGENT_PORT_FORWARD_ACCEPTED, 15);
+                latencies.push_back(test_now() - burst_start);
+                client_close(pf, msg.id());
+            }
+            for (size_t i = 0; i < socks.size(); ++i) {
+                tcp_reset(socks[i]);
+            }
+        }
+        double elapsed = test_now() - start;
+        std::sort(latencies.begin(), latencies.end());
+        printf("accepts backlog %3d depth %d burst %3d: %6.0f conn/s, "
+               "p50 %4.1f ms, p99 %4.1f ms, max %4.1f ms\n",
+               CASES[c].backlog, CASES[c].accept_depth, CASES[c].burst,
+               latencies.size() / elapsed, latencies[latencies.size() / 2] * 1e3,
+               latencies[latencies.size() * 99 / 100] * 1e3, latencies.back() * 1e3);
+    }
+}
+
+// Data from many guest connections, spread over 1 and 4 shards
+static void bench_shards()
+{
+    static const int CONNECTIONS[] = {1, 16, 256};
+    for (int threads = 1; threads <= 4; threads *= 4) {
+        for (size_t i = 0; i < sizeof(CONNECTIONS) / sizeof(CONNECTIONS[0]); ++i) {
+            TestSender sender;
+            sender.headers_only = true;
+            PortForwarder pf(sender, test_options(threads));
+            uint16_t port = free_port();
+            Guests guests;
+
+            client_listen(pf, port, "127.0.0.1");
+            guests.open(pf, sender, port, CONNECTIONS[i]);
+            printf("shards %d connections %3d %8.0f MB/s\n", threads, CONNECTIONS[i],
+                   stream_guests(pf, sender, guests, 2));
+        }
+    }
+}
+
+// A client behind a link of limited bandwidth, whose ACKs reach the agent
+// one RTT after the data went through the link. Shows the throughput and the
+// most data that the client had queued, which the window has to bound.
+struct LinkCase {
+    int connections;
+    double rtt_ms;
+    double mb_per_s;
+};
+
+struct PendingAck {
+    double at;
+    uint32_t id;
+    uint32_t size;
+};
+
+static void bench_window()
+{
+    static const LinkCase CASES[] = {
+        {64, 50, 50},
+        {16, 100, 5},
+        {1, 100, 50},
+        {1, 200, 100},
+    };
+    static const double SECONDS = 4;
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); ++c) {
+        const LinkCase &link = CASES[c];
+        double bandwidth = link.mb_per_s * 1e6;
+        TestSender sender;
+        sender.headers_only = true;
+        PortForwarder pf(sender, test_options(1));
+        uint16_t port = free_port();
+        Guests guests;
+        std::deque<SentMessage> messages;
+        std::deque<PendingAck> acks;
+        uint64_t delivered = 0;
+        long peak = 0;
+        pthread_t writer;
+
+        client_listen(pf, port, "127.0.0.1");
+        guests.open(pf, sender, port, link.connections);
+        pthread_create(&writer, NULL, guest_writer, &guests);
+        double start = test_now();
+        double link_free = start;
+        while (test_now() < start + SECONDS) {
+            double now = test_now();
+            while (!acks.empty() && acks.front().at <= now) {
+                client_ack(pf, acks.front().id, acks.front().size);
+                acks.pop_front();
+            }
+            if (messages.empty()) {
+                sender.take(messages);
+            }
+            peak = std::max(peak, sender.data_bytes - (long)delivered);
+            // The link does not save up idle time beyond a millisecond
+            link_free = std::max(link_free, now - 0.001);
+            while (!messages.empty() && link_free <= now) {
+                const SentMessage &msg = messages.front();
+                if (msg.type == VD_AGENT_PORT_FORWARD_DATA) {
+                    VDAgentPortForwardDataMessage *hdr =
+                        (VDAgentPortForwardDataMessage *)&msg.data[0];
+                    uint32_t &unacked = guests.unacked[hdr->id];
+                    link_free += hdr->size / bandwidth;
+                    delivered += hdr->size;
+                    unacked += hdr->size;
+                    if (unacked >= guests.ack_interval) {
+                        PendingAck ack = {link_free + link.rtt_ms / 1000, hdr->id, unacked};
+                        acks.push_back(ack);
+                        unacked = 0;
+                    }
+                }
+                messages.pop_front();
+            }
+            usleep(200);
+        }
+        double elapsed = test_now() - start;
+        guests.stop = true;
+        pthread_join(writer, NULL);
+        printf("window %3d connections %3.0f ms %3.0f MB/s: %6.1f MB/s, peak queued %6.1f MB\n",
+               link.connections, link.rtt_ms, link.mb_per_s, delivered / elapsed / 1e6,
+               peak / 1e6);
+    }
+}
+
+// Records of 64 bytes written with TCP_NODELAY at a fixed interval, timed
+// from write() until the sender gets them. Wire overhead counts the chunk,
+// message and DATA headers of every message.
+static const size_t RECORD_SIZE = 64;
+static const double MESSAGE_OVERHEAD = sizeof(VDIChunkHeader) + sizeof(VDAgentMessage) +
+                                       sizeof(VDAgentPortForwardDataMessage);
+
+class RecordSender : public TestSender {
+public:
+    std::vector<double> written_at;
+    std::vector<double> latencies;
+    volatile long record_bytes;
+    long messages;
+
+    RecordSender() : record_bytes(0), messages(0) {}
+
+    void send(uint32_t type, size_t size, void *data) {
+        if (size && type == VD_AGENT_PORT_FORWARD_DATA) {
+            VDAgentPortForwardDataMessage *msg = (VDAgentPortForwardDataMessage *)data;
+            double now = test_now();
+            _stream.insert(_stream.end(), msg->data, msg->data + msg->size);
+            size_t records = _stream.size() / RECORD_SIZE;
+            for (size_t i = 0; i < records; ++i) {
+                uint32_t seq;
+                memcpy(&seq, &_stream[i * RECORD_SIZE], sizeof(seq));
+                latencies.push_back(now - written_at[seq]);
+            }
+            _stream.erase(_stream.begin(), _stream.begin() + records * RECORD_SIZE);
+            messages++;
+            vd_atomic_add(&record_bytes, msg->size);
+        }
+        TestSender::send(type, size, data);
+    }
+
+private:
+    std::vector<uint8_t> _stream;
+};
+
+struct RecordWriter {
+    int sock;
+    int count;
+    int interval_us;
+    std::vector<double> *written_at;
+};
+
+static void *write_records(void *param)
+{
+    RecordWriter &writer = *(RecordWriter *)param;
+    uint8_t record[RECORD_SIZE];
+    struct timespec next;
+
+    memset(record, 'r', sizeof(record));
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < writer.count; ++i) {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        memcpy(record, &i, sizeof(i));
+        (*writer.written_at)[i] = test_now();
+        CHECK(write(writer.sock, record, sizeof(record)) == sizeof(record));
+        next.tv_nsec += writer.interval_us * 1000;
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+    }
+    return NULL;
+}
+
+struct BatchCase {
+    int interval_us;
+    int delay_us;
+};
+
+static void bench_batching()
+{
+    static const BatchCase CASES[] = {
+        {20, 0},
+        {20, 200},
+        {100, 0},
+        {100, 200},
+        {1000, 200},
+    };
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); ++c) {
+        int count = std::min(20000, 1000000 / CASES[c].interval_us);
+        RecordSender sender;
+        PortForwarder::Options options = test_options(1);
+        options.batch_delay_us = CASES[c].delay_us;
+        PortForwarder pf(sender, options);
+        uint16_t port = free_port();
+        uint32_t ack_interval;
+        long acked = 0;
+        int sock, one = 1;
+        pthread_t writer;
+
+        client_listen(pf, port, "127.0.0.1");
+        uint32_t id = accept_forwarded(sender, port, &sock, &ack_interval);
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        client_ack(pf, id, ack_interval);
+        sender.written_at.resize(count);
+        RecordWriter records = {sock, count, CASES[c].interval_us, &sender.written_at};
+        pthread_create(&writer, NULL, write_records, &records);
+        while ((size_t)sender.record_bytes < count * RECORD_SIZE) {
+            long bytes = sender.record_bytes;
+            if (bytes - acked >= ack_interval) {
+                client_ack(pf, id, bytes - acked);
+                acked = bytes;
+            }
+            usleep(50);
+        }
+        pthread_join(writer, NULL);
+        std::vector<double> &latencies = sender.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        printf("batching interval %4d us delay %3d us: %5.1f records/msg, overhead %4.1f%%, "
+               "p50 %4.0f us, p99 %4.0f us\n", CASES[c].interval_us, CASES[c].delay_us,
+               (double)count / sender.messages,
+               100 * sender.messages * MESSAGE_OVERHEAD / (count * RECORD_SIZE +
+                                                           sender.messages * MESSAGE_OVERHEAD),
+               latencies[latencies.size() / 2] * 1e6,
+               latencies[latencies.size() * 99 / 100] * 1e6);
+        close(sock);
+    }
+}
+
+struct Bench {
+    const char *name;
+    void (*run)();
+};
+
+static const Bench benches[] = {
+    {"connections", bench_connections},
+    {"throughput", bench_throughput},
+    {"depth", bench_depth},
+    {"accepts", bench_accepts},
+    {"shards", bench_shards},
+    {"window", bench_window},
+    {"batching", bench_batching},
+};
+
+int main(int argc, char **argv)
+{
+    bool found = false;
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        if (argc < 2 || !strcmp(argv[1], benches[i].name)) {
+            benches[i].run();
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
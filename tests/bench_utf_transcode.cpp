@@ -0,0 +1,140 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+// The scalar and vector converters are private to the transcoder
+#include "utf_transcode.cpp"
+#include <iconv.h>
+#include <string>
+#include "test_util.h"
+
+/*
+ * Throughput of each converter and of iconv on clipboard text in several
+ * scripts, from ASCII logs to emoji, in MB/s of UTF-8 both ways.
+ */
+
+typedef size_t (*ToUtf8)(const uint16_t *src, size_t count, uint8_t *dst);
+typedef size_t (*ToUtf16)(const uint8_t *src, size_t size, uint16_t *dst);
+
+static void append_char(std::string &s, uint32_t c)
+{
+    uint16_t units[2] = {(uint16_t)c};
+    size_t count = 1;
+    uint8_t buf[4];
+    if (c >= 0x10000) {
+        units[0] = 0xd800 | (c - 0x10000) >> 10;
+        units[1] = 0xdc00 | (c & 0x3ff);
+        count = 2;
+    }
+    s.append((char *)buf, utf16_to_utf8_scalar(units, count, buf));
+}
+
+static std::string make_text(const std::string &name, size_t size)
+{
+    static const char *const WORDS[] = {"GET", "/index.html", "200", "user_id",
+                                        "2014-10-17T02:41:00Z", "INFO", "connection", "42",
+                                        "0.137", "ok"};
+    static const uint32_t WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+    TestRandom random(3);
+    std::string s;
+    while (s.size() < size) {
+        if (name == "ascii log") {
+            s += WORDS[random.below(WORD_COUNT)];
+            s += random.below(8) ? ',' : '\n';
+        } else if (name == "french") {
+            s += WORDS[random.below(WORD_COUNT)];
+            if (!random.below(6)) {
+                append_char(s, 0xe9);
+            }
+            s += ' ';
+        } else if (name == "russian") {
+            for (int i = 2 + random.below(8); i; --i) {
+                append_char(s, 0x430 + random.below(32));
+            }
+            s += ' ';
+        } else if (name == "chinese") {
+            append_char(s, 0x4e00 + random.below(0x5000));
+            if (!random.below(10)) {
+                s += ", ";
+            }
+        } else {
+            append_char(s, 0x1f600 + random.below(80));
+            s += ' ';
+        }
+    }
+    return s;
+}
+
+static size_t iconv_convert(const char *to, const char *from, const void *src, size_t size,
+                            void *dst, size_t capacity)
+{
+    iconv_t cd = iconv_open(to, from);
+    char *in = (char *)src, *out = (char *)dst;
+    size_t out_left = capacity;
+    CHECK(cd != (iconv_t)-1);
+    CHECK(iconv(cd, &in, &size, &out, &out_left) != (size_t)-1);
+    iconv_close(cd);
+    return capacity - out_left;
+}
+
+int main()
+{
+    static const char *const TEXTS[] = {"ascii log", "french", "russian", "chinese", "emoji"};
+    static const size_t TEXT_SIZE = 8 << 20;
+    static const int REPEATS = 5;
+    const char *names[] = {"scalar", "sse2", "avx2", "iconv"};
+    ToUtf8 to_utf8[] = {utf16_to_utf8_scalar, NULL, NULL, NULL};
+    ToUtf16 to_utf16[] = {utf8_to_utf16_scalar, NULL, NULL, NULL};
+#ifdef UTF_SSE2
+    if (simd_level() >= SIMD_SSE2) {
+        to_utf8[1] = utf16_to_utf8_sse2;
+        to_utf16[1] = utf8_to_utf16_sse2;
+    }
+#endif
+#ifdef UTF_AVX2
+    if (simd_level() >= SIMD_AVX2) {
+        to_utf8[2] = utf16_to_utf8_avx2;
+        to_utf16[2] = utf8_to_utf16_avx2;
+    }
+#endif
+
+    printf("%-10s %-7s %8s %8s\n", "text", "impl", "16->8", "8->16");
+    for (size_t t = 0; t < sizeof(TEXTS) / sizeof(TEXTS[0]); ++t) {
+        std::string text = make_text(TEXTS[t], TEXT_SIZE);
+        const uint8_t *utf8 = (const uint8_t *)text.data();
+        std::vector<uint16_t> utf16(UTF16_MAX_COUNT(text.size()));
+        size_t count = utf8_to_utf16_scalar(utf8, text.size(), &utf16[0]);
+        std::vector<uint8_t> out8(UTF8_MAX_SIZE(count));
+        std::vector<uint16_t> out16(utf16.size());
+
+        for (int i = 0; i < 4; ++i) {
+            if (i < 3 && !to_utf8[i]) {
+                continue;
+            }
+            double best8 = 1e9, best16 = 1e9;
+            for (int r = 0; r < REPEATS; ++r) {
+                size_t size, units;
+                double start = test_now();
+                if (i < 3) {
+                    size = to_utf8[i](&utf16[0], count, &out8[0]);
+                } else {
+                    size = iconv_convert("UTF-8", "UTF-16LE", &utf16[0], count * 2, &out8[0],
+                                         out8.size());
+                }
+                double middle = test_now();
+                if (i < 3) {
+                    units = to_utf16[i](utf8, text.size(), &out16[0]);
+                } else {
+                    units = iconv_convert("UTF-16LE", "UTF-8", utf8, text.size(), &out16[0],
+                                          out16.size() * 2) / 2;
+                }
+                best8 = std::min(best8, middle - start);
+                best16 = std::min(best16, test_now() - middle);
+                CHECK(size == text.size() && units == count);
+            }
+            printf("%-10s %-7s %8.0f %8.0f\n", TEXTS[t], names[i], text.size() / best8 / 1e6,
+                   text.size() / best16 / 1e6);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __CORPUS_H
+#define __CORPUS_H
+
+#include <string>
+#include "test_util.h"
+
+/*
+ * Deterministic data that looks like what goes through forwarded
+ * connections, from text that compresses well to random bytes that do not.
+ */
+
+static const char *const CORPUS_WORDS[] = {
+    "the", "connection", "agent", "client", "data", "window", "message", "port",
+    "server", "request", "response", "buffer", "stream", "of", "and", "to", "a",
+    "is", "for", "with", "read", "write", "close", "open", "remote", "local",
+    "session", "display", "guest", "host", "time", "value", "error", "status",
+};
+static const uint32_t CORPUS_WORD_COUNT = sizeof(CORPUS_WORDS) / sizeof(CORPUS_WORDS[0]);
+
+static inline void corpus_append(std::vector<uint8_t> &out, const std::string &s)
+{
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+static inline std::string corpus_number(uint32_t n)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u", n);
+    return buf;
+}
+
+static inline std::string corpus_sentence(TestRandom &random)
+{
+    std::string s;
+    uint32_t words = 4 + random.below(12);
+    for (uint32_t i = 0; i < words; ++i) {
+        s += i ? " " : "";
+        s += CORPUS_WORDS[random.below(CORPUS_WORD_COUNT)];
+    }
+    return s + ".";
+}
+
+// name is one of CORPUS_NAMES
+static inline std::vector<uint8_t> make_corpus(const std::string &name, size_t size)
+{
+    std::vector<uint8_t> out;
+    TestRandom random(size);
+    uint32_t n = 0;
+
+    out.reserve(size + 1024);
+    while (out.size() < size) {
+        if (name == "html") {
+            corpus_append(out, "<div class=\"item\"><a href=\"/items/" + corpus_number(n) +
+                          "\">" + corpus_sentence(random) + "</a><p>" +
+                          corpus_sentence(random) + "</p></div>\n");
+        } else if (name == "json") {
+            corpus_append(out, "{\"id\":" + corpus_number(n) + ",\"name\":\"user_" +
+                          corpus_number(random.below(1000)) + "\",\"active\":" +
+                          (random.below(2) ? "true" : "false") + ",\"score\":" +
+                          corpus_number(random.below(100000)) + "},\n");
+        } else if (name == "text") {
+            corpus_append(out, corpus_sentence(random) + "\n");
+        } else if (name == "binary") {
+            // Records of small integers and counters
+            uint32_t record[8] = {n, n * 3, random.below(16), random.below(256), 0, 1,
+                                  random.next(), 0x7f000001};
+            out.insert(out.end(), (uint8_t *)record, (uint8_t *)(record + 8));
+        } else {
+            CHECK(name == "random");
+            uint32_t value = random.next();
+            out.insert(out.end(), (uint8_t *)&value, (uint8_t *)(&value + 1));
+        }
+        n++;
+    }
+    out.resize(size);
+    return out;
+}
+
+static const char *const CORPUS_NAMES[] = {"html", "json", "text", "binary", "random"};
+static const int CORPUS_COUNT = sizeof(CORPUS_NAMES) / sizeof(CORPUS_NAMES[0]);
+
+#endif // __CORPUS_H
@@ -0,0 +1,256 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __PORT_FORWARD_UTIL_H
+#define __PORT_FORWARD_UTIL_H
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <deque>
+#include "port_forward.h"
+#include "test_util.h"
+
+/*
+ * Helpers of the tests of PortForwarder over loopback sockets: a Sender that
+ * keeps the messages for the client, and the commands of the client.
+ */
+
+struct SentMessage {
+    uint32_t type;
+    std::vector<uint8_t> data;
+
+    uint32_t id() const {
+        uint32_t id;
+        memcpy(&id, &data[0], sizeof(id));
+        return id;
+    }
+};
+
+class TestSender : public PortForwarder::Sender {
+public:
+    // Buffers given out and not sent or released yet
+    volatile long buffers;
+    // Payload bytes of the DATA messages, kept or not
+    volatile long data_bytes;
+    // Keep only the header of DATA messages, for benchmarks
+    bool headers_only;
+    // Bigger buffers are refused if not 0
+    size_t max_buffer;
+
+    TestSender() : buffers(0), data_bytes(0), headers_only(false), max_buffer(0) {}
+
+    void *get_buffer(size_t size) {
+        if (max_buffer && size > max_buffer) {
+            return NULL;
+        }
+        vd_atomic_add(&buffers, 1);
+        return new uint8_t[size];
+    }
+
+    void send(uint32_t type, size_t size, void *data) {
+        if (size) {
+            SentMessage msg;
+            if (type == VD_AGENT_PORT_FORWARD_DATA) {
+                vd_atomic_add(&data_bytes, size - sizeof(VDAgentPortForwardDataMessage));
+                if (headers_only) {
+                    size = sizeof(VDAgentPortForwardDataMessage);
+                }
+            }
+            msg.type = type;
+            msg.data.assign((uint8_t *)data, (uint8_t *)data + size);
+            MutexLocker lock(_mutex);
+            _messages.push_back(msg);
+        }
+        delete[] (uint8_t *)data;
+        vd_atomic_add(&buffers, -1);
+    }
+
+    // Takes all the messages sent so far
+    void take(std::deque<SentMessage> &messages) {
+        MutexLocker lock(_mutex);
+        messages.swap(_messages);
+    }
+
+    bool poll(SentMessage &msg) {
+        MutexLocker lock(_mutex);
+        if (_messages.empty()) {
+            return false;
+        }
+        msg = _messages.front();
+        _messages.pop_front();
+        return true;
+    }
+
+    // The next message, which must come within seconds and be of the type
+    SentMessage next(uint32_t type, double seconds = 5) {
+        SentMessage msg;
+        double deadline = test_now() + seconds;
+        while (!poll(msg)) {
+            CHECK(test_now() < deadline);
+            usleep(100);
+        }
+        if (msg.type != type) {
+            fprintf(stderr, "message %u instead of %u\n", msg.type, type);
+        }
+        CHECK(msg.type == type);
+        return msg;
+    }
+
+    // Drops the messages sent so far
+    void clear() {
+        MutexLocker lock(_mutex);
+        _messages.clear();
+    }
+
+    // Whether no message comes within seconds
+    bool quiet(double seconds) {
+        usleep((useconds_t)(seconds * 1e6));
+        MutexLocker lock(_mutex);
+        return _messages.empty();
+    }
+
+private:
+    mutex_t _mutex;
+    std::deque<SentMessage> _messages;
+};
+
+static inline sockaddr_in loopback_addr(uint16_t port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// A loopback listener on a free port
+static inline int tcp_listen(uint16_t *port)
+{
+    sockaddr_in addr = loopback_addr(0);
+    socklen_t len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sock >= 0);
+    CHECK(bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(listen(sock, 1024) == 0);
+    CHECK(getsockname(sock, (sockaddr *)&addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+// A port that nobody listens to right now
+static inline uint16_t free_port()
+{
+    uint16_t port;
+    close(tcp_listen(&port));
+    return port;
+}
+
+// Retries while the forwarder is not listening yet
+static inline int tcp_connect(uint16_t port)
+{
+    sockaddr_in addr = loopback_addr(port);
+    double deadline = test_now() + 5;
+    for (;;) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(sock >= 0);
+        if (!connect(sock, (sockaddr *)&addr, sizeof(addr))) {
+            return sock;
+        }
+        CHECK(errno == ECONNREFUSED && test_now() < deadline);
+        close(sock);
+        usleep(1000);
+    }
+}
+
+// Closes with a RST instead of a FIN
+static inline void tcp_reset(int sock)
+{
+    struct linger linger = {1, 0};
+    CHECK(setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == 0);
+    close(sock);
+}
+
+// The commands of the client
+
+static inline void client_listen(PortForwarder &pf, uint16_t port, const char *address)
+{
+    std::vector<uint8_t> buf(sizeof(VDAgentPortForwardListenMessage) + strlen(address) + 1);
+    VDAgentPortForwardListenMessage *msg = (VDAgentPortForwardListenMessage *)&buf[0];
+    msg->port = port;
+    strcpy(msg->bind_address, address);
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_LISTEN, msg, buf.size()));
+}
+
+static inline void client_connect(PortForwarder &pf, uint32_t id, uint16_t port,
+                                  const char *host, uint32_t ack_interval)
+{
+    std::vector<uint8_t> buf(sizeof(VDAgentPortForwardConnectMessage) + strlen(host) + 1);
+    VDAgentPortForwardConnectMessage *msg = (VDAgentPortForwardConnectMessage *)&buf[0];
+    msg->id = id;
+    msg->port = port;
+    msg->ack_interval = ack_interval;
+    strcpy(msg->host, host);
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_CONNECT, msg, buf.size()));
+}
+
+static inline void client_data(PortForwarder &pf, uint32_t id, const void *data, uint32_t size)
+{
+    std::vector<uint8_t> buf(sizeof(VDAgentPortForwardDataMessage) + size);
+    VDAgentPortForwardDataMessage *msg = (VDAgentPortForwardDataMessage *)&buf[0];
+    msg->id = id;
+    msg->size = size;
+    memcpy(msg->data, data, size);
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_DATA, msg, buf.size()));
+}
+
+static inline void client_ack(PortForwarder &pf, uint32_t id, uint32_t size)
+{
+    VDAgentPortForwardAckMessage msg;
+    msg.id = id;
+    msg.size = size;
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_ACK, &msg, sizeof(msg)));
+}
+
+static inline void client_close(PortForwarder &pf, uint32_t id)
+{
+    VDAgentPortForwardCloseMessage msg;
+    msg.id = id;
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_CLOSE, &msg, sizeof(msg)));
+}
+
+static inline void client_shutdown(PortForwarder &pf, uint16_t port)
+{
+    VDAgentPortForwardShutdownMessage msg;
+    msg.port = port;
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_SHUTDOWN, &msg, sizeof(msg)));
+}
+
+// Accepts a connection on a forwarded port and returns its id, and the
+// interval at which the client has to ack its data
+static inline uint32_t accept_forwarded(TestSender &sender, uint16_t port, int *sock,
+                                        uint32_t *ack_interval = NULL)
+{
+    VDAgentPortForwardAcceptedMessage accepted;
+    *sock = tcp_connect(port);
+    SentMessage msg = sender.next(VD_AGENT_PORT_FORWARD_ACCEPTED);
+    memcpy(&accepted, &msg.data[0], sizeof(accepted));
+    CHECK(accepted.port == port);
+    if (ack_interval) {
+        *ack_interval = accepted.ack_interval;
+    }
+    return accepted.id;
+}
+
+static inline PortForwarder::Options test_options(int threads)
+{
+    PortForwarder::Options options;
+    options.threads = threads;
+    return options;
+}
+
+#endif // __PORT_FORWARD_UTIL_H
@@ -0,0 +1,590 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <deque>
+#include "chunk_transport.h"
+#include "chunked_buffer.h"
+#include "test_util.h"
+
+/*
+ * ChunkTransport over a socketpair, with FdStream standing in for the
+ * virtio-serial port: either the raw byte stream of a client is written to
+ * the other end, or another transport sends to it.
+ */
+
+struct Receiver : ChunkTransport::Handler {
+    std::vector<std::vector<uint8_t> > messages;
+    std::vector<uint32_t> ports;
+    int partial;
+    bool error;
+
+    Receiver() : partial(0), error(false) {}
+    void handle_message(VDAgentMessage *msg, uint32_t port) {
+        messages.push_back(std::vector<uint8_t>((uint8_t *)msg,
+                                                msg->data + msg->size));
+        ports.push_back(port);
+    }
+    void handle_partial_message(VDAgentMessage *msg) {
+        partial++;
+    }
+    void handle_transport_error() {
+        error = true;
+    }
+};
+
+static void check_received(const Receiver &receiver, const ChunkStream &sent)
+{
+    CHECK(!receiver.error);
+    CHECK(receiver.messages.size() == sent.messages.size());
+    for (size_t i = 0; i < sent.messages.size(); ++i) {
+        CHECK(receiver.ports[i] == sent.ports[i]);
+        CHECK(receiver.messages[i] == sent.messages[i]);
+    }
+}
+
+static void make_socketpair(int fds[2])
+{
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+// Writes the stream to fd in pieces of up to max_piece bytes, as the reader
+// takes them, until the receiver has all the messages or an error
+static void feed(int fd, const ChunkStream &sent, FdStream &stream, Receiver &receiver,
+                 size_t max_piece, TestRandom &random)
+{
+    double deadline = test_now() + 30;
+    size_t pos = 0;
+
+    while (receiver.messages.size() < sent.messages.size() && !receiver.error) {
+        if (pos < sent.bytes.size()) {
+            size_t n = std::min<size_t>(sent.bytes.size() - pos, 1 + random.below(max_piece));
+            ssize_t written = write(fd, &sent.bytes[pos], n);
+            CHECK(written > 0 || errno == EAGAIN);
+            if (written > 0) {
+                pos += written;
+            }
+        }
+        CHECK(stream.poll(pos < sent.bytes.size() ? 0 : 100));
+        CHECK(test_now() < deadline);
+    }
+}
+
+static void run_stream(const ChunkStream &sent, ChunkTransport::ReadMode mode,
+                       size_t max_piece, Receiver &receiver)
+{
+    TestRandom random(max_piece);
+    int fds[2];
+
+    make_socketpair(fds);
+    ChunkTransport transport(receiver, mode);
+    FdStream stream(transport, fds[1], fds[1]);
+    transport.set_stream(&stream);
+    CHECK(transport.start());
+    feed(fds[0], sent, stream, receiver, max_piece, random);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static const ChunkTransport::ReadMode modes[] = {
+    ChunkTransport::READ_EXACT,
+    ChunkTransport::READ_BATCHED,
+};
+
+// Single and multi-chunk messages on both ports, written in pieces that cut
+// headers and bodies everywhere
+static void test_framing()
+{
+    ChunkStream sent;
+    TestRandom random(1);
+
+    for (uint32_t i = 0; i < 300; ++i) {
+        uint32_t port = i % 5 == 0 ? VDP_SERVER_PORT : VDP_CLIENT_PORT;
+        uint32_t size = port == VDP_SERVER_PORT ? random.below(1000) : random.below(12000);
+        sent.message(port, VD_AGENT_CLIPBOARD, i, size);
+    }
+    // Too short to be a message, skipped
+    sent.chunk(VDP_CLIENT_PORT, "abc", 3);
+    sent.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 300, 0);
+    for (int m = 0; m < 2; ++m) {
+        for (size_t piece = 1; piece <= 65536; piece *= 16) {
+            Receiver receiver;
+            run_stream(sent, modes[m], piece, receiver);
+            check_received(receiver, sent);
+        }
+    }
+}
+
+// Many small chunks arrive in one read, and are all handled from it
+static void test_batching()
+{
+    ChunkStream sent;
+    Receiver receiver;
+
+    for (uint32_t i = 0; i < 20000; ++i) {
+        sent.message(i % 2 ? VDP_CLIENT_PORT : VDP_SERVER_PORT, VD_AGENT_PORT_FORWARD_ACK, i,
+                     8);
+    }
+    run_stream(sent, ChunkTransport::READ_BATCHED, 1 << 20, receiver);
+    check_received(receiver, sent);
+}
+
+// Big multi-chunk messages go into direct reads, server chunks in the middle
+// of them take the transport back to the batch buffer
+static void test_direct_reads()
+{
+    ChunkStream sent;
+    TestRandom random(2);
+
+    for (uint32_t i = 0; i < 12; ++i) {
+        uint32_t size = VD_DIRECT_READ_MIN - 100 + random.below(2000000);
+        sent.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, i, size, i % 3 ? 7 : 0);
+        sent.message(VDP_SERVER_PORT, VD_AGENT_REPLY, 100 + i, random.below(100));
+        sent.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 200 + i, random.below(3000));
+    }
+    for (int m = 0; m < 2; ++m) {
+        size_t pieces[] = {100, 5000, 1 << 20};
+        for (int p = 0; p < 3; ++p) {
+            Receiver receiver;
+            run_stream(sent, modes[m], pieces[p], receiver);
+            check_received(receiver, sent);
+            CHECK(receiver.partial > 0);
+        }
+    }
+}
+
+static void test_bad_chunks()
+{
+    for (int m = 0; m < 2; ++m) {
+        // A chunk above VD_AGENT_MAX_DATA_SIZE
+        ChunkStream sent;
+        std::vector<uint8_t> big(VD_AGENT_MAX_DATA_SIZE + 1);
+        sent.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 1, 10);
+        sent.chunk(VDP_CLIENT_PORT, &big[0], (uint32_t)big.size());
+        sent.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 2, 10);
+        Receiver receiver;
+        run_stream(sent, modes[m], 1 << 20, receiver);
+        CHECK(receiver.error);
+        CHECK(receiver.messages.size() == 1);
+
+        // A continuation chunk past the end of its message
+        ChunkStream over;
+        std::vector<uint8_t> msg = ChunkStream::make_message(VD_AGENT_CLIPBOARD, 3, 3000);
+        over.chunk(VDP_CLIENT_PORT, &msg[0], VD_AGENT_MAX_DATA_SIZE);
+        over.chunk(VDP_CLIENT_PORT, &msg[0], VD_AGENT_MAX_DATA_SIZE);
+        over.message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 4, 10);
+        Receiver overflow;
+        run_stream(over, modes[m], 1 << 20, overflow);
+        CHECK(overflow.error);
+        CHECK(overflow.messages.empty());
+    }
+}
+
+// A server chunk in the middle of a big message takes the transport back to
+// the batch buffer, and the continuation chunk that follows it is too big for
+// what is left of the message. It must be a stream error there too, not a
+// direct read past the end of the message.
+static void test_direct_overflow_after_server_chunk()
+{
+    static const uint32_t MSG_SIZE = 100000;
+    std::vector<uint8_t> msg = ChunkStream::make_message(VD_AGENT_CLIPBOARD, 5,
+                                                         MSG_SIZE - sizeof(VDAgentMessage));
+    ChunkStream sent;
+
+    for (uint32_t pos = 0; pos < MSG_SIZE - 10;) {
+        uint32_t n = std::min<uint32_t>(MSG_SIZE - 10 - pos, VD_AGENT_MAX_DATA_SIZE);
+        sent.chunk(VDP_CLIENT_PORT, &msg[pos], n);
+        pos += n;
+    }
+    sent.message(VDP_SERVER_PORT, VD_AGENT_REPLY, 6, 8);
+    // The header says 2048 bytes, 100 of them follow
+    VDIChunkHeader hdr;
+    hdr.port = VDP_CLIENT_PORT;
+    hdr.size = VD_AGENT_MAX_DATA_SIZE;
+    sent.bytes.insert(sent.bytes.end(), (uint8_t *)&hdr, (uint8_t *)(&hdr + 1));
+    sent.bytes.insert(sent.bytes.end(), msg.begin(), msg.begin() + 100);
+
+    Receiver receiver;
+    int fds[2];
+    make_socketpair(fds);
+    ChunkTransport transport(receiver, ChunkTransport::READ_BATCHED);
+    FdStream stream(transport, fds[1], fds[1]);
+    transport.set_stream(&stream);
+    CHECK(transport.start());
+    // All of it is there at once, so that the rest of the server chunk and
+    // the bad header come in the same batch
+    CHECK(write(fds[0], &sent.bytes[0], sent.bytes.size()) == (ssize_t)sent.bytes.size());
+    double deadline = test_now() + 2;
+    while (!receiver.error && test_now() < deadline) {
+        CHECK(stream.poll(10));
+    }
+    CHECK(receiver.error);
+    CHECK(receiver.messages.size() == 1 && receiver.ports[0] == VDP_SERVER_PORT);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Outgoing messages, with inline payload and external data, are split in
+// chunks that the receiving transport puts back together
+static int released;
+
+static void release_data(void *opaque)
+{
+    released++;
+    delete[] (uint8_t *)opaque;
+}
+
+static void test_send()
+{
+    Receiver sender_handler, receiver;
+    ChunkStream sent;
+    TestRandom random(3);
+    int fds[2];
+
+    make_socketpair(fds);
+    ChunkTransport sender(sender_handler), transport(receiver);
+    FdStream sender_stream(sender, fds[0], fds[0]), stream(transport, fds[1], fds[1]);
+    sender.set_stream(&sender_stream);
+    transport.set_stream(&stream);
+    CHECK(sender.start());
+    CHECK(transport.start());
+
+    int with_data = 0;
+    released = 0;
+    for (uint32_t i = 0; i < 2000; ++i) {
+        uint32_t inline_size = random.below(3000);
+        uint32_t data_size = i % 3 ? random.below(i % 50 ? 9000 : 300000) : 0;
+        std::vector<uint8_t> msg = ChunkStream::make_message(VD_AGENT_CLIPBOARD, i,
+                                                             inline_size + data_size);
+        VDIMessage *out = sender.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, inline_size);
+        out->hdr.msg.opaque = i;
+        memcpy(out->payload(), &msg[sizeof(VDAgentMessage)], inline_size);
+        if (data_size) {
+            uint8_t *data = new uint8_t[data_size];
+            memcpy(data, &msg[sizeof(VDAgentMessage) + inline_size], data_size);
+            out->set_data(data, data_size, release_data, data);
+            with_data++;
+        }
+        sender.enqueue_message(out);
+        sent.messages.push_back(msg);
+        sent.ports.push_back(msg.size() > VD_AGENT_MAX_DATA_SIZE ? 0 : VDP_CLIENT_PORT);
+        double deadline = test_now() + 30;
+        while (receiver.messages.size() < sent.messages.size()) {
+            CHECK(sender_stream.poll(0));
+            CHECK(stream.poll(0));
+            CHECK(test_now() < deadline);
+        }
+    }
+    check_received(receiver, sent);
+    CHECK(released == with_data);
+    CHECK(sender.queued_bytes(ChunkTransport::PRIO_CLIPBOARD) == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Data appended and read in pieces of any size, across the blocks
+static void test_chunked_buffer()
+{
+    ChunkedBuffer buffer;
+    std::deque<uint8_t> expected;
+    std::vector<uint8_t> piece;
+    TestRandom random(24);
+    size_t appended = 0;
+
+    for (int step = 0; step < 3000; ++step) {
+        size_t size = random.below(random.below(8) ? 3000 : 3 * ChunkedBuffer::BLOCK_SIZE);
+        piece.resize(size + 1);
+        if (random.below(2)) {
+            for (size_t i = 0; i < size; ++i) {
+                piece[i] = test_byte(1, appended + i);
+            }
+            CHECK(buffer.append(&piece[0], size));
+            expected.insert(expected.end(), piece.begin(), piece.begin() + size);
+            appended += size;
+        } else {
+            size_t n = buffer.read(&piece[0], size);
+            CHECK(n == std::min(size, expected.size()));
+            CHECK(std::equal(piece.begin(), piece.begin() + n, expected.begin()));
+            expected.erase(expected.begin(), expected.begin() + n);
+        }
+        CHECK(buffer.size() == expected.size());
+    }
+    piece.resize(expected.size() + 1);
+    CHECK(buffer.read(&piece[0], piece.size()) == expected.size());
+    CHECK(buffer.size() == 0);
+    CHECK(buffer.read(&piece[0], 1) == 0);
+}
+
+// External data that the transport reads from a source a slice at a time as
+// it writes the chunks, like a ChunkedBuffer or a clipboard bitmap. The
+// source is released once the message is written.
+struct TestSource {
+    uint32_t seed, start, pos, size;
+    bool released;
+};
+
+static uint32_t read_test_source(void *opaque, uint8_t *buf, uint32_t size)
+{
+    TestSource *source = (TestSource *)opaque;
+    CHECK(!source->released);
+    CHECK(size && size <= source->size - source->pos);
+    for (uint32_t i = 0; i < size; ++i) {
+        buf[i] = test_byte(source->seed, source->start + source->pos + i);
+    }
+    source->pos += size;
+    return size;
+}
+
+static void release_test_source(void *opaque)
+{
+    TestSource *source = (TestSource *)opaque;
+    CHECK(!source->released && source->pos == source->size);
+    source->released = true;
+}
+
+static void test_streamed()
+{
+    static const uint32_t SIZES[] = {1, 2047, ChunkedBuffer::BLOCK_SIZE - 1,
+                                     ChunkedBuffer::BLOCK_SIZE, ChunkedBuffer::BLOCK_SIZE + 1,
+                                     3 * ChunkedBuffer::BLOCK_SIZE + 17, 5 << 20};
+    Receiver sender_handler, receiver;
+    ChunkStream sent;
+    TestRandom random(24);
+    int fds[2];
+
+    make_socketpair(fds);
+    ChunkTransport sender(sender_handler), transport(receiver);
+    FdStream sender_stream(sender, fds[0], fds[0]), stream(transport, fds[1], fds[1]);
+    sender.set_stream(&sender_stream);
+    transport.set_stream(&stream);
+    CHECK(sender.start());
+    CHECK(transport.start());
+
+    uint32_t seed = 0;
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); ++s) {
+        for (int chunked = 0; chunked < 2; ++chunked) {
+            uint32_t inline_size = random.below(100);
+            uint32_t data_size = SIZES[s];
+            std::vector<uint8_t> msg = ChunkStream::make_message(VD_AGENT_CLIPBOARD, ++seed,
+                                                                 inline_size + data_size);
+            VDIMessage *out = sender.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD,
+                                                 inline_size);
+            out->hdr.msg.opaque = seed;
+            memcpy(out->payload(), &msg[sizeof(VDAgentMessage)], inline_size);
+            TestSource source = {seed, inline_size, 0, data_size, false};
+            if (chunked) {
+                // Appended in slices, like converted clipboard text
+                ChunkedBuffer *buffer = new ChunkedBuffer;
+                const uint8_t *data = &msg[sizeof(VDAgentMessage) + inline_size];
+                for (uint32_t pos = 0; pos < data_size; ) {
+                    uint32_t n = std::min(data_size - pos, 1 + random.below(100000));
+                    CHECK(buffer->append(data + pos, n));
+                    pos += n;
+                }
+                CHECK(buffer->size() == data_size);
+                buffer->attach(out);
+            } else {
+                out->set_source(data_size, read_test_source, release_test_source, &source);
+            }
+            sender.enqueue_message(out);
+            sent.messages.push_back(msg);
+            sent.ports.push_back(msg.size() > VD_AGENT_MAX_DATA_SIZE ? 0 : VDP_CLIENT_PORT);
+            double deadline = test_now() + 30;
+            while (receiver.messages.size() < sent.messages.size()) {
+                CHECK(sender_stream.poll(0));
+                CHECK(stream.poll(0));
+                CHECK(test_now() < deadline);
+            }
+            CHECK(chunked || source.released);
+        }
+    }
+    check_received(receiver, sent);
+    CHECK(sender.queued_bytes(ChunkTransport::PRIO_CLIPBOARD) == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Control and interactive messages go ahead of a backlog of bulk data. The
+// client takes whole messages, so they still wait for the message being
+// written and what is already in the socket.
+struct PriorityReceiver : ChunkTransport::Handler {
+    uint64_t bytes, reply_at, grab_at;
+    uint32_t last_data;
+    bool in_order;
+
+    PriorityReceiver() : bytes(0), reply_at(0), grab_at(0), last_data(0), in_order(true) {}
+    void handle_message(VDAgentMessage *msg, uint32_t port) {
+        bytes += msg->size;
+        if (msg->type == VD_AGENT_REPLY) {
+            reply_at = bytes;
+        } else if (msg->type == VD_AGENT_CLIPBOARD_GRAB) {
+            grab_at = bytes;
+        } else if (msg->type == VD_AGENT_PORT_FORWARD_DATA) {
+            uint32_t seq;
+            memcpy(&seq, msg->data, sizeof(seq));
+            in_order = in_order && seq == last_data + 1;
+            last_data = seq;
+        }
+    }
+    void handle_transport_error() {
+        CHECK(!"transport error");
+    }
+};
+
+static void test_priorities()
+{
+    static const uint32_t DATA_COUNT = 3000, CLIPBOARD_SIZE = 1 << 20;
+    static const uint64_t SOCKET_BYTES = 64 * 1024;
+    Receiver sender_handler;
+    PriorityReceiver receiver;
+    int fds[2], sndbuf = SOCKET_BYTES / 2;
+
+    make_socketpair(fds);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    ChunkTransport sender(sender_handler), transport(receiver);
+    FdStream sender_stream(sender, fds[0], fds[0]), stream(transport, fds[1], fds[1]);
+    sender.set_stream(&sender_stream);
+    transport.set_stream(&stream);
+    CHECK(sender.start());
+    CHECK(transport.start());
+
+    uint64_t total = 0;
+    for (uint32_t i = 1; i <= DATA_COUNT; ++i) {
+        VDIMessage *msg = sender.new_message(VDP_CLIENT_PORT, VD_AGENT_PORT_FORWARD_DATA, 2000);
+        memcpy(msg->payload(), &i, sizeof(i));
+        sender.enqueue_message(msg);
+        total += 2000;
+        if (i % 1000 == 0) {
+            sender.enqueue_message(sender.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD,
+                                                      CLIPBOARD_SIZE));
+            total += CLIPBOARD_SIZE;
+        }
+    }
+    for (int i = 0; i < 50; ++i) {
+        CHECK(sender_stream.poll(0));
+        CHECK(stream.poll(0));
+    }
+    uint64_t before = receiver.bytes;
+    sender.enqueue_message(sender.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD_GRAB, 8));
+    sender.enqueue_message(sender.new_message(VDP_CLIENT_PORT, VD_AGENT_REPLY, 8));
+    total += 16;
+    double deadline = test_now() + 30;
+    while (receiver.bytes < total) {
+        CHECK(sender_stream.poll(0));
+        CHECK(stream.poll(0));
+        CHECK(test_now() < deadline);
+    }
+    // The reply waits at most for the message being written, the grab for a
+    // round of the other classes too
+    CHECK(receiver.reply_at - before <= CLIPBOARD_SIZE + SOCKET_BYTES + 8);
+    CHECK(receiver.grab_at - before <= 2 * CLIPBOARD_SIZE + SOCKET_BYTES + 16);
+    CHECK(total - receiver.grab_at > 2 * CLIPBOARD_SIZE);
+    CHECK(receiver.in_order && receiver.last_data == DATA_COUNT);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Several threads enqueue at once, while the owner thread writes. Every
+// message arrives, and the messages of each thread in the order they were
+// enqueued.
+static const int PRODUCERS = 4;
+static const uint32_t PRODUCER_MESSAGES = 20000;
+
+struct OrderReceiver : ChunkTransport::Handler {
+    uint32_t last[PRODUCERS];
+    uint32_t count;
+    bool in_order;
+
+    OrderReceiver() : count(0), in_order(true) {
+        memset(last, 0, sizeof(last));
+    }
+    void handle_message(VDAgentMessage *msg, uint32_t port) {
+        uint32_t id[2];
+        memcpy(id, msg->data, sizeof(id));
+        in_order = in_order && id[0] < PRODUCERS && id[1] == last[id[0]] + 1;
+        last[id[0] % PRODUCERS] = id[1];
+        count++;
+    }
+    void handle_transport_error() {
+        CHECK(!"transport error");
+    }
+};
+
+struct Producer {
+    ChunkTransport *transport;
+    uint32_t id;
+};
+
+static void *produce(void *opaque)
+{
+    Producer *producer = (Producer *)opaque;
+
+    for (uint32_t i = 1; i <= PRODUCER_MESSAGES; ++i) {
+        uint32_t id[2] = {producer->id, i};
+        VDIMessage *msg = producer->transport->new_message(VDP_CLIENT_PORT,
+                                                           VD_AGENT_PORT_FORWARD_DATA,
+                                                           8 + i % 100);
+        memcpy(msg->payload(), id, sizeof(id));
+        producer->transport->enqueue_message(msg);
+    }
+    return NULL;
+}
+
+static void test_producers()
+{
+    Receiver sender_handler;
+    OrderReceiver receiver;
+    Producer producers[PRODUCERS];
+    pthread_t threads[PRODUCERS];
+    int fds[2];
+
+    make_socketpair(fds);
+    ChunkTransport sender(sender_handler), transport(receiver);
+    FdStream sender_stream(sender, fds[0], fds[0]), stream(transport, fds[1], fds[1]);
+    sender.set_stream(&sender_stream);
+    transport.set_stream(&stream);
+    CHECK(sender.start());
+    CHECK(transport.start());
+
+    for (int i = 0; i < PRODUCERS; ++i) {
+        producers[i].transport = &sender;
+        producers[i].id = i;
+        CHECK(pthread_create(&threads[i], NULL, produce, &producers[i]) == 0);
+    }
+    double deadline = test_now() + 60;
+    while (receiver.count < PRODUCERS * PRODUCER_MESSAGES) {
+        CHECK(sender_stream.poll(1));
+        CHECK(stream.poll(0));
+        CHECK(test_now() < deadline);
+    }
+    for (int i = 0; i < PRODUCERS; ++i) {
+        pthread_join(threads[i], NULL);
+        CHECK(receiver.last[i] == PRODUCER_MESSAGES);
+    }
+    CHECK(receiver.in_order);
+    CHECK(sender.queued_bytes(ChunkTransport::PRIO_PORT_FORWARD) == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main()
+{
+    RUN_TEST(test_framing);
+    RUN_TEST(test_batching);
+    RUN_TEST(test_direct_reads);
+    RUN_TEST(test_bad_chunks);
+    RUN_TEST(test_direct_overflow_after_server_chunk);
+    RUN_TEST(test_send);
+    RUN_TEST(test_chunked_buffer);
+    RUN_TEST(test_streamed);
+    RUN_TEST(test_priorities);
+    RUN_TEST(test_producers);
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+// ConnectionTable is private to the forwarder
+#include "port_forward.cpp"
+#include "test_util.h"
+
+/*
+ * The slot table of the connections of a shard, against a std::map of the
+ * connections that it should hold.
+ */
+
+typedef std::map<PortForwarder::conn_id_t, uint32_t> Reference;
+
+static void check_table(ConnectionTable &table, const Reference &ref)
+{
+    std::vector<Connection *> conns;
+    CHECK(table.size() == ref.size());
+    table.list(conns);
+    CHECK(conns.size() == ref.size());
+    for (size_t i = 0; i < conns.size(); ++i) {
+        Reference::const_iterator it = ref.find(conns[i]->id);
+        CHECK(it != ref.end() && conns[i]->ack_interval == it->second);
+    }
+}
+
+// Random adds, removes and lookups, in shard 2 of 3. Ids chosen by the client
+// may collide with the ids of accepted connections, and removed ids and
+// handles must not find anything.
+static void test_random()
+{
+    ConnectionTable table(2, 3);
+    Reference ref;
+    std::vector<PortForwarder::conn_id_t> stale_ids, stale_handles;
+    TestRandom random(16);
+
+    for (int step = 0; step < 400000; ++step) {
+        uint32_t op = random.below(10);
+        if (op < 4 || ref.empty()) {
+            Connection *conn;
+            if (op < 2) {
+                conn = table.add();
+                CHECK(conn);
+                CHECK((uint32_t)conn->id % 3 == 2);
+                CHECK(conn->id == conn->handle);
+                CHECK(!ref.count(conn->id));
+            } else {
+                PortForwarder::conn_id_t id = random.below(200000);
+                bool taken = ref.count(id) > 0;
+                conn = table.add(id);
+                CHECK(!conn == taken);
+                if (!conn) {
+                    continue;
+                }
+                CHECK(conn->id == id);
+            }
+            CHECK(table.find_handle(conn->handle) == conn);
+            conn->ack_interval = random.next();
+            ref[conn->id] = conn->ack_interval;
+        } else if (op < 7) {
+            Reference::iterator it = ref.lower_bound(random.below(200000));
+            if (it == ref.end()) {
+                it = ref.begin();
+            }
+            Connection *conn = table.find(it->first);
+            CHECK(conn);
+            stale_ids.push_back(conn->id);
+            stale_handles.push_back(conn->handle);
+            table.remove(*conn);
+            ref.erase(it);
+        } else {
+            for (int i = 0; i < 5; ++i) {
+                Reference::iterator it = ref.lower_bound(random.below(200000));
+                if (it == ref.end()) {
+                    it = ref.begin();
+                }
+                Connection *conn = table.find(it->first);
+                CHECK(conn && conn->id == it->first && conn->ack_interval == it->second);
+            }
+            if (!stale_ids.empty()) {
+                size_t i = random.below(stale_ids.size());
+                CHECK(!table.find(stale_ids[i]) == !ref.count(stale_ids[i]));
+                Connection *conn = table.find_handle(stale_handles[i]);
+                CHECK(!conn || conn->handle != stale_handles[i] || ref.count(conn->id));
+            }
+        }
+        CHECK(table.size() == ref.size());
+        if (step % 50000 == 0) {
+            check_table(table, ref);
+        }
+    }
+    check_table(table, ref);
+    table.clear();
+    CHECK(table.size() == 0);
+}
+
+// A closed connection keeps its slot until its operations complete, but
+// its id is free for the client once detached
+static void test_detach()
+{
+    ConnectionTable table(0, 1);
+    Connection *conn = table.add(1000);
+    CHECK(conn);
+    PortForwarder::conn_id_t handle = conn->handle;
+    conn->closed = true;
+    CHECK(!table.add(1000));
+    table.detach(*conn);
+    CHECK(!table.find(1000));
+    Connection *reused = table.add(1000);
+    CHECK(reused && reused != conn);
+    CHECK(table.find(1000) == reused);
+    CHECK(table.find_handle(handle) == conn);
+    table.remove(*conn);
+    CHECK(!table.find_handle(handle));
+    CHECK(table.find(1000) == reused);
+    CHECK(table.size() == 1);
+}
+
+int main()
+{
+    RUN_TEST(test_random);
+    RUN_TEST(test_detach);
+    return 0;
+}
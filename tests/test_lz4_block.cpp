@@ -0,0 +1,182 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include "lz4_block.h"
+#include "corpus.h"
+
+/*
+ * The LZ4 block codec: round trips of every kind of data, and blocks from
+ * the other end that are malformed or corrupted. Output buffers are followed
+ * by guard bytes that must not change.
+ */
+
+static const size_t GUARD_SIZE = 64;
+static const uint8_t GUARD = 0xa5;
+
+static size_t worst_case(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+static bool guard_intact(const std::vector<uint8_t> &buf, size_t capacity)
+{
+    for (size_t i = capacity; i < buf.size(); ++i) {
+        if (buf[i] != GUARD) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_round_trip(const uint8_t *data, size_t size)
+{
+    std::vector<uint8_t> block(worst_case(size) + GUARD_SIZE, GUARD);
+    std::vector<uint8_t> back(size + GUARD_SIZE, GUARD);
+    size_t compressed = lz4_compress_block(data, size, &block[0], worst_case(size));
+    CHECK(compressed > 0 && compressed <= worst_case(size));
+    CHECK(guard_intact(block, worst_case(size)));
+    CHECK(lz4_decompress_block(&block[0], compressed, &back[0], size) == (int)size);
+    CHECK(!size || !memcmp(&back[0], data, size));
+    CHECK(guard_intact(back, size));
+
+    // Too small for the block
+    if (size) {
+        CHECK(lz4_decompress_block(&block[0], compressed, &back[0], size - 1) == -1);
+        CHECK(guard_intact(back, size));
+    }
+}
+
+static void test_round_trip()
+{
+    static const size_t SIZES[] = {0, 1, 4, 5, 12, 13, 16, 63, 64, 255, 256, 2020, 4096,
+                                   65535};
+    for (int c = 0; c < CORPUS_COUNT; ++c) {
+        std::vector<uint8_t> data = make_corpus(CORPUS_NAMES[c], 1 << 20);
+        for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); ++s) {
+            for (size_t pos = 0; pos + SIZES[s] <= data.size(); pos += 65536 + 777) {
+                check_round_trip(&data[pos], SIZES[s]);
+            }
+        }
+    }
+    // Runs, which make overlapping matches
+    for (size_t run = 1; run <= 20; ++run) {
+        std::vector<uint8_t> data(30000);
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (uint8_t)(i % run);
+        }
+        check_round_trip(&data[0], data.size());
+    }
+    std::vector<uint8_t> big(LZ4_MAX_BLOCK_SIZE + 1);
+    std::vector<uint8_t> block(worst_case(big.size()));
+    CHECK(lz4_compress_block(&big[0], big.size(), &block[0], block.size()) == 0);
+}
+
+// Compression gives up instead of overflowing the output
+static void test_capacity()
+{
+    std::vector<uint8_t> data = make_corpus("random", 2020);
+    for (size_t capacity = 0; capacity < data.size() + 16; capacity += 7) {
+        std::vector<uint8_t> block(capacity + GUARD_SIZE, GUARD);
+        size_t compressed = lz4_compress_block(&data[0], data.size(), &block[0], capacity);
+        CHECK(compressed <= capacity);
+        CHECK(guard_intact(block, capacity));
+    }
+    data = make_corpus("json", 2020);
+    std::vector<uint8_t> block(data.size());
+    size_t compressed = lz4_compress_block(&data[0], data.size(), &block[0], block.size());
+    CHECK(compressed > 0 && compressed < data.size() / 2);
+    CHECK(lz4_compress_block(&data[0], data.size(), &block[0], compressed - 1) == 0);
+}
+
+static int decompress(const uint8_t *src, size_t size, std::vector<uint8_t> &out, size_t capacity)
+{
+    out.assign(capacity + GUARD_SIZE, GUARD);
+    int result = lz4_decompress_block(src, size, &out[0], capacity);
+    CHECK(guard_intact(out, capacity));
+    return result;
+}
+
+// Blocks written by hand
+static void test_blocks()
+{
+    std::vector<uint8_t> out;
+    // Literals only
+    static const uint8_t literals[] = {0x50, 'h', 'e', 'l', 'l', 'o'};
+    CHECK(decompress(literals, sizeof(literals), out, 5) == 5);
+    CHECK(!memcmp(&out[0], "hello", 5));
+    // "abcd", a match of 8 at offset 4, then literals
+    static const uint8_t match[] = {0x44, 'a', 'b', 'c', 'd', 4, 0, 0x50, 'x', 'y', 'z', 'z', 'y'};
+    CHECK(decompress(match, sizeof(match), out, 17) == 17);
+    CHECK(!memcmp(&out[0], "abcdabcdabcdxyzzy", 17));
+    // Literal length continued in a byte
+    std::vector<uint8_t> long_literals(1, 0xf0);
+    long_literals.push_back(20 - 15);
+    long_literals.insert(long_literals.end(), 20, 'q');
+    CHECK(decompress(&long_literals[0], long_literals.size(), out, 20) == 20);
+    CHECK(out[19] == 'q');
+}
+
+// Blocks that must be rejected without touching memory out of bounds
+static void test_malformed()
+{
+    std::vector<uint8_t> out;
+    // Offset 0
+    static const uint8_t zero_offset[] = {0x44, 'a', 'b', 'c', 'd', 0, 0, 0x50, 'x', 'y', 'z',
+                                          'z', 'y'};
+    CHECK(decompress(zero_offset, sizeof(zero_offset), out, 100) == -1);
+    // Offset before the start of the output
+    static const uint8_t far_offset[] = {0x44, 'a', 'b', 'c', 'd', 5, 0, 0x50, 'x', 'y', 'z',
+                                         'z', 'y'};
+    CHECK(decompress(far_offset, sizeof(far_offset), out, 100) == -1);
+    // More literals than the input has
+    static const uint8_t short_literals[] = {0x50, 'h', 'e'};
+    CHECK(decompress(short_literals, sizeof(short_literals), out, 100) == -1);
+    // A length that runs off the end of the input
+    static const uint8_t open_length[] = {0xf0, 255, 255};
+    CHECK(decompress(open_length, sizeof(open_length), out, 1000) == -1);
+    // A match that would overflow the output
+    static const uint8_t long_match[] = {0x4f, 'a', 'b', 'c', 'd', 4, 0, 200, 0x50, 'x', 'y',
+                                         'z', 'z', 'y'};
+    CHECK(decompress(long_match, sizeof(long_match), out, 100) == -1);
+    // A block that ends in the middle of a sequence
+    CHECK(decompress(long_match, 6, out, 100) == -1);
+}
+
+// Compressed blocks with bytes changed or cut short decompress to something
+// or fail, but stay in their buffers
+static void test_fuzz()
+{
+    TestRandom random(21);
+    for (int c = 0; c < CORPUS_COUNT; ++c) {
+        std::vector<uint8_t> data = make_corpus(CORPUS_NAMES[c], 1 << 18);
+        std::vector<uint8_t> block(worst_case(4096)), out;
+        for (int i = 0; i < 4000; ++i) {
+            size_t size = 1 + random.below(4096);
+            size_t pos = random.below(data.size() - size);
+            size_t compressed = lz4_compress_block(&data[pos], size, &block[0], block.size());
+            CHECK(compressed);
+            std::vector<uint8_t> bad(block.begin(), block.begin() + compressed);
+            int changes = 1 + random.below(4);
+            for (int j = 0; j < changes; ++j) {
+                bad[random.below(bad.size())] = (uint8_t)random.next();
+            }
+            if (random.below(4) == 0) {
+                bad.resize(random.below(bad.size()) + 1);
+            }
+            size_t capacity = random.below(2) ? size : random.below(size + 1);
+            int result = decompress(&bad[0], bad.size(), out, capacity);
+            CHECK(result == -1 || (result >= 0 && (size_t)result <= capacity));
+        }
+    }
+}
+
+int main()
+{
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_capacity);
+    RUN_TEST(test_blocks);
+    RUN_TEST(test_malformed);
+    RUN_TEST(test_fuzz);
+    return 0;
+}
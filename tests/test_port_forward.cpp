@@ -0,0 +1,785 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include "chunk_transport.h"
+#include "lz4_block.h"
+#include "corpus.h"
+#include "port_forward_util.h"
+
+/*
+ * PortForwarder on the epoll backend, with the client commands dispatched by
+ * the test and the guest side on loopback sockets.
+ */
+
+static double cpu_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void check_data(const SentMessage &msg, uint32_t id, const char *data)
+{
+    VDAgentPortForwardDataMessage *hdr = (VDAgentPortForwardDataMessage *)&msg.data[0];
+    CHECK(hdr->id == id);
+    CHECK(hdr->size == strlen(data));
+    CHECK(msg.data.size() == sizeof(*hdr) + hdr->size);
+    CHECK(!memcmp(hdr->data, data, hdr->size));
+}
+
+// A guest connection to a forwarded port, data both ways and closed by the
+// guest
+static void test_accept()
+{
+    TestSender sender;
+    char buf[16];
+    int sock;
+    {
+        PortForwarder pf(sender, test_options(2));
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        for (int i = 0; i < 4; ++i) {
+            uint32_t id = accept_forwarded(sender, port, &sock);
+            client_ack(pf, id, 4096);
+            CHECK(write(sock, "hello", 5) == 5);
+            check_data(sender.next(VD_AGENT_PORT_FORWARD_DATA), id, "hello");
+            client_data(pf, id, "world", 5);
+            CHECK(read(sock, buf, sizeof(buf)) == 5 && !memcmp(buf, "world", 5));
+            close(sock);
+            CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+        }
+        client_shutdown(pf, port);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// A connection that the client opens to a guest listener, and closes, and
+// connections that cannot be opened
+static void test_connect()
+{
+    TestSender sender;
+    uint16_t port;
+    int listener = tcp_listen(&port);
+    char buf[16];
+    {
+        PortForwarder pf(sender, test_options(2));
+        client_connect(pf, 1000, port, "127.0.0.1", 4096);
+        int sock = accept(listener, NULL, NULL);
+        CHECK(sock >= 0);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_ACK).id() == 1000);
+        CHECK(write(sock, "ping", 4) == 4);
+        check_data(sender.next(VD_AGENT_PORT_FORWARD_DATA), 1000, "ping");
+        // An id in use is refused with a CLOSE
+        client_connect(pf, 1000, port, "127.0.0.1", 4096);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == 1000);
+        client_data(pf, 1000, "pong", 4);
+        CHECK(read(sock, buf, sizeof(buf)) == 4 && !memcmp(buf, "pong", 4));
+        client_close(pf, 1000);
+        CHECK(read(sock, buf, sizeof(buf)) == 0);
+        close(sock);
+
+        // Nobody listens on the port any more
+        close(listener);
+        client_connect(pf, 1001, port, "127.0.0.1", 4096);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == 1001);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// A peer that resets a connection with no operation pending, before the
+// client is ready for its data, does not keep the I/O thread busy. The reset
+// is seen once reads are posted.
+static void test_idle_reset()
+{
+    TestSender sender;
+    int sock;
+    {
+        PortForwarder pf(sender, test_options(1));
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        uint32_t id = accept_forwarded(sender, port, &sock);
+        tcp_reset(sock);
+        double cpu = cpu_now();
+        CHECK(sender.quiet(0.3));
+        CHECK(cpu_now() - cpu < 0.1);
+        client_ack(pf, id, 4096);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// A connection that cannot post a read is closed instead of left hanging
+static void test_read_failure()
+{
+    TestSender sender;
+    int sock;
+    char buf[16];
+    {
+        PortForwarder pf(sender, test_options(1));
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        uint32_t id = accept_forwarded(sender, port, &sock);
+        sender.max_buffer = sizeof(VDAgentPortForwardCloseMessage);
+        client_ack(pf, id, 4096);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+        CHECK(read(sock, buf, sizeof(buf)) == 0);
+        close(sock);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// The next message of the type, skipping the others
+static SentMessage next_of_type(TestSender &sender, uint32_t type)
+{
+    SentMessage msg;
+    double deadline = test_now() + 5;
+    for (;;) {
+        while (!sender.poll(msg)) {
+            CHECK(test_now() < deadline);
+            usleep(100);
+        }
+        if (msg.type == type) {
+            return msg;
+        }
+    }
+}
+
+// Connections opened and closed in every way, many times over, leave no
+// buffer behind; nor does destroying the forwarder with reads pending.
+static void test_churn()
+{
+    static const int COUNT = 100000;
+    TestSender sender;
+    uint16_t connect_port;
+    int listener = tcp_listen(&connect_port);
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    {
+        PortForwarder pf(sender, test_options(2));
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        for (int i = 0; i < COUNT; ++i) {
+            int sock;
+            if (i % 10 == 9) {
+                // A CONNECT with a reused id, closed by the client right
+                // away or after the peer reset it
+                client_connect(pf, 7, connect_port, "127.0.0.1", 4096);
+                if (i % 20 == 19) {
+                    double deadline = test_now() + 5;
+                    while ((sock = accept(listener, NULL, NULL)) < 0) {
+                        CHECK(test_now() < deadline);
+                        usleep(100);
+                    }
+                    CHECK(next_of_type(sender, VD_AGENT_PORT_FORWARD_ACK).id() == 7);
+                    tcp_reset(sock);
+                }
+                client_close(pf, 7);
+                // The connect may have been made or not
+                while ((sock = accept(listener, NULL, NULL)) >= 0) {
+                    tcp_reset(sock);
+                }
+                continue;
+            }
+            sock = tcp_connect(port);
+            uint32_t id = next_of_type(sender, VD_AGENT_PORT_FORWARD_ACCEPTED).id();
+            client_ack(pf, id, 4096);
+            switch (i % 3) {
+            case 0:
+                // The client closes with reads pending
+                client_close(pf, id);
+                tcp_reset(sock);
+                break;
+            case 1:
+                tcp_reset(sock);
+                CHECK(next_of_type(sender, VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+                break;
+            case 2:
+                // Data for the client, then EOF
+                CHECK(write(sock, "abc", 3) == 3);
+                shutdown(sock, SHUT_WR);
+                CHECK(next_of_type(sender, VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+                tcp_reset(sock);
+                break;
+            }
+        }
+        // The last completions of the connections closed by the client
+        double deadline = test_now() + 5;
+        while (vd_atomic_load(&sender.buffers)) {
+            CHECK(test_now() < deadline);
+            usleep(1000);
+        }
+
+        std::vector<int> socks;
+        sender.clear();
+        for (int i = 0; i < 50; ++i) {
+            int sock;
+            client_ack(pf, accept_forwarded(sender, port, &sock), 4096);
+            socks.push_back(sock);
+        }
+        for (size_t i = 0; i < socks.size(); ++i) {
+            close(socks[i]);
+        }
+    }
+    close(listener);
+    CHECK(sender.buffers == 0);
+}
+
+// The sender of the agent: messages go through a ChunkTransport, and the
+// forwarder is told when the port forwarding class drains
+class TransportSender : public PortForwarder::Sender, public ChunkTransport::Handler {
+public:
+    ChunkTransport transport;
+    PortForwarder *pf;
+    volatile long buffers;
+
+    TransportSender() : transport(*this), pf(NULL), buffers(0) {}
+
+    void *get_buffer(size_t size) {
+        VDIMessage *msg = transport.new_message(VDP_CLIENT_PORT, 0, size);
+        if (!msg) {
+            return NULL;
+        }
+        vd_atomic_add(&buffers, 1);
+        return msg->payload();
+    }
+    void send(uint32_t type, size_t size, void *data) {
+        VDIMessage *msg = VDIMessage::from_payload(data);
+        if (size) {
+            msg->hdr.msg.type = type;
+            msg->inline_size = size;
+            msg->release = release;
+            msg->opaque = this;
+            transport.enqueue_message(msg);
+        } else {
+            transport.free_message(msg);
+            vd_atomic_add(&buffers, -1);
+        }
+    }
+    size_t queued_bytes() {
+        return transport.queued_bytes(ChunkTransport::PRIO_PORT_FORWARD);
+    }
+    void set_low_water(size_t bytes) {
+        transport.set_low_water(ChunkTransport::PRIO_PORT_FORWARD, bytes);
+    }
+
+    void handle_message(VDAgentMessage *msg, uint32_t port) {}
+    void handle_transport_error() {
+        CHECK(!"transport error");
+    }
+    void handle_queue_drained(int prio) {
+        if (prio == ChunkTransport::PRIO_PORT_FORWARD && pf) {
+            pf->transport_drained();
+        }
+    }
+
+private:
+    static void release(void *opaque) {
+        vd_atomic_add(&((TransportSender *)opaque)->buffers, -1);
+    }
+};
+
+static uint8_t stream_byte(uint64_t pos)
+{
+    return (uint8_t)(pos * 7 + pos / 251);
+}
+
+// The client end of the port, read at a limited rate. It checks the data of
+// each connection and ACKs it in steps of the ack interval.
+struct SlowClient {
+    static const uint32_t ACK_INTERVAL = 64 * 1024;
+    int fd;
+    double rate, start;
+    uint64_t read_bytes, data_bytes;
+    std::vector<uint8_t> buf;
+    std::map<uint32_t, uint64_t> received;
+
+    SlowClient(int fd, double rate)
+        : fd(fd), rate(rate), start(test_now()), read_bytes(0), data_bytes(0) {}
+
+    void pump(PortForwarder *pf) {
+        uint8_t tmp[16384];
+        double allowed = start + (test_now() - start) * rate - read_bytes;
+        ssize_t n = read(fd, tmp, std::min(sizeof(tmp), (size_t)std::max(allowed, 0.0)));
+        if (n <= 0) {
+            return;
+        }
+        read_bytes += n;
+        buf.insert(buf.end(), tmp, tmp + n);
+        size_t pos = 0;
+        while (buf.size() - pos >= sizeof(VDIChunkHeader)) {
+            VDIChunkHeader *chunk = (VDIChunkHeader *)&buf[pos];
+            if (buf.size() - pos < sizeof(*chunk) + chunk->size) {
+                break;
+            }
+            VDAgentMessage *msg = (VDAgentMessage *)(chunk + 1);
+            if (msg->type == VD_AGENT_PORT_FORWARD_ACCEPTED && pf) {
+                VDAgentPortForwardAcceptedMessage *accepted =
+                    (VDAgentPortForwardAcceptedMessage *)msg->data;
+                client_ack(*pf, accepted->id, ACK_INTERVAL);
+            } else if (msg->type == VD_AGENT_PORT_FORWARD_DATA) {
+                VDAgentPortForwardDataMessage *data = (VDAgentPortForwardDataMessage *)msg->data;
+                uint64_t &offset = received[data->id];
+                for (uint32_t i = 0; i < data->size; ++i) {
+                    CHECK(data->data[i] == stream_byte(offset + i));
+                }
+                uint64_t acks = (offset + data->size) / ACK_INTERVAL - offset / ACK_INTERVAL;
+                offset += data->size;
+                data_bytes += data->size;
+                for (uint64_t i = 0; pf && i < acks; ++i) {
+                    client_ack(*pf, data->id, ACK_INTERVAL);
+                }
+            }
+            pos += sizeof(*chunk) + chunk->size;
+        }
+        buf.erase(buf.begin(), buf.begin() + pos);
+    }
+};
+
+// Guests that write faster than the port is read fill the transport queue
+// only up to about the outbound budget, the reads in flight aside, and all
+// their data gets through in order
+static void test_backpressure()
+{
+    static const int CONNECTIONS = 16;
+    static const uint64_t CONNECTION_BYTES = 1 << 20;
+    static const size_t BUDGET = 1 << 20;
+    TransportSender sender;
+    int fds[2], size = 64 * 1024;
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    FdStream stream(sender.transport, fds[0], fds[0]);
+    sender.transport.set_stream(&stream);
+    CHECK(sender.transport.start());
+    SlowClient client(fds[1], 32 << 20);
+    size_t peak = 0;
+    {
+        PortForwarder::Options options = test_options(2);
+        options.outbound_budget = BUDGET;
+        PortForwarder pf(sender, options);
+        sender.pf = &pf;
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        std::vector<int> socks;
+        std::vector<uint64_t> written(CONNECTIONS);
+        for (int i = 0; i < CONNECTIONS; ++i) {
+            socks.push_back(tcp_connect(port));
+            fcntl(socks[i], F_SETFL, O_NONBLOCK);
+        }
+        uint64_t total = CONNECTIONS * CONNECTION_BYTES;
+        double deadline = test_now() + 20;
+        while (client.data_bytes < total) {
+            CHECK(test_now() < deadline);
+            for (int i = 0; i < CONNECTIONS; ++i) {
+                uint8_t data[16384];
+                size_t bytes = std::min<uint64_t>(sizeof(data), CONNECTION_BYTES - written[i]);
+                for (size_t j = 0; j < bytes; ++j) {
+                    data[j] = stream_byte(written[i] + j);
+                }
+                ssize_t n = bytes ? write(socks[i], data, bytes) : 0;
+                if (n > 0) {
+                    written[i] += n;
+                }
+            }
+            CHECK(stream.poll(1));
+            client.pump(&pf);
+            peak = std::max(peak, sender.queued_bytes());
+        }
+        CHECK(client.received.size() == CONNECTIONS);
+        for (int i = 0; i < CONNECTIONS; ++i) {
+            close(socks[i]);
+        }
+        // Let the CLOSEs go out
+        double end = test_now() + 0.2;
+        while (test_now() < end) {
+            CHECK(stream.poll(1));
+            client.pump(&pf);
+        }
+        sender.pf = NULL;
+    }
+    while (sender.queued_bytes()) {
+        CHECK(stream.poll(1));
+        client.pump(NULL);
+    }
+    CHECK(peak < 2 * BUDGET);
+    CHECK(sender.buffers == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Small records written at random intervals, batched by the forwarder, come
+// out whole and in order whether the guest or the client closes mid-stream
+static void test_batching()
+{
+    static const size_t RECORD_SIZE = 37;
+    TestSender sender;
+    TestRandom random(22);
+    {
+        PortForwarder::Options options = test_options(2);
+        options.batch_delay_us = 300;
+        options.batch_bytes = 1024;
+        PortForwarder pf(sender, options);
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        for (int round = 0; round < 40; ++round) {
+            int sock, one = 1;
+            uint32_t id = accept_forwarded(sender, port, &sock);
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            client_ack(pf, id, 1 << 20);
+            int records = 200 + random.below(300);
+            std::vector<uint8_t> expected;
+            for (int i = 0; i < records; ++i) {
+                uint8_t record[RECORD_SIZE];
+                for (size_t j = 0; j < RECORD_SIZE; ++j) {
+                    record[j] = (uint8_t)(i * RECORD_SIZE + j);
+                }
+                CHECK(write(sock, record, sizeof(record)) == sizeof(record));
+                expected.insert(expected.end(), record, record + sizeof(record));
+                struct timespec pause = {0, (long)random.below(40) * 1000};
+                nanosleep(&pause, NULL);
+            }
+            bool client_closes = round % 2;
+            if (client_closes) {
+                client_close(pf, id);
+            }
+            close(sock);
+
+            // Until the CLOSE for the guest, or until nothing else comes after
+            // the client closed
+            std::vector<uint8_t> received;
+            SentMessage msg;
+            double deadline = test_now() + 5;
+            for (;;) {
+                if (!sender.poll(msg)) {
+                    CHECK(test_now() < deadline);
+                    if (client_closes && sender.quiet(0.05)) {
+                        break;
+                    }
+                    usleep(100);
+                    continue;
+                }
+                if (msg.type == VD_AGENT_PORT_FORWARD_CLOSE) {
+                    CHECK(!client_closes && msg.id() == id);
+                    break;
+                }
+                CHECK(msg.type == VD_AGENT_PORT_FORWARD_DATA && msg.id() == id);
+                VDAgentPortForwardDataMessage *hdr = (VDAgentPortForwardDataMessage *)&msg.data[0];
+                received.insert(received.end(), hdr->data, hdr->data + hdr->size);
+            }
+            if (client_closes) {
+                CHECK(received.size() <= expected.size());
+                CHECK(std::equal(received.begin(), received.end(), expected.begin()));
+            } else {
+                CHECK(received == expected);
+            }
+        }
+        std::string metrics = pf.metrics();
+        CHECK(metrics.find(" batched_reads=0 ") == std::string::npos);
+        client_shutdown(pf, port);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// Writes data to a guest connection and returns what the client got of it,
+// compressed or not
+static std::vector<uint8_t> pump(PortForwarder &pf, TestSender &sender, int sock, uint32_t id,
+                                 const std::vector<uint8_t> &data, int *plain, int *compressed)
+{
+    std::vector<uint8_t> got;
+    size_t written = 0;
+    uint32_t unacked = 0;
+    double deadline = test_now() + 20;
+
+    *plain = *compressed = 0;
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    while (got.size() < data.size()) {
+        SentMessage msg;
+        CHECK(test_now() < deadline);
+        if (written < data.size()) {
+            ssize_t n = write(sock, &data[written], std::min<size_t>(65536, data.size() - written));
+            if (n > 0) {
+                written += n;
+            }
+        }
+        if (!sender.poll(msg)) {
+            continue;
+        }
+        uint32_t size;
+        if (msg.type == VD_AGENT_PORT_FORWARD_DATA) {
+            VDAgentPortForwardDataMessage *hdr = (VDAgentPortForwardDataMessage *)&msg.data[0];
+            CHECK(hdr->id == id && sizeof(*hdr) + hdr->size == msg.data.size());
+            got.insert(got.end(), hdr->data, hdr->data + hdr->size);
+            size = hdr->size;
+            (*plain)++;
+        } else {
+            CHECK(msg.type == VD_AGENT_PORT_FORWARD_DATA_COMPRESSED);
+            VDAgentPortForwardCompressedDataMessage *hdr =
+                (VDAgentPortForwardCompressedDataMessage *)&msg.data[0];
+            CHECK(hdr->id == id && sizeof(*hdr) + hdr->size == msg.data.size());
+            CHECK(hdr->size < hdr->original_size);
+            size_t pos = got.size();
+            got.resize(pos + hdr->original_size);
+            CHECK(lz4_decompress_block(hdr->data, hdr->size, &got[pos], hdr->original_size) ==
+                  (int)hdr->original_size);
+            size = hdr->original_size;
+            (*compressed)++;
+        }
+        // Windows count the original bytes
+        unacked += size;
+        if (unacked >= 65536) {
+            client_ack(pf, id, unacked);
+            unacked = 0;
+        }
+    }
+    if (unacked) {
+        client_ack(pf, id, unacked);
+    }
+    fcntl(sock, F_SETFL, 0);
+    return got;
+}
+
+static void client_compressed_data(PortForwarder &pf, uint32_t id, const uint8_t *data,
+                                   uint32_t size, uint32_t original_size)
+{
+    std::vector<uint8_t> buf(sizeof(VDAgentPortForwardCompressedDataMessage) + size);
+    VDAgentPortForwardCompressedDataMessage *msg =
+        (VDAgentPortForwardCompressedDataMessage *)&buf[0];
+    msg->id = id;
+    msg->size = size;
+    msg->original_size = original_size;
+    memcpy(msg->data, data, size);
+    CHECK(pf.dispatch(VD_AGENT_PORT_FORWARD_DATA_COMPRESSED, msg, buf.size()));
+}
+
+// Messages whose data does not fill them exactly, or too short for their
+// command, are refused before anything reads them
+static void test_bad_sizes()
+{
+    TestSender sender;
+    {
+        PortForwarder pf(sender, test_options(1));
+        pf.set_client_compression(true);
+        std::vector<uint8_t> buf(sizeof(VDAgentPortForwardCompressedDataMessage) + 16);
+        VDAgentPortForwardDataMessage *data = (VDAgentPortForwardDataMessage *)&buf[0];
+        data->id = 1;
+        data->size = 16;
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_DATA, data, sizeof(*data) + 15));
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_DATA, data, sizeof(*data) + 17));
+        data->size = 0xfffffff8;
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_DATA, data, sizeof(*data)));
+
+        VDAgentPortForwardCompressedDataMessage *compressed =
+            (VDAgentPortForwardCompressedDataMessage *)&buf[0];
+        compressed->id = 1;
+        compressed->size = 1 << 20;
+        compressed->original_size = 1 << 20;
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_DATA_COMPRESSED, compressed, buf.size()));
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_DATA_COMPRESSED, compressed,
+                           sizeof(*compressed) - 1));
+
+        VDAgentPortForwardAckMessage ack = {1, 100};
+        CHECK(!pf.dispatch(VD_AGENT_PORT_FORWARD_ACK, &ack, sizeof(ack) - 1));
+        CHECK(sender.quiet(0.05));
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// Data that compresses goes out compressed when the client supports it, and
+// data that does not goes as it is until it compresses again. Compressed
+// data from the client is written out, and a bad block closes the
+// connection.
+static void test_compression()
+{
+    TestSender sender;
+    std::vector<uint8_t> text = make_corpus("html", 1 << 20);
+    std::vector<uint8_t> random = make_corpus("random", 1 << 20);
+    std::vector<uint8_t> more_text(text.begin(), text.begin() + 400000);
+    {
+        PortForwarder pf(sender, test_options(2));
+        uint16_t port = free_port();
+        client_listen(pf, port, "127.0.0.1");
+        for (int supported = 0; supported < 2; ++supported) {
+            int plain, compressed, sock;
+            pf.set_client_compression(supported);
+            uint32_t id = accept_forwarded(sender, port, &sock);
+            client_ack(pf, id, 65536);
+
+            CHECK(pump(pf, sender, sock, id, text, &plain, &compressed) == text);
+            CHECK(supported ? compressed > plain : compressed == 0);
+            CHECK(pump(pf, sender, sock, id, random, &plain, &compressed) == random);
+            CHECK(compressed == 0);
+            CHECK(pump(pf, sender, sock, id, more_text, &plain, &compressed) == more_text);
+            CHECK(supported ? compressed > plain : compressed == 0);
+
+            std::vector<uint8_t> block(20000), back(20000);
+            uint32_t size = lz4_compress_block(&text[0], 20000, &block[0], block.size());
+            CHECK(size);
+            client_compressed_data(pf, id, &block[0], size, 20000);
+            for (size_t got = 0; got < back.size();) {
+                ssize_t n = read(sock, &back[got], back.size() - got);
+                CHECK(n > 0);
+                got += n;
+            }
+            CHECK(!memcmp(&back[0], &text[0], 20000));
+
+            client_compressed_data(pf, id, &block[0], size, 20001);
+            CHECK(sender.next(VD_AGENT_PORT_FORWARD_CLOSE).id() == id);
+            CHECK(read(sock, &back[0], 1) <= 0);
+            close(sock);
+        }
+    }
+    CHECK(sender.buffers == 0);
+}
+
+// Resolves slow.test and fast.test to the IPv4 loopback, the former after a
+// while, and does not find missing.test. Other names go to getaddrinfo().
+struct TestLookup : Resolver::Lookup {
+    volatile long calls;
+
+    TestLookup() : calls(0) {}
+    bool lookup(const std::string &host, bool passive, ResolvedAddress &addr) {
+        struct addrinfo hints, *result;
+        std::string name = host;
+
+        vd_atomic_add(&calls, 1);
+        if (host == "missing.test") {
+            return false;
+        }
+        if (host == "slow.test") {
+            usleep(300000);
+            name = "127.0.0.1";
+        } else if (host == "fast.test") {
+            name = "127.0.0.1";
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+        if (getaddrinfo(name.c_str(), NULL, &hints, &result)) {
+            return false;
+        }
+        addr.len = result->ai_addrlen;
+        memcpy(addr.storage, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        return true;
+    }
+};
+
+// Host names are resolved off the main thread, so a slow one delays neither
+// the dispatch of commands nor the other connections, and the data that the
+// client sends in the meantime is kept. Names that are not found close the
+// connection, and the ones found are cached.
+static void test_lookup()
+{
+    TestSender sender;
+    TestLookup *lookup = new TestLookup;
+    uint16_t port;
+    int listener = tcp_listen(&port);
+    int fast, slow;
+    char buf[16];
+    {
+        PortForwarder pf(sender, test_options(2), lookup);
+        double start = test_now();
+        client_connect(pf, 1001, port, "slow.test", 4096);
+        client_data(pf, 1001, "early", 5);
+        client_connect(pf, 1002, port, "fast.test", 4096);
+        client_connect(pf, 1003, port, "missing.test", 4096);
+        CHECK(test_now() - start < 0.1);
+
+        // The fast and missing hosts in any order, then the slow one
+        bool connected = false, closed = false;
+        double deadline = test_now() + 5;
+        for (int i = 0; i < 2; ++i) {
+            SentMessage msg;
+            while (!sender.poll(msg)) {
+                CHECK(test_now() < deadline);
+                usleep(100);
+            }
+            if (msg.type == VD_AGENT_PORT_FORWARD_ACK) {
+                CHECK(msg.id() == 1002);
+                connected = true;
+            } else {
+                CHECK(msg.type == VD_AGENT_PORT_FORWARD_CLOSE && msg.id() == 1003);
+                closed = true;
+            }
+        }
+        CHECK(connected && closed);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_ACK).id() == 1001);
+        fast = accept(listener, NULL, NULL);
+        slow = accept(listener, NULL, NULL);
+        CHECK(fast >= 0 && slow >= 0);
+        CHECK(read(slow, buf, sizeof(buf)) == 5 && !memcmp(buf, "early", 5));
+
+        long calls = lookup->calls;
+        client_connect(pf, 1004, port, "fast.test", 4096);
+        CHECK(sender.next(VD_AGENT_PORT_FORWARD_ACK).id() == 1004);
+        CHECK(lookup->calls == calls);
+        close(accept(listener, NULL, NULL));
+    }
+    close(fast);
+    close(slow);
+    close(listener);
+    CHECK(sender.buffers == 0);
+}
+
+// Listening to an IPv6 address, when the host has one
+static void test_listen_ipv6()
+{
+    TestSender sender;
+    sockaddr_in6 addr;
+    int sock = socket(AF_INET6, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_loopback;
+    if (sock < 0 || bind(sock, (sockaddr *)&addr, sizeof(addr))) {
+        printf("no IPv6 loopback, skipped\n");
+        if (sock >= 0) {
+            close(sock);
+        }
+        return;
+    }
+    close(sock);
+    {
+        PortForwarder pf(sender, test_options(1), new TestLookup);
+        uint16_t port = free_port();
+        client_listen(pf, port, "::1");
+        addr.sin6_port = htons(port);
+        double deadline = test_now() + 5;
+        for (;;) {
+            sock = socket(AF_INET6, SOCK_STREAM, 0);
+            if (!connect(sock, (sockaddr *)&addr, sizeof(addr))) {
+                break;
+            }
+            CHECK(errno == ECONNREFUSED && test_now() < deadline);
+            close(sock);
+            usleep(1000);
+        }
+        VDAgentPortForwardAcceptedMessage accepted;
+        SentMessage msg = sender.next(VD_AGENT_PORT_FORWARD_ACCEPTED);
+        memcpy(&accepted, &msg.data[0], sizeof(accepted));
+        CHECK(accepted.port == port);
+        close(sock);
+    }
+    CHECK(sender.buffers == 0);
+}
+
+int main()
+{
+    RUN_TEST(test_accept);
+    RUN_TEST(test_connect);
+    RUN_TEST(test_idle_reset);
+    RUN_TEST(test_read_failure);
+    RUN_TEST(test_churn);
+    RUN_TEST(test_batching);
+    RUN_TEST(test_backpressure);
+    RUN_TEST(test_compression);
+    RUN_TEST(test_bad_sizes);
+    RUN_TEST(test_lookup);
+    RUN_TEST(test_listen_ipv6);
+    return 0;
+}
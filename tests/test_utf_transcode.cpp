@@ -0,0 +1,452 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+// The scalar and vector converters are private to the transcoder
+#include "utf_transcode.cpp"
+#include <iconv.h>
+#include "test_util.h"
+
+/*
+ * Every converter the processor can run, against iconv for valid text and
+ * against a decoder written from Table 3-7 of the Unicode Standard, and the
+ * examples of its section 3.9, for invalid text. Inputs are exact-size heap
+ * copies at several alignments, so that reads and writes out of bounds show
+ * under a sanitizer, and are put after runs of ASCII of every length so that
+ * the vector code hands over to the scalar code at every position.
+ */
+
+struct Converter {
+    const char *name;
+    size_t (*to_utf8)(const uint16_t *src, size_t count, uint8_t *dst);
+    size_t (*to_utf16)(const uint8_t *src, size_t size, uint16_t *dst);
+};
+
+static std::vector<Converter> converters()
+{
+    std::vector<Converter> result;
+    Converter scalar = {"scalar", utf16_to_utf8_scalar, utf8_to_utf16_scalar};
+    result.push_back(scalar);
+#ifdef UTF_SSE2
+    if (simd_level() >= SIMD_SSE2) {
+        Converter sse2 = {"sse2", utf16_to_utf8_sse2, utf8_to_utf16_sse2};
+        result.push_back(sse2);
+    }
+#endif
+#ifdef UTF_AVX2
+    if (simd_level() >= SIMD_AVX2) {
+        Converter avx2 = {"avx2", utf16_to_utf8_avx2, utf8_to_utf16_avx2};
+        result.push_back(avx2);
+    }
+#endif
+    Converter dispatch = {"dispatch", utf16_to_utf8, utf8_to_utf16};
+    result.push_back(dispatch);
+    return result;
+}
+
+static const std::vector<Converter> CONVERTERS = converters();
+static const int ALIGNMENTS = 4;
+
+// Well-formed sequences follow Table 3-7; anything else is replaced by one
+// U+FFFD per maximal subpart
+static std::vector<uint32_t> reference_utf8(const uint8_t *src, size_t size)
+{
+    std::vector<uint32_t> out;
+    size_t i = 0;
+    while (i < size) {
+        uint8_t lead = src[i];
+        uint8_t low = 0x80, high = 0xbf;
+        size_t length;
+        uint32_t c;
+        if (lead < 0x80) {
+            out.push_back(lead);
+            i++;
+            continue;
+        } else if (lead >= 0xc2 && lead <= 0xdf) {
+            length = 2;
+            c = lead & 0x1f;
+        } else if (lead >= 0xe0 && lead <= 0xef) {
+            length = 3;
+            c = lead & 0x0f;
+            low = lead == 0xe0 ? 0xa0 : 0x80;
+            high = lead == 0xed ? 0x9f : 0xbf;
+        } else if (lead >= 0xf0 && lead <= 0xf4) {
+            length = 4;
+            c = lead & 0x07;
+            low = lead == 0xf0 ? 0x90 : 0x80;
+            high = lead == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            out.push_back(0xfffd);
+            i++;
+            continue;
+        }
+        size_t j = 1;
+        for (; j < length && i + j < size; ++j) {
+            uint8_t trail = src[i + j];
+            if (trail < (j == 1 ? low : 0x80) || trail > (j == 1 ? high : 0xbf)) {
+                break;
+            }
+            c = c << 6 | (trail & 0x3f);
+        }
+        out.push_back(j == length ? c : 0xfffd);
+        i += j;
+    }
+    return out;
+}
+
+// Pairs of surrogates; any other surrogate is replaced by U+FFFD
+static std::vector<uint32_t> reference_utf16(const uint16_t *src, size_t count)
+{
+    std::vector<uint32_t> out;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t c = src[i];
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < count && src[i + 1] >= 0xdc00 &&
+            src[i + 1] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (src[++i] - 0xdc00);
+        } else if (c >= 0xd800 && c < 0xe000) {
+            c = 0xfffd;
+        }
+        out.push_back(c);
+    }
+    return out;
+}
+
+static std::vector<uint8_t> encode_utf8(const std::vector<uint32_t> &chars)
+{
+    std::vector<uint8_t> out;
+    for (size_t i = 0; i < chars.size(); ++i) {
+        uint32_t c = chars[i];
+        if (c < 0x80) {
+            out.push_back(c);
+        } else if (c < 0x800) {
+            out.push_back(0xc0 | c >> 6);
+            out.push_back(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            out.push_back(0xe0 | c >> 12);
+            out.push_back(0x80 | (c >> 6 & 0x3f));
+            out.push_back(0x80 | (c & 0x3f));
+        } else {
+            out.push_back(0xf0 | c >> 18);
+            out.push_back(0x80 | (c >> 12 & 0x3f));
+            out.push_back(0x80 | (c >> 6 & 0x3f));
+            out.push_back(0x80 | (c & 0x3f));
+        }
+    }
+    return out;
+}
+
+static std::vector<uint16_t> encode_utf16(const std::vector<uint32_t> &chars)
+{
+    std::vector<uint16_t> out;
+    for (size_t i = 0; i < chars.size(); ++i) {
+        uint32_t c = chars[i];
+        if (c < 0x10000) {
+            out.push_back(c);
+        } else {
+            out.push_back(0xd800 | (c - 0x10000) >> 10);
+            out.push_back(0xdc00 | (c & 0x3ff));
+        }
+    }
+    return out;
+}
+
+// Converts with every converter at every alignment, into an output of
+// exactly the maximum size
+static void check_utf8(const std::vector<uint8_t> &in, const std::vector<uint16_t> &expected)
+{
+    for (size_t c = 0; c < CONVERTERS.size(); ++c) {
+        for (int offset = 0; offset < ALIGNMENTS; ++offset) {
+            uint8_t *raw = (uint8_t *)malloc(in.size() + offset);
+            uint8_t *src = raw + offset;
+            uint16_t *dst = (uint16_t *)malloc(UTF16_MAX_COUNT(in.size()) * 2);
+            if (!in.empty()) {
+                memcpy(src, &in[0], in.size());
+            }
+            size_t count = CONVERTERS[c].to_utf16(src, in.size(), dst);
+            if (count != expected.size() ||
+                (count && memcmp(dst, &expected[0], count * 2))) {
+                fprintf(stderr, "%s: UTF-8 of %u bytes at offset %d\n", CONVERTERS[c].name,
+                        (unsigned)in.size(), offset);
+                CHECK(false);
+            }
+            free(raw);
+            free(dst);
+        }
+    }
+}
+
+static void check_utf16(const std::vector<uint16_t> &in, const std::vector<uint8_t> &expected)
+{
+    for (size_t c = 0; c < CONVERTERS.size(); ++c) {
+        for (int offset = 0; offset < ALIGNMENTS; ++offset) {
+            uint8_t *raw = (uint8_t *)malloc((in.size() + offset) * 2);
+            uint16_t *src = (uint16_t *)raw + offset;
+            uint8_t *dst = (uint8_t *)malloc(UTF8_MAX_SIZE(in.size()));
+            if (!in.empty()) {
+                memcpy(src, &in[0], in.size() * 2);
+            }
+            size_t size = CONVERTERS[c].to_utf8(src, in.size(), dst);
+            if (size != expected.size() || (size && memcmp(dst, &expected[0], size))) {
+                fprintf(stderr, "%s: UTF-16 of %u units at offset %d\n", CONVERTERS[c].name,
+                        (unsigned)in.size(), offset);
+                CHECK(false);
+            }
+            free(raw);
+            free(dst);
+        }
+    }
+}
+
+static void check_utf8(const std::vector<uint8_t> &in)
+{
+    check_utf8(in, encode_utf16(reference_utf8(in.empty() ? NULL : &in[0], in.size())));
+}
+
+static void check_utf16(const std::vector<uint16_t> &in)
+{
+    check_utf16(in, encode_utf8(reference_utf16(in.empty() ? NULL : &in[0], in.size())));
+}
+
+// The examples of U+FFFD substitution in section 3.9, after every length of
+// ASCII up to past two AVX2 blocks
+static void test_unicode_examples()
+{
+    static const uint8_t EXAMPLES[][16] = {
+        // Table 3-8, and the non-shortest forms, surrogates, other ill-formed
+        // and truncated sequences after it
+        {0x61, 0xf1, 0x80, 0x80, 0xe1, 0x80, 0xc2, 0x62, 0x80, 0x63, 0x80, 0xbf, 0x64},
+        {0xc0, 0xaf, 0xe0, 0x80, 0xbf, 0xf0, 0x81, 0x82, 0x41},
+        {0xed, 0xa0, 0x80, 0xed, 0xbf, 0xbf, 0xed, 0xaf, 0x41},
+        {0xf4, 0x91, 0x92, 0x93, 0xff, 0x41, 0x80, 0xbf, 0x42},
+        {0xe1, 0x80, 0xe2, 0xf0, 0x91, 0x92, 0xf1, 0xbf, 0x41},
+    };
+    static const size_t SIZES[] = {13, 9, 9, 9, 9};
+    static const uint16_t EXPECTED[][16] = {
+        {0x61, 0xfffd, 0xfffd, 0xfffd, 0x62, 0xfffd, 0x63, 0xfffd, 0xfffd, 0x64},
+        {0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0x41},
+        {0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0x41},
+        {0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0x41, 0xfffd, 0xfffd, 0x42},
+        {0xfffd, 0xfffd, 0xfffd, 0xfffd, 0x41},
+    };
+    static const size_t COUNTS[] = {10, 9, 9, 9, 5};
+
+    for (size_t e = 0; e < sizeof(SIZES) / sizeof(SIZES[0]); ++e) {
+        for (size_t ascii = 0; ascii <= 70; ++ascii) {
+            for (int after = 0; after < 2; ++after) {
+                std::vector<uint8_t> in(ascii, 'x');
+                std::vector<uint16_t> expected(ascii, 'x');
+                in.insert(in.end(), EXAMPLES[e], EXAMPLES[e] + SIZES[e]);
+                expected.insert(expected.end(), EXPECTED[e], EXPECTED[e] + COUNTS[e]);
+                if (after) {
+                    in.insert(in.end(), 40, 'y');
+                    expected.insert(expected.end(), 40, 'y');
+                }
+                check_utf8(in, expected);
+                // The reference agrees with the standard
+                std::vector<uint32_t> chars = reference_utf8(&in[0], in.size());
+                CHECK(encode_utf16(chars) == expected);
+            }
+        }
+    }
+}
+
+// Truncated sequences and unpaired surrogates at the end of the input, after
+// every length of ASCII
+static void test_edges()
+{
+    static const uint8_t TAILS[][4] = {
+        {0xc3}, {0xe2, 0x82}, {0xf0, 0x9f, 0x98}, {0xe2}, {0xf0}, {0xf0, 0x9f},
+    };
+    static const size_t TAIL_SIZES[] = {1, 2, 3, 1, 1, 2};
+    static const uint16_t UNITS[][2] = {
+        {0xd800}, {0xdbff}, {0xdc00}, {0xdfff}, {0xdc00, 0xd800}, {0xd83d, 0xde00},
+    };
+    static const size_t UNIT_COUNTS[] = {1, 1, 1, 1, 2, 2};
+
+    for (size_t ascii = 0; ascii <= 70; ++ascii) {
+        for (size_t t = 0; t < sizeof(TAIL_SIZES) / sizeof(TAIL_SIZES[0]); ++t) {
+            std::vector<uint8_t> in(ascii, 'a');
+            in.insert(in.end(), TAILS[t], TAILS[t] + TAIL_SIZES[t]);
+            std::vector<uint16_t> expected(ascii, 'a');
+            expected.push_back(0xfffd);
+            check_utf8(in, expected);
+        }
+        for (size_t u = 0; u < sizeof(UNIT_COUNTS) / sizeof(UNIT_COUNTS[0]); ++u) {
+            std::vector<uint16_t> in(ascii, 'a');
+            in.insert(in.end(), UNITS[u], UNITS[u] + UNIT_COUNTS[u]);
+            check_utf16(in);
+            in.insert(in.end(), 33, 'b');
+            check_utf16(in);
+        }
+    }
+    check_utf8(std::vector<uint8_t>(), std::vector<uint16_t>());
+    check_utf16(std::vector<uint16_t>(), std::vector<uint8_t>());
+}
+
+// Characters from every range of lengths, with runs of ASCII of random
+// lengths, as the text of a clipboard
+static uint32_t random_char(TestRandom &random)
+{
+    static const uint32_t EDGES[] = {0x00, 0x7f, 0x80, 0x7ff, 0x800, 0xd7ff, 0xe000, 0xfffd,
+                                     0xffff, 0x10000, 0x10ffff};
+    switch (random.below(6)) {
+    case 0:
+        return EDGES[random.below(sizeof(EDGES) / sizeof(EDGES[0]))];
+    case 1:
+        return 0x80 + random.below(0x800 - 0x80);
+    case 2: {
+        uint32_t c = 0x800 + random.below(0x10000 - 0x800 - 0x800);
+        return c < 0xd800 ? c : c + 0x800;
+    }
+    case 3:
+        return 0x10000 + random.below(0x110000 - 0x10000);
+    default:
+        return random.below(0x80);
+    }
+}
+
+static std::vector<uint32_t> random_text(TestRandom &random, size_t max_chars)
+{
+    std::vector<uint32_t> chars;
+    size_t count = random.below(max_chars + 1);
+    while (chars.size() < count) {
+        if (random.below(2)) {
+            size_t run = random.below(80);
+            for (size_t i = 0; i < run; ++i) {
+                chars.push_back(0x20 + random.below(0x5f));
+            }
+        } else {
+            chars.push_back(random_char(random));
+        }
+    }
+    return chars;
+}
+
+static std::vector<uint8_t> iconv_convert(const char *to, const char *from,
+                                          const void *data, size_t size)
+{
+    iconv_t cd = iconv_open(to, from);
+    CHECK(cd != (iconv_t)-1);
+    std::vector<uint8_t> out(size * 2 + 16);
+    char *in = (char *)data, *outp = (char *)&out[0];
+    size_t in_left = size, out_left = out.size();
+    CHECK(iconv(cd, size ? &in : NULL, &in_left, &outp, &out_left) != (size_t)-1);
+    CHECK(in_left == 0);
+    iconv_close(cd);
+    out.resize(out.size() - out_left);
+    return out;
+}
+
+// Valid text converted both ways gives what iconv gives, and converts back
+// to itself
+static void test_valid()
+{
+    TestRandom random(25);
+    for (int i = 0; i < 4000; ++i) {
+        std::vector<uint32_t> chars = random_text(random, i % 10 ? 200 : 3000);
+        std::vector<uint8_t> utf8 = iconv_convert("UTF-8", "UTF-32LE",
+                                                  chars.empty() ? NULL : &chars[0],
+                                                  chars.size() * 4);
+        std::vector<uint8_t> bytes = iconv_convert("UTF-16LE", "UTF-32LE",
+                                                   chars.empty() ? NULL : &chars[0],
+                                                   chars.size() * 4);
+        std::vector<uint16_t> utf16(bytes.size() / 2);
+        if (!bytes.empty()) {
+            memcpy(&utf16[0], &bytes[0], bytes.size());
+        }
+        CHECK(encode_utf8(chars) == utf8);
+        CHECK(encode_utf16(chars) == utf16);
+        check_utf8(utf8, utf16);
+        check_utf16(utf16, utf8);
+    }
+}
+
+// Random damage to valid text: bytes and units inserted, changed and
+// removed, and the ill-formed sequences of each kind
+static void test_invalid()
+{
+    static const uint8_t BAD[][4] = {
+        {0xed, 0xa0, 0x80}, {0xc0, 0x80}, {0xe0, 0x80, 0x80}, {0xf4, 0x90, 0x80, 0x80},
+        {0xf0, 0x8f, 0xbf, 0xbf}, {0xf8}, {0xe2, 0x82}, {0xf0, 0x9f, 0x98}, {0xc1, 0xbf},
+    };
+    static const size_t BAD_SIZES[] = {3, 2, 3, 4, 4, 1, 2, 3, 2};
+    TestRandom random(3);
+
+    for (int i = 0; i < 6000; ++i) {
+        std::vector<uint32_t> chars = random_text(random, i % 10 ? 150 : 2000);
+        std::vector<uint8_t> utf8 = encode_utf8(chars);
+        std::vector<uint16_t> utf16 = encode_utf16(chars);
+        int changes = 1 + random.below(6);
+        for (int j = 0; j < changes; ++j) {
+            size_t pos = random.below(utf8.size() + 1);
+            switch (random.below(4)) {
+            case 0:
+                utf8.insert(utf8.begin() + pos, (uint8_t)random.next());
+                break;
+            case 1: {
+                size_t b = random.below(sizeof(BAD_SIZES) / sizeof(BAD_SIZES[0]));
+                utf8.insert(utf8.begin() + pos, BAD[b], BAD[b] + BAD_SIZES[b]);
+                break;
+            }
+            default:
+                if (pos < utf8.size()) {
+                    if (random.below(2)) {
+                        utf8[pos] = (uint8_t)random.next();
+                    } else {
+                        utf8.erase(utf8.begin() + pos);
+                    }
+                }
+            }
+            pos = random.below(utf16.size() + 1);
+            if (random.below(2)) {
+                utf16.insert(utf16.begin() + pos, 0xd800 + random.below(0x800));
+            } else if (pos < utf16.size()) {
+                utf16[pos] = random.below(3) ? 0xd800 + random.below(0x800) : random.next();
+            }
+        }
+        check_utf8(utf8);
+        check_utf16(utf16);
+
+        // What comes out is valid, and converts back to itself
+        std::vector<uint16_t> once(UTF16_MAX_COUNT(utf8.size()) + 1);
+        once.resize(utf8_to_utf16(utf8.empty() ? NULL : &utf8[0], utf8.size(), &once[0]));
+        std::vector<uint8_t> twice(UTF8_MAX_SIZE(once.size()) + 1);
+        twice.resize(utf16_to_utf8(once.empty() ? NULL : &once[0], once.size(), &twice[0]));
+        CHECK(encode_utf16(reference_utf8(twice.empty() ? NULL : &twice[0], twice.size())) ==
+              once);
+    }
+}
+
+// Any bytes and any units at all
+static void test_random()
+{
+    TestRandom random(8);
+    for (int i = 0; i < 3000; ++i) {
+        size_t size = random.below(i % 10 ? 300 : 5000);
+        std::vector<uint8_t> utf8(size);
+        std::vector<uint16_t> utf16(size);
+        int ascii = random.below(4) * 300;
+        for (size_t j = 0; j < size; ++j) {
+            bool plain = (int)random.below(1000) < ascii;
+            utf8[j] = plain ? random.below(0x80) : random.next();
+            utf16[j] = plain ? random.below(0x80) : random.next();
+        }
+        check_utf8(utf8);
+        check_utf16(utf16);
+    }
+}
+
+int main()
+{
+    printf("converters:");
+    for (size_t c = 0; c < CONVERTERS.size(); ++c) {
+        printf(" %s", CONVERTERS[c].name);
+    }
+    printf("\n");
+    RUN_TEST(test_unicode_examples);
+    RUN_TEST(test_edges);
+    RUN_TEST(test_valid);
+    RUN_TEST(test_invalid);
+    RUN_TEST(test_random);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __TEST_UTIL_H
+#define __TEST_UTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "vdcommon.h"
+
+/*
+ * Helpers of the tests of the portable parts of the agent. Every test is a
+ * program that runs its cases in order and aborts at the first failed check.
+ */
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        abort();                                                        \
+    }                                                                   \
+} while (0)
+
+#define RUN_TEST(test) do {                                             \
+    printf("%s\n", #test);                                              \
+    fflush(stdout);                                                     \
+    test();                                                             \
+} while (0)
+
+// Deterministic pseudo-random numbers, the same on every run
+class TestRandom {
+public:
+    TestRandom(uint32_t seed) : _state(seed * 2654435761u + 1) {}
+    uint32_t next() {
+        _state = _state * 1103515245u + 12345u;
+        return _state >> 8;
+    }
+    // In [0, n)
+    uint32_t below(uint32_t n) {
+        return (uint32_t)(((uint64_t)next() << 8 | (next() & 0xff)) % n);
+    }
+
+private:
+    uint32_t _state;
+};
+
+// The data of test messages, a function of the seed and the offset
+static inline uint8_t test_byte(uint32_t seed, size_t i)
+{
+    return (uint8_t)(seed * 31 + i * 7 + i / 251);
+}
+
+static inline double test_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * The byte stream that the client side of the VDI port sends: single chunks,
+ * or messages split in chunks of VD_AGENT_MAX_DATA_SIZE bytes. The messages
+ * that the transport is expected to report are kept, with the port it
+ * reports them on.
+ */
+class ChunkStream {
+public:
+    std::vector<uint8_t> bytes;
+    std::vector<std::vector<uint8_t> > messages;
+    std::vector<uint32_t> ports;
+
+    void chunk(uint32_t port, const void *data, uint32_t size) {
+        VDIChunkHeader hdr;
+        hdr.port = port;
+        hdr.size = size;
+        bytes.insert(bytes.end(), (const uint8_t *)&hdr, (const uint8_t *)(&hdr + 1));
+        bytes.insert(bytes.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    }
+
+    // The whole message, as it is reported
+    static std::vector<uint8_t> make_message(uint32_t type, uint32_t seed, uint32_t size) {
+        std::vector<uint8_t> msg(sizeof(VDAgentMessage) + size);
+        VDAgentMessage *hdr = (VDAgentMessage *)&msg[0];
+        hdr->protocol = VD_AGENT_PROTOCOL;
+        hdr->type = type;
+        hdr->opaque = seed;
+        hdr->size = size;
+        for (uint32_t i = 0; i < size; ++i) {
+            hdr->data[i] = test_byte(seed, i);
+        }
+        return msg;
+    }
+
+    // Chunks of server messages are put between the chunks of the message
+    // after every inject_every of them, if not 0
+    void message(uint32_t port, uint32_t type, uint32_t seed, uint32_t size,
+                 int inject_every = 0) {
+        std::vector<uint8_t> msg = make_message(type, seed, size);
+        std::vector<std::vector<uint8_t> > injected;
+        int count = 0;
+        for (size_t pos = 0; pos < msg.size(); count++) {
+            uint32_t n = (uint32_t)std::min<size_t>(msg.size() - pos, VD_AGENT_MAX_DATA_SIZE);
+            chunk(port, &msg[pos], n);
+            pos += n;
+            if (inject_every && count % inject_every == 0 && pos < msg.size()) {
+                std::vector<uint8_t> server = make_message(VD_AGENT_REPLY, seed + count,
+                                                           count % 300);
+                chunk(VDP_SERVER_PORT, &server[0], (uint32_t)server.size());
+                injected.push_back(server);
+            }
+        }
+        // Whole server messages are reported as soon as they are read, before
+        // the message they interrupt
+        for (size_t i = 0; i < injected.size(); ++i) {
+            messages.push_back(injected[i]);
+            ports.push_back(VDP_SERVER_PORT);
+        }
+        messages.push_back(msg);
+        ports.push_back(count > 1 ? 0 : port);
+    }
+};
+
+#endif // __TEST_UTIL_H
@@ -0,0 +1,117 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <string.h>
+#include "buffer_pool.h"
+
+BufferPool::BufferPool()
+    : _count(0)
+{
+    for (int i = 0; i <= MAX_CLASSES; ++i) {
+        _classes[i].size = 0;
+        _classes[i].max_free = 0;
+        _classes[i].free_count = 0;
+        _classes[i].free_list = NULL;
+        memset(&_classes[i].stats, 0, sizeof(Stats));
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    for (int i = 0; i < _count; ++i) {
+        while (_classes[i].free_list) {
+            BlockHeader *block = _classes[i].free_list;
+            _classes[i].free_list = block->next;
+            delete[] (uint8_t *)block;
+        }
+    }
+}
+
+void BufferPool::add_class(size_t size, uint32_t max_free)
+{
+    ASSERT(_count < MAX_CLASSES && (!_count || _classes[_count - 1].size < size));
+    _classes[_count].size = size;
+    _classes[_count].max_free = max_free;
+    _count++;
+}
+
+void BufferPool::update_in_use(Stats &stats, int delta)
+{
+    stats.in_use += delta;
+    if (stats.in_use > stats.high_water) {
+        stats.high_water = stats.in_use;
+    }
+}
+
+void *BufferPool::alloc(size_t size)
+{
+    int cls = 0;
+    while (cls < _count && _classes[cls].size < size) {
+        cls++;
+    }
+    SizeClass &sc = _classes[cls];
+    BlockHeader *block = NULL;
+    {
+        MutexLocker lock(sc.mutex);
+        sc.stats.allocs++;
+        update_in_use(sc.stats, 1);
+        if (sc.free_list) {
+            block = sc.free_list;
+            sc.free_list = block->next;
+            sc.free_count--;
+            sc.stats.hits++;
+        }
+    }
+    if (!block) {
+        block = (BlockHeader *)new uint8_t[sizeof(BlockHeader) + (cls < _count ? sc.size : size)];
+    }
+    block->cls = cls;
+    return block + 1;
+}
+
+void BufferPool::free(void *buffer)
+{
+    if (!buffer) {
+        return;
+    }
+    BlockHeader *block = (BlockHeader *)buffer - 1;
+    SizeClass &sc = _classes[block->cls];
+    {
+        MutexLocker lock(sc.mutex);
+        update_in_use(sc.stats, -1);
+        if (sc.free_count < sc.max_free) {
+            block->next = sc.free_list;
+            sc.free_list = block;
+            sc.free_count++;
+            return;
+        }
+    }
+    delete[] (uint8_t *)block;
+}
+
+BufferPool::Stats BufferPool::get_stats(int cls)
+{
+    ASSERT(cls >= 0 && cls <= _count);
+    MutexLocker lock(_classes[cls].mutex);
+    return _classes[cls].stats;
+}
+
+void BufferPool::log_stats(const char *name)
+{
+    for (int i = 0; i <= _count; ++i) {
+        Stats stats = get_stats(i);
+        if (!stats.allocs) {
+            continue;
+        }
+        if (i == _count) {
+            LOG(LOG_INFO, "%s pool, unpooled buffers: %lu allocations, %u in use, %u max",
+                name, (unsigned long)stats.allocs, stats.in_use, stats.high_water);
+        } else {
+            LOG(LOG_INFO, "%s pool, %lu byte buffers: %lu allocations, %lu%% reused, "
+                "%u in use, %u max", name, (unsigned long)_classes[i].size,
+                (unsigned long)stats.allocs, (unsigned long)(stats.hits * 100 / stats.allocs),
+                stats.in_use, stats.high_water);
+        }
+    }
+}
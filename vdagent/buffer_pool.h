@@ -0,0 +1,58 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include "vdcommon.h"
+
+/*
+ * Thread-safe pool of buffers grouped in size classes. Freed buffers are kept
+ * in a per-class free list, up to a maximum, and reused by later allocations
+ * of the same class. Requests bigger than the largest class go to the heap.
+ */
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t allocs;
+        uint64_t hits;
+        uint32_t in_use;
+        uint32_t high_water;
+    };
+    static const int MAX_CLASSES = 4;
+
+    BufferPool();
+    ~BufferPool();
+    // Classes are added in increasing size order, before any allocation
+    void add_class(size_t size, uint32_t max_free);
+    void *alloc(size_t size);
+    void free(void *buffer);
+    Stats get_stats(int cls);
+    void log_stats(const char *name);
+
+private:
+    union BlockHeader {
+        BlockHeader *next;
+        int cls;
+        uint64_t align;
+    };
+    struct SizeClass {
+        size_t size;
+        uint32_t max_free;
+        uint32_t free_count;
+        BlockHeader *free_list;
+        Stats stats;
+        mutex_t mutex;
+    };
+    // The last one holds the buffers that do not fit in any class
+    SizeClass _classes[MAX_CLASSES + 1];
+    int _count;
+
+    static void update_in_use(Stats &stats, int delta);
+    // no copy
+    BufferPool(const BufferPool&);
+    void operator=(const BufferPool&);
+};
+
+#endif // __BUFFER_POOL_H
@@ -0,0 +1,844 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#include "chunk_transport.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+ChunkTransport::ChunkTransport(Handler &handler, ReadMode read_mode)
+    : _handler(handler)
+    , _stream(NULL)
+    , _read_mode(read_mode)
+    , _read_pos(0)
+    , _read_end(0)
+    , _write_pos(0)
+    , _in_msg(NULL)
+    , _in_msg_pos(0)
+    , _in_msg_discard(false)
+    , _direct(false)
+    , _direct_in_body(false)
+    , _direct_have(0)
+    , _incoming(NULL)
+    , _queued(0)
+    , _queued_max(0)
+    , _sched_prio(PRIO_INTERACTIVE)
+    , _write_msg(NULL)
+{
+    memset(_read_buf, 0, sizeof(_read_buf));
+    memset(_sched_credit, 0, sizeof(_sched_credit));
+    memset(_sent, 0, sizeof(_sent));
+    memset((void *)_queued_bytes, 0, sizeof(_queued_bytes));
+    memset(_low_water, 0, sizeof(_low_water));
+    // Replies and small control messages, and full chunks (clipboard and
+    // port forwarding data)
+    _pool.add_class(sizeof(VDIMessage) + 64, 256);
+    _pool.add_class(sizeof(VDIMessage) + VD_AGENT_MAX_DATA_SIZE, 512);
+}
+
+ChunkTransport::~ChunkTransport()
+{
+    free_in_msg();
+    if (_write_msg) {
+        free_message(_write_msg);
+    }
+    take_incoming();
+    for (int prio = 0; prio < PRIO_COUNT; ++prio) {
+        while (!_message_queue[prio].empty()) {
+            free_message(_message_queue[prio].front());
+            _message_queue[prio].pop();
+        }
+    }
+}
+
+bool ChunkTransport::start()
+{
+    _read_pos = _read_end = 0;
+    if (_read_mode == READ_BATCHED) {
+        return _stream->post_read(_read_buf, sizeof(_read_buf));
+    }
+    return _stream->post_read(_read_buf, sizeof(VDIChunk));
+}
+
+void ChunkTransport::stream_error()
+{
+    _handler.handle_transport_error();
+}
+
+void ChunkTransport::read_done(size_t bytes)
+{
+    if (_direct) {
+        read_direct_done(bytes);
+    } else if (_read_mode == READ_BATCHED) {
+        read_batch_done(bytes);
+    } else {
+        read_chunk_done(bytes);
+    }
+}
+
+void ChunkTransport::read_chunk_done(size_t bytes)
+{
+    VDIChunk* chunk = (VDIChunk*)_read_buf;
+    size_t count;
+
+    _read_pos += bytes;
+    if (_read_pos < sizeof(VDIChunk)) {
+        count = sizeof(VDIChunk) - _read_pos;
+    } else if (_read_pos == sizeof(VDIChunk) && chunk->hdr.size) {
+        count = chunk->hdr.size;
+        if (_read_pos + count > VD_READ_BUF_SIZE) {
+            vd_printf("chunk is too large, size %u port %u", chunk->hdr.size, chunk->hdr.port);
+            _handler.handle_transport_error();
+            return;
+        }
+    } else if (_read_pos == sizeof(VDIChunk) + chunk->hdr.size) {
+        if (!handle_chunk(chunk)) {
+            return;
+        }
+        count = sizeof(VDIChunk);
+        _read_pos = 0;
+    } else {
+        ASSERT(_read_pos < sizeof(VDIChunk) + chunk->hdr.size);
+        count = sizeof(VDIChunk) + chunk->hdr.size - _read_pos;
+    }
+
+    if (!_stream->post_read(_read_buf + _read_pos, count)) {
+        _handler.handle_transport_error();
+    }
+}
+
+// Chunks are handled in place, the buffer is only compacted when the partial
+// chunk at its end would not fit in the remaining space.
+void ChunkTransport::read_batch_done(size_t bytes)
+{
+    _read_end += bytes;
+    while (_read_end - _read_pos >= sizeof(VDIChunk)) {
+        VDIChunk* chunk = (VDIChunk*)(_read_buf + _read_pos);
+        if (chunk->hdr.size > VD_AGENT_MAX_DATA_SIZE) {
+            vd_printf("chunk is too large, size %u port %u", chunk->hdr.size, chunk->hdr.port);
+            _handler.handle_transport_error();
+            return;
+        }
+        size_t chunk_size = sizeof(VDIChunk) + chunk->hdr.size;
+        if (_read_end - _read_pos < chunk_size) {
+            break;
+        }
+        if (!handle_chunk(chunk)) {
+            return;
+        }
+        _read_pos += chunk_size;
+    }
+
+    if (start_direct_read()) {
+        return;
+    }
+    if (_read_pos == _read_end) {
+        _read_pos = _read_end = 0;
+    } else if (sizeof(_read_buf) - _read_pos < VD_READ_BUF_SIZE) {
+        memmove(_read_buf, _read_buf + _read_pos, _read_end - _read_pos);
+        _read_end -= _read_pos;
+        _read_pos = 0;
+    }
+    if (!_stream->post_read(_read_buf + _read_end, sizeof(_read_buf) - _read_end)) {
+        _handler.handle_transport_error();
+    }
+}
+
+// Moves what is left in the batch buffer, the beginning of the next chunk,
+// into the message being assembled and continues reading there. Returns false
+// when reading goes on in the batch buffer instead; a chunk header that does
+// not fit the message is a stream error, like in read_direct_done().
+bool ChunkTransport::start_direct_read()
+{
+    size_t left = _read_end - _read_pos;
+    uint8_t *pos = (uint8_t *)_in_msg + _in_msg_pos;
+
+    if (!_in_msg || sizeof(VDAgentMessage) + _in_msg->size < VD_DIRECT_READ_MIN) {
+        return false;
+    }
+    if (left >= sizeof(VDIChunk)) {
+        memcpy(&_direct_hdr, _read_buf + _read_pos, sizeof(VDIChunk));
+        // Only continuation chunks, other ports keep going through the buffer
+        if (_direct_hdr.port == VDP_SERVER_PORT) {
+            return false;
+        }
+        if (_in_msg_pos + _direct_hdr.size > sizeof(VDAgentMessage) + _in_msg->size) {
+            vd_printf("chunk overflows message, size %u port %u", _direct_hdr.size,
+                      _direct_hdr.port);
+            _handler.handle_transport_error();
+            return true;
+        }
+        _direct_in_body = true;
+        _direct_have = left - sizeof(VDIChunk);
+        memcpy(pos, _read_buf + _read_pos + sizeof(VDIChunk), _direct_have);
+    } else {
+        _direct_in_body = false;
+        _direct_have = left;
+        memcpy(pos, _read_buf + _read_pos, left);
+    }
+    _read_pos = _read_end = 0;
+    _direct = true;
+    return post_direct_read();
+}
+
+bool ChunkTransport::post_direct_read()
+{
+    uint32_t msg_size = sizeof(VDAgentMessage) + _in_msg->size;
+    uint8_t *pos = (uint8_t *)_in_msg + _in_msg_pos;
+    size_t count;
+
+    if (!_direct_in_body) {
+        count = sizeof(VDIChunk) - _direct_have;
+    } else {
+        count = _direct_hdr.size - _direct_have;
+        // Take the header of the next chunk too, unless this is the last one.
+        // It lands where the next body goes and is moved away before that.
+        if (_in_msg_pos + _direct_hdr.size < msg_size) {
+            count += sizeof(VDIChunk);
+        }
+    }
+    if (!_stream->post_read(pos + _direct_have, count)) {
+        _handler.handle_transport_error();
+    }
+    return true;
+}
+
+void ChunkTransport::read_direct_done(size_t bytes)
+{
+    uint32_t msg_size = sizeof(VDAgentMessage) + _in_msg->size;
+    uint8_t *pos = (uint8_t *)_in_msg + _in_msg_pos;
+
+    _direct_have += bytes;
+    for (;;) {
+        if (!_direct_in_body) {
+            if (_direct_have < sizeof(VDIChunk)) {
+                break;
+            }
+            memcpy(&_direct_hdr, pos, sizeof(VDIChunk));
+            if (_direct_hdr.port == VDP_SERVER_PORT) {
+                // Back to the batch buffer, with the header read so far
+                memcpy(_read_buf, pos, _direct_have);
+                _read_pos = 0;
+                _read_end = _direct_have;
+                _direct = false;
+                read_batch_done(0);
+                return;
+            }
+            if (_direct_hdr.size > VD_AGENT_MAX_DATA_SIZE ||
+                    _in_msg_pos + _direct_hdr.size > msg_size) {
+                vd_printf("chunk overflows message, size %u port %u", _direct_hdr.size,
+                          _direct_hdr.port);
+                _handler.handle_transport_error();
+                return;
+            }
+            _direct_in_body = true;
+            _direct_have -= sizeof(VDIChunk);
+        }
+        if (_direct_have < _direct_hdr.size) {
+            break;
+        }
+        _in_msg_pos += _direct_hdr.size;
+        _direct_have -= _direct_hdr.size;
+        _direct_in_body = false;
+        pos = (uint8_t *)_in_msg + _in_msg_pos;
+        if (_in_msg_pos == msg_size) {
+            // Whatever followed the message goes back to the batch buffer
+            memcpy(_read_buf, pos, _direct_have);
+            _read_pos = 0;
+            _read_end = _direct_have;
+            _direct = false;
+            finish_in_msg();
+            read_batch_done(0);
+            return;
+        }
+        if (!_in_msg_discard) {
+            _handler.handle_partial_message(_in_msg);
+        }
+    }
+    post_direct_read();
+}
+
+// Returns false when the stream is no longer usable
+bool ChunkTransport::handle_chunk(VDIChunk* chunk)
+{
+    //FIXME: currently assumes that multi-part msg arrives only from client port
+    if (_in_msg_pos == 0 || chunk->hdr.port == VDP_SERVER_PORT) {
+        if (chunk->hdr.size < sizeof(VDAgentMessage)) {
+            return true;
+        }
+        VDAgentMessage* msg = (VDAgentMessage*)chunk->data;
+        if (msg->protocol != VD_AGENT_PROTOCOL) {
+            vd_printf("Invalid protocol %u", msg->protocol);
+            _handler.handle_transport_error();
+            return false;
+        }
+        uint32_t msg_size = sizeof(VDAgentMessage) + msg->size;
+        if (chunk->hdr.size == msg_size) {
+            _handler.handle_message(msg, chunk->hdr.port);
+        } else {
+            ASSERT(chunk->hdr.size < msg_size);
+            // Room for the chunk header that direct reads may take after it
+            _in_msg = (VDAgentMessage*)new uint8_t[msg_size + sizeof(VDIChunk)];
+            memcpy(_in_msg, chunk->data, chunk->hdr.size);
+            _in_msg_pos = chunk->hdr.size;
+        }
+    } else {
+        if (_in_msg_pos + chunk->hdr.size > sizeof(VDAgentMessage) + _in_msg->size) {
+            vd_printf("chunk overflows message, size %u port %u", chunk->hdr.size,
+                      chunk->hdr.port);
+            _handler.handle_transport_error();
+            return false;
+        }
+        memcpy((uint8_t*)_in_msg + _in_msg_pos, chunk->data, chunk->hdr.size);
+        _in_msg_pos += chunk->hdr.size;
+        if (_in_msg_pos == sizeof(VDAgentMessage) + _in_msg->size) {
+            finish_in_msg();
+        } else if (!_in_msg_discard) {
+            _handler.handle_partial_message(_in_msg);
+        }
+    }
+    return true;
+}
+
+void ChunkTransport::finish_in_msg()
+{
+    if (!_in_msg_discard) {
+        _handler.handle_message(_in_msg, 0);
+    }
+    free_in_msg();
+}
+
+void ChunkTransport::free_in_msg()
+{
+    _in_msg_pos = 0;
+    _in_msg_discard = false;
+    delete[] (uint8_t *)_in_msg;
+    _in_msg = NULL;
+}
+
+// A direct read may be pending on the message buffer, so it is kept until the
+// message is complete and then dropped.
+void ChunkTransport::reset_in_msg()
+{
+    if (_direct) {
+        _in_msg_discard = true;
+    } else {
+        free_in_msg();
+    }
+}
+
+void ChunkTransport::write_done(size_t bytes)
+{
+    ASSERT(_write_msg);
+    _write_pos += bytes;
+    write_next();
+}
+
+void ChunkTransport::write_next()
+{
+    VDIMessage* msg = _write_msg;
+    VDIOVec iov[MAX_IOV];
+    int count;
+
+    if (_write_pos == sizeof(VDIChunkHeader) + msg->hdr.chunk.size) {
+        msg->pos += msg->hdr.chunk.size;
+        _write_pos = 0;
+        if (msg->pos == msg->size()) {
+            message_written(msg);
+            _write_msg = msg = dequeue_message();
+            if (!msg) {
+                return;
+            }
+        }
+    }
+    if (_write_pos == 0) {
+        msg->hdr.chunk.size = MIN(msg->size() - msg->pos, VD_AGENT_MAX_DATA_SIZE);
+        if (msg->read) {
+            read_source(msg);
+        }
+    }
+    count = get_chunk_iov(msg, _write_pos, iov);
+    if (!_stream->post_write(iov, count)) {
+        _handler.handle_transport_error();
+    }
+}
+
+// Reads the slice of streamed data of the current chunk of msg, if it has
+// one. A source that comes short is padded with zeros, the size of the
+// message is already on the wire.
+void ChunkTransport::read_source(VDIMessage *msg)
+{
+    uint32_t head_size = sizeof(VDAgentMessage) + msg->inline_size;
+    uint32_t end = msg->pos + msg->hdr.chunk.size;
+    if (end <= head_size) {
+        return;
+    }
+    uint32_t from = MAX(msg->pos, head_size) - head_size;
+    uint32_t size = end - head_size - from;
+    if (msg->data == _source_buf && msg->data_pos == from) {
+        // Already read, the last write took no bytes
+        return;
+    }
+    uint32_t got = msg->read(msg->opaque, _source_buf, size);
+    if (got < size) {
+        vd_printf("Message source of type %u ended at %u of %u bytes", msg->hdr.msg.type,
+                  from + got, msg->data_size);
+        memset(_source_buf + got, 0, size - got);
+    }
+    msg->data = _source_buf;
+    msg->data_pos = from;
+}
+
+// Describes the current chunk of msg, minus the skip bytes already written:
+// its header, then the slice of the message header and inline payload, then
+// the slice of the external data.
+int ChunkTransport::get_chunk_iov(VDIMessage *msg, size_t skip, VDIOVec *iov)
+{
+    const uint8_t *head = (const uint8_t *)&msg->hdr.msg;
+    uint32_t head_size = sizeof(VDAgentMessage) + msg->inline_size;
+    uint32_t start = msg->pos;
+    uint32_t end = msg->pos + msg->hdr.chunk.size;
+    int count = 1;
+    int first = 0;
+
+    iov[0].base = &msg->hdr.chunk;
+    iov[0].len = sizeof(VDIChunkHeader);
+    if (start < head_size) {
+        if (start == 0) {
+            // The message header follows the chunk header in memory
+            iov[0].len += MIN(end, head_size);
+        } else {
+            iov[count].base = head + start;
+            iov[count++].len = MIN(end, head_size) - start;
+        }
+    }
+    if (end > head_size) {
+        uint32_t from = MAX(start, head_size);
+        iov[count].base = msg->data + from - head_size - msg->data_pos;
+        iov[count++].len = end - from;
+    }
+
+    while (skip >= iov[first].len) {
+        skip -= iov[first++].len;
+    }
+    iov[first].base = (const uint8_t *)iov[first].base + skip;
+    iov[first].len -= skip;
+    for (int i = first; i < count; ++i) {
+        iov[i - first] = iov[i];
+    }
+    return count - first;
+}
+
+VDIMessage* ChunkTransport::new_message(uint32_t port, uint32_t type, uint32_t size)
+{
+    VDIMessage* msg = (VDIMessage*)_pool.alloc(sizeof(VDIMessage) + size);
+
+    msg->set_data(NULL, 0);
+    msg->inline_size = size;
+    msg->pos = 0;
+    msg->hdr.chunk.port = port;
+    msg->hdr.chunk.size = 0;
+    msg->hdr.msg.protocol = VD_AGENT_PROTOCOL;
+    msg->hdr.msg.type = type;
+    msg->hdr.msg.opaque = 0;
+    msg->hdr.msg.size = size;
+    return msg;
+}
+
+// Releases a message once it is written, and tells the handler when that
+// drains its class. Messages are enqueued from other threads meanwhile, so
+// the count may cross the mark again right after.
+void ChunkTransport::message_written(VDIMessage* msg)
+{
+    Priority prio = message_priority(msg->hdr.msg.type);
+    long size = msg->size();
+    size_t queued = (size_t)vd_atomic_add(&_queued_bytes[prio], -size);
+    free_message(msg);
+    if (_low_water[prio] && queued <= _low_water[prio] && queued + size > _low_water[prio]) {
+        _handler.handle_queue_drained(prio);
+    }
+}
+
+void ChunkTransport::free_message(VDIMessage* msg)
+{
+    if (msg->release) {
+        msg->release(msg->opaque);
+    }
+    _pool.free(msg);
+}
+
+void ChunkTransport::log_stats()
+{
+    _pool.log_stats("Message");
+    vd_printf("Outgoing messages: %llu control, %llu interactive, %llu clipboard, "
+              "%llu file xfer, %llu port forwarding; at most %lu queued",
+              (unsigned long long)_sent[PRIO_CONTROL],
+              (unsigned long long)_sent[PRIO_INTERACTIVE],
+              (unsigned long long)_sent[PRIO_CLIPBOARD],
+              (unsigned long long)_sent[PRIO_FILE_XFER],
+              (unsigned long long)_sent[PRIO_PORT_FORWARD], (unsigned long)_queued_max);
+}
+
+void ChunkTransport::enqueue_message(VDIMessage* msg)
+{
+    msg->hdr.msg.size = msg->inline_size + msg->data_size;
+    msg->hdr.chunk.size = 0;
+    msg->pos = 0;
+    vd_atomic_add(&_queued_bytes[message_priority(msg->hdr.msg.type)], msg->size());
+
+    // Guess an empty list, the first failed exchange returns the real head
+    VDIMessage* head = NULL;
+    for (;;) {
+        msg->next = head;
+        VDIMessage* prev = (VDIMessage*)vd_atomic_cas_ptr((void* volatile*)&_incoming, head, msg);
+        if (prev == head) {
+            break;
+        }
+        head = prev;
+    }
+    // Only the first message of a batch needs to wake up the owner thread
+    if (!head) {
+        _stream->wakeup();
+    }
+}
+
+void ChunkTransport::send_queued()
+{
+    if (!_write_msg) {
+        _write_msg = dequeue_message();
+        if (_write_msg) {
+            write_next();
+        }
+    }
+}
+
+// Moves the messages enqueued since the last call to the class queues, in
+// the order they were enqueued.
+void ChunkTransport::take_incoming()
+{
+    VDIMessage* msg = (VDIMessage*)vd_atomic_xchg_ptr((void* volatile*)&_incoming, NULL);
+    VDIMessage* fifo = NULL;
+
+    while (msg) {
+        VDIMessage* next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg = next;
+    }
+    for (; fifo; fifo = fifo->next) {
+        Priority prio = message_priority(fifo->hdr.msg.type);
+        _message_queue[prio].push(fifo);
+        _sent[prio]++;
+        _queued++;
+    }
+    _queued_max = MAX(_queued_max, _queued);
+}
+
+ChunkTransport::Priority ChunkTransport::message_priority(uint32_t type)
+{
+    switch (type) {
+    case VD_AGENT_MOUSE_STATE:
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_REQUEST:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+        return PRIO_INTERACTIVE;
+    case VD_AGENT_CLIPBOARD:
+        return PRIO_CLIPBOARD;
+    case VD_AGENT_FILE_XFER_START:
+    case VD_AGENT_FILE_XFER_STATUS:
+    case VD_AGENT_FILE_XFER_DATA:
+        return PRIO_FILE_XFER;
+    // All of them in one class, they must stay in order
+    case VD_AGENT_PORT_FORWARD_LISTEN:
+    case VD_AGENT_PORT_FORWARD_ACCEPTED:
+    case VD_AGENT_PORT_FORWARD_CONNECT:
+    case VD_AGENT_PORT_FORWARD_DATA:
+    case VD_AGENT_PORT_FORWARD_ACK:
+    case VD_AGENT_PORT_FORWARD_CLOSE:
+    case VD_AGENT_PORT_FORWARD_SHUTDOWN:
+    case VD_AGENT_PORT_FORWARD_DATA_COMPRESSED:
+        return PRIO_PORT_FORWARD;
+    default:
+        return PRIO_CONTROL;
+    }
+}
+
+// Picks the next message to write. The client reassembles one message at a
+// time, so messages are interleaved, not their chunks. Control messages are
+// always taken first; the other classes are served by deficit round robin,
+// each round adding weight chunks worth of credit to a class.
+VDIMessage* ChunkTransport::dequeue_message()
+{
+    static const int32_t weight[PRIO_COUNT] = {0, 8, 2, 2, 4};
+    VDIMessage* msg;
+
+    take_incoming();
+    if (!_queued) {
+        return NULL;
+    }
+    if (!_message_queue[PRIO_CONTROL].empty()) {
+        msg = _message_queue[PRIO_CONTROL].front();
+        _message_queue[PRIO_CONTROL].pop();
+        _queued--;
+        return msg;
+    }
+    for (;;) {
+        std::queue<VDIMessage*>& queue = _message_queue[_sched_prio];
+        if (queue.empty()) {
+            _sched_credit[_sched_prio] = 0;
+        } else if (_sched_credit[_sched_prio] > 0) {
+            msg = queue.front();
+            queue.pop();
+            _queued--;
+            _sched_credit[_sched_prio] -= msg->size();
+            return msg;
+        }
+        if (++_sched_prio == PRIO_COUNT) {
+            _sched_prio = PRIO_INTERACTIVE;
+        }
+        if (!_message_queue[_sched_prio].empty()) {
+            _sched_credit[_sched_prio] += weight[_sched_prio] * VD_AGENT_MAX_DATA_SIZE;
+        }
+    }
+}
+
+#ifdef _WIN32
+VioSerialStream::VioSerialStream(ChunkTransport &transport)
+    : _transport(transport)
+    , _handle(INVALID_HANDLE_VALUE)
+    , _thread(NULL)
+{
+    ZeroMemory(&_read_overlapped, sizeof(_read_overlapped));
+    ZeroMemory(&_write_overlapped, sizeof(_write_overlapped));
+    // hEvent is not used by ReadFileEx/WriteFileEx, keep our instance there
+    _read_overlapped.hEvent = (HANDLE)this;
+    _write_overlapped.hEvent = (HANDLE)this;
+}
+
+VioSerialStream::~VioSerialStream()
+{
+    close();
+}
+
+bool VioSerialStream::open(LPCWSTR path)
+{
+    _handle = CreateFile(path, GENERIC_READ | GENERIC_WRITE , 0, NULL,
+                         OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (_handle == INVALID_HANDLE_VALUE) {
+        vd_printf("Failed opening %ls, error %lu", path, GetLastError());
+        return false;
+    }
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+                         &_thread, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        vd_printf("DuplicateHandle failed: %lu", GetLastError());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void VioSerialStream::close()
+{
+    if (_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(_handle);
+        _handle = INVALID_HANDLE_VALUE;
+    }
+    if (_thread) {
+        CloseHandle(_thread);
+        _thread = NULL;
+    }
+}
+
+bool VioSerialStream::post_read(void *buf, size_t size)
+{
+    if (!ReadFileEx(_handle, buf, (DWORD)size, &_read_overlapped, read_completion) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        vd_printf("vio_serial read error %lu", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool VioSerialStream::post_write(const VDIOVec *iov, int count)
+{
+    const void *buf = iov[0].base;
+    size_t size = iov[0].len;
+
+    if (count > 1) {
+        size = 0;
+        for (int i = 0; i < count; ++i) {
+            ASSERT(size + iov[i].len <= sizeof(_write_buf));
+            memcpy(_write_buf + size, iov[i].base, iov[i].len);
+            size += iov[i].len;
+        }
+        buf = _write_buf;
+    }
+    if (!WriteFileEx(_handle, buf, (DWORD)size, &_write_overlapped, write_completion) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        vd_printf("vio_serial write error %lu", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+VOID VioSerialStream::read_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped)
+{
+    VioSerialStream *s = (VioSerialStream *)overlapped->hEvent;
+
+    if (err != 0 && err != ERROR_OPERATION_ABORTED && err != ERROR_NO_SYSTEM_RESOURCES) {
+        vd_printf("vio_serial read completion error %lu", err);
+        s->_transport.stream_error();
+        return;
+    }
+    s->_transport.read_done(bytes);
+}
+
+VOID VioSerialStream::write_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped)
+{
+    VioSerialStream *s = (VioSerialStream *)overlapped->hEvent;
+
+    if (err != 0) {
+        vd_printf("vio_serial write completion error %lu", err);
+        s->_transport.stream_error();
+        return;
+    }
+    s->_transport.write_done(bytes);
+}
+
+void VioSerialStream::wakeup()
+{
+    if (!QueueUserAPC(wakeup_apc, _thread, (ULONG_PTR)this)) {
+        vd_printf("QueueUserAPC failed: %lu", GetLastError());
+    }
+}
+
+VOID CALLBACK VioSerialStream::wakeup_apc(ULONG_PTR param)
+{
+    VioSerialStream *s = (VioSerialStream *)param;
+
+    s->_transport.send_queued();
+}
+#else
+FdStream::FdStream(ChunkTransport &transport, int read_fd, int write_fd)
+    : _transport(transport)
+    , _read_fd(read_fd)
+    , _write_fd(write_fd)
+    , _read_buf(NULL)
+    , _read_size(0)
+    , _write_count(0)
+{
+    if (pipe(_wakeup_fds) < 0) {
+        _wakeup_fds[0] = _wakeup_fds[1] = -1;
+        return;
+    }
+    fcntl(_wakeup_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wakeup_fds[1], F_SETFL, O_NONBLOCK);
+}
+
+FdStream::~FdStream()
+{
+    if (_wakeup_fds[0] != -1) {
+        ::close(_wakeup_fds[0]);
+        ::close(_wakeup_fds[1]);
+    }
+}
+
+void FdStream::wakeup()
+{
+    char c = 0;
+
+    // A full pipe already has a wakeup pending
+    if (::write(_wakeup_fds[1], &c, 1) < 0 && errno != EAGAIN) {
+        vd_printf("wakeup failed: %d", errno);
+    }
+}
+
+bool FdStream::post_read(void *buf, size_t size)
+{
+    _read_buf = (uint8_t *)buf;
+    _read_size = size;
+    return true;
+}
+
+bool FdStream::post_write(const VDIOVec *iov, int count)
+{
+    std::copy(iov, iov + count, _write_iov);
+    _write_count = count;
+    return true;
+}
+
+bool FdStream::poll(int timeout_ms)
+{
+    struct pollfd fds[3];
+    nfds_t count = 0;
+
+    fds[count].fd = _wakeup_fds[0];
+    fds[count].events = POLLIN;
+    count++;
+    if (_read_size) {
+        fds[count].fd = _read_fd;
+        fds[count].events = POLLIN;
+        count++;
+    }
+    if (_write_count) {
+        if (_read_size && _write_fd == _read_fd) {
+            fds[1].events |= POLLOUT;
+        } else {
+            fds[count].fd = _write_fd;
+            fds[count].events = POLLOUT;
+            count++;
+        }
+    }
+    if (::poll(fds, count, timeout_ms) < 0) {
+        return errno == EINTR;
+    }
+    if (fds[0].revents & POLLIN) {
+        char buf[64];
+        while (::read(_wakeup_fds[0], buf, sizeof(buf)) > 0);
+        _transport.send_queued();
+    }
+    for (nfds_t i = 1; i < count; ++i) {
+        if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && fds[i].fd == _read_fd &&
+                _read_size) {
+            ssize_t bytes = ::read(_read_fd, _read_buf, _read_size);
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            } else if (bytes <= 0) {
+                return false;
+            }
+            _read_size = 0;
+            _transport.read_done(bytes);
+        }
+        if ((fds[i].revents & (POLLOUT | POLLERR)) && fds[i].fd == _write_fd && _write_count) {
+            struct iovec iov[ChunkTransport::MAX_IOV];
+            for (int j = 0; j < _write_count; ++j) {
+                iov[j].iov_base = (void *)_write_iov[j].base;
+                iov[j].iov_len = _write_iov[j].len;
+            }
+            ssize_t bytes = ::writev(_write_fd, iov, _write_count);
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            } else if (bytes < 0) {
+                return false;
+            }
+            _write_count = 0;
+            _transport.write_done(bytes);
+        }
+    }
+    return true;
+}
+#endif
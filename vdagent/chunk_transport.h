@@ -0,0 +1,268 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __CHUNK_TRANSPORT_H
+#define __CHUNK_TRANSPORT_H
+
+#include <stddef.h>
+#include <queue>
+#include "vdcommon.h"
+#include "buffer_pool.h"
+
+typedef struct ALIGN_VC VDIChunk {
+    VDIChunkHeader hdr;
+    uint8_t data[0];
+} ALIGN_GCC VDIChunk;
+
+#define VD_MESSAGE_HEADER_SIZE (sizeof(VDIChunk) + sizeof(VDAgentMessage))
+#define VD_READ_BUF_SIZE       (sizeof(VDIChunk) + VD_AGENT_MAX_DATA_SIZE)
+#define VD_READ_BATCH_SIZE     (64 * 1024)
+// Multi-chunk messages from this size on are read directly into place
+#define VD_DIRECT_READ_MIN     (64 * 1024)
+
+typedef struct ALIGN_VC VDIMessageHeader {
+    VDIChunkHeader chunk;
+    VDAgentMessage msg;
+} ALIGN_GCC VDIMessageHeader;
+
+/*
+ * An outgoing message: the VDAgentMessage header, an inline payload that
+ * follows it in memory and, optionally, a view of external data that is
+ * appended to the payload without copying it. Chunk headers are generated
+ * while the message is written; release(opaque) is called once the external
+ * data is no longer needed.
+ *
+ * The external data may also be streamed from a source: read(opaque) is
+ * called for the slice of every chunk, in order, when the chunk is about to
+ * be written, so only one chunk of it is ever in the transport.
+ */
+struct VDIMessage {
+    VDIMessage *next;
+    const uint8_t *data;
+    uint32_t data_size;
+    void (*release)(void *opaque);
+    void *opaque;
+    // Streamed data only; data then holds the slice read last, which starts
+    // at data_pos in the external data
+    uint32_t (*read)(void *opaque, uint8_t *buf, uint32_t size);
+    uint32_t data_pos;
+    uint32_t inline_size;
+    uint32_t pos;
+    VDIMessageHeader hdr;
+
+    uint8_t *payload() { return (uint8_t *)(&hdr + 1); }
+    uint32_t size() const { return sizeof(VDAgentMessage) + inline_size + data_size; }
+    void set_data(const void *d, uint32_t size, void (*r)(void *) = NULL, void *o = NULL) {
+        data = (const uint8_t *)d;
+        data_size = size;
+        release = r;
+        opaque = o;
+        read = NULL;
+        data_pos = 0;
+    }
+    // read() has to fill the whole slice it is asked for
+    void set_source(uint32_t size, uint32_t (*rd)(void *, uint8_t *, uint32_t),
+                    void (*r)(void *), void *o) {
+        set_data(NULL, size, r, o);
+        read = rd;
+    }
+    static VDIMessage *from_payload(void *p) {
+        return (VDIMessage *)((uint8_t *)p - sizeof(VDIMessageHeader) -
+                              offsetof(VDIMessage, hdr));
+    }
+};
+
+/*
+ * Framing of the VDI port byte stream: splits the input in chunks, assembles
+ * multi-chunk messages and keeps the queue of outgoing messages. The actual I/O
+ * is done by a Stream backend, which posts asynchronous reads and writes and
+ * reports their completion back with read_done()/write_done(), from the
+ * thread that owns the transport.
+ *
+ * Messages may be enqueued from any thread. They are pushed on a lock-free
+ * list and the owner thread is woken up through the stream to schedule them,
+ * so the queues themselves are only touched by the owner thread.
+ */
+class ChunkTransport {
+public:
+    class Stream {
+    public:
+        virtual ~Stream() {}
+        virtual bool post_read(void *buf, size_t size) = 0;
+        // Writes may complete partially, like writev(). At most
+        // ChunkTransport::MAX_IOV segments are passed.
+        virtual bool post_write(const VDIOVec *iov, int count) = 0;
+        // Called from any thread; makes the owner thread call
+        // ChunkTransport::send_queued() soon.
+        virtual void wakeup() = 0;
+    };
+
+    class Handler {
+    public:
+        virtual ~Handler() {}
+        // Multi-chunk messages are handled with port 0
+        virtual void handle_message(VDAgentMessage *msg, uint32_t port) = 0;
+        // Called on every chunk of a multi-chunk message but the last one
+        virtual void handle_partial_message(VDAgentMessage *msg) {}
+        virtual void handle_transport_error() = 0;
+        // The bytes queued in class prio (a Priority) went down to its low
+        // water mark, see set_low_water(). Called on the owner thread.
+        virtual void handle_queue_drained(int prio) {}
+    };
+
+    static const int MAX_IOV = 3;
+
+    // Outgoing traffic classes, see message_priority(). Control messages go
+    // first, the rest share the stream by weight.
+    enum Priority {
+        PRIO_CONTROL,
+        PRIO_INTERACTIVE,
+        PRIO_CLIPBOARD,
+        PRIO_FILE_XFER,
+        PRIO_PORT_FORWARD,
+        PRIO_COUNT
+    };
+
+    enum ReadMode {
+        // One read for each chunk header and another one for its body
+        READ_EXACT,
+        // Read as much as is available and handle every complete chunk in
+        // it. The rest of a big multi-chunk message is read straight into the
+        // message buffer, each read taking a chunk body plus the next header.
+        READ_BATCHED,
+    };
+
+    ChunkTransport(Handler &handler, ReadMode read_mode = READ_BATCHED);
+    ~ChunkTransport();
+
+    void set_stream(Stream *stream) { _stream = stream; }
+    bool start();
+
+    // Stream callbacks
+    void read_done(size_t bytes);
+    void write_done(size_t bytes);
+    void stream_error();
+    void send_queued();
+
+    // The inline payload of new messages has room for size bytes
+    VDIMessage *new_message(uint32_t port, uint32_t type, uint32_t size);
+    void free_message(VDIMessage *msg);
+    void enqueue_message(VDIMessage *msg);
+    static Priority message_priority(uint32_t type);
+    // Bytes of the messages of a class enqueued and not completely written
+    // yet. Called from any thread.
+    size_t queued_bytes(Priority prio) const {
+        return (size_t)vd_atomic_load(const_cast<volatile long *>(&_queued_bytes[prio]));
+    }
+    // Makes a write that takes the queued bytes of a class from above bytes
+    // to bytes or less call Handler::handle_queue_drained(). 0 disables it.
+    void set_low_water(Priority prio, size_t bytes) {
+        _low_water[prio] = bytes;
+    }
+    void reset_in_msg();
+    void log_stats();
+
+private:
+    Handler &_handler;
+    Stream *_stream;
+    ReadMode _read_mode;
+    uint8_t _read_buf[VD_READ_BATCH_SIZE];
+    size_t _read_pos;
+    size_t _read_end;
+    size_t _write_pos;
+    VDAgentMessage *_in_msg;
+    uint32_t _in_msg_pos;
+    bool _in_msg_discard;
+    bool _direct;
+    bool _direct_in_body;
+    uint32_t _direct_have;
+    VDIChunkHeader _direct_hdr;
+    VDIMessage *volatile _incoming;
+    std::queue<VDIMessage *> _message_queue[PRIO_COUNT];
+    size_t _queued;
+    size_t _queued_max;
+    volatile long _queued_bytes[PRIO_COUNT];
+    size_t _low_water[PRIO_COUNT];
+    uint64_t _sent[PRIO_COUNT];
+    int _sched_prio;
+    int32_t _sched_credit[PRIO_COUNT];
+    VDIMessage *_write_msg;
+    // The slice of streamed data of the chunk being written
+    uint8_t _source_buf[VD_AGENT_MAX_DATA_SIZE];
+    BufferPool _pool;
+
+    void read_chunk_done(size_t bytes);
+    void read_batch_done(size_t bytes);
+    void read_direct_done(size_t bytes);
+    bool start_direct_read();
+    bool post_direct_read();
+    bool handle_chunk(VDIChunk *chunk);
+    void finish_in_msg();
+    void free_in_msg();
+    void write_next();
+    void message_written(VDIMessage *msg);
+    void read_source(VDIMessage *msg);
+    VDIMessage *dequeue_message();
+    void take_incoming();
+    static int get_chunk_iov(VDIMessage *msg, size_t skip, VDIOVec *iov);
+
+    // no copy
+    ChunkTransport(const ChunkTransport&);
+    void operator=(const ChunkTransport&);
+};
+
+#ifdef _WIN32
+// Overlapped I/O on the virtio-serial port, completed with APCs on the
+// thread that posted the operation.
+class VioSerialStream : public ChunkTransport::Stream {
+public:
+    VioSerialStream(ChunkTransport &transport);
+    ~VioSerialStream();
+    bool open(LPCWSTR path);
+    void close();
+    bool post_read(void *buf, size_t size);
+    bool post_write(const VDIOVec *iov, int count);
+    void wakeup();
+
+private:
+    ChunkTransport &_transport;
+    HANDLE _handle;
+    // The thread that opened the port, woken up with an APC
+    HANDLE _thread;
+    OVERLAPPED _read_overlapped;
+    OVERLAPPED _write_overlapped;
+    // There are no gathered writes on a plain overlapped handle; the few
+    // segments of a chunk are joined here so that it still takes one write.
+    uint8_t _write_buf[VD_READ_BUF_SIZE];
+
+    static VOID CALLBACK read_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped);
+    static VOID CALLBACK write_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped);
+    static VOID CALLBACK wakeup_apc(ULONG_PTR param);
+};
+#else
+// Stand-in for virtio-serial on POSIX systems: any pair of file descriptors
+// (a socketpair, two pipes...). I/O is performed from poll().
+class FdStream : public ChunkTransport::Stream {
+public:
+    FdStream(ChunkTransport &transport, int read_fd, int write_fd);
+    ~FdStream();
+    bool post_read(void *buf, size_t size);
+    bool post_write(const VDIOVec *iov, int count);
+    void wakeup();
+    // Waits for and completes the pending operations. Returns false on
+    // errors or when the peer closed the stream.
+    bool poll(int timeout_ms);
+
+private:
+    ChunkTransport &_transport;
+    int _read_fd, _write_fd;
+    uint8_t *_read_buf;
+    size_t _read_size;
+    VDIOVec _write_iov[ChunkTransport::MAX_IOV];
+    int _write_count;
+    int _wakeup_fds[2];
+};
+#endif
+
+#endif // __CHUNK_TRANSPORT_H
@@ -0,0 +1,90 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include "chunk_transport.h"
+#include "chunked_buffer.h"
+
+ChunkedBuffer::ChunkedBuffer()
+    : _head(NULL)
+    , _tail(NULL)
+    , _size(0)
+{
+}
+
+ChunkedBuffer::~ChunkedBuffer()
+{
+    while (_head) {
+        Block *next = _head->next;
+        delete _head;
+        _head = next;
+    }
+}
+
+bool ChunkedBuffer::append(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (size) {
+        if (!_tail || _tail->end == BLOCK_SIZE) {
+            Block *block = new (std::nothrow) Block;
+            if (!block) {
+                return false;
+            }
+            block->next = NULL;
+            block->start = block->end = 0;
+            if (_tail) {
+                _tail->next = block;
+            } else {
+                _head = block;
+            }
+            _tail = block;
+        }
+        size_t n = std::min<size_t>(size, BLOCK_SIZE - _tail->end);
+        memcpy(_tail->data + _tail->end, p, n);
+        _tail->end += n;
+        _size += n;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+size_t ChunkedBuffer::read(void *buf, size_t size)
+{
+    uint8_t *p = (uint8_t *)buf;
+    size_t done = 0;
+    while (done < size && _head) {
+        size_t n = std::min<size_t>(size - done, _head->end - _head->start);
+        memcpy(p + done, _head->data + _head->start, n);
+        _head->start += n;
+        done += n;
+        if (_head->start == _head->end) {
+            Block *next = _head->next;
+            delete _head;
+            _head = next;
+            if (!_head) {
+                _tail = NULL;
+            }
+        }
+    }
+    _size -= done;
+    return done;
+}
+
+void ChunkedBuffer::attach(VDIMessage *msg)
+{
+    msg->set_source((uint32_t)_size, read_source, release, this);
+}
+
+uint32_t ChunkedBuffer::read_source(void *opaque, uint8_t *buf, uint32_t size)
+{
+    return (uint32_t)((ChunkedBuffer *)opaque)->read(buf, size);
+}
+
+void ChunkedBuffer::release(void *opaque)
+{
+    delete (ChunkedBuffer *)opaque;
+}
@@ -0,0 +1,55 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __CHUNKED_BUFFER_H
+#define __CHUNKED_BUFFER_H
+
+#include "vdcommon.h"
+
+struct VDIMessage;
+
+/*
+ * Outgoing data of unknown or big size, like an encoded clipboard, kept in a
+ * chain of blocks instead of one buffer: it grows without reallocating and
+ * needs no big contiguous range of the address space. Once attached to a
+ * message it is streamed by the transport, which frees every block as soon
+ * as it is written out.
+ */
+class ChunkedBuffer {
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    ChunkedBuffer();
+    ~ChunkedBuffer();
+
+    // Returns false when out of memory
+    bool append(const void *data, size_t size);
+    size_t size() const {
+        return _size;
+    }
+    // Takes size bytes from the front, less at the end of the data
+    size_t read(void *buf, size_t size);
+    // The message sends all the data as its external data, and deletes the
+    // buffer once it is written
+    void attach(VDIMessage *msg);
+
+private:
+    struct Block {
+        Block *next;
+        size_t start, end;
+        uint8_t data[BLOCK_SIZE];
+    };
+
+    Block *_head, *_tail;
+    size_t _size;
+
+    static uint32_t read_source(void *opaque, uint8_t *buf, uint32_t size);
+    static void release(void *opaque);
+
+    // no copy
+    ChunkedBuffer(const ChunkedBuffer&);
+    void operator=(const ChunkedBuffer&);
+};
+
+#endif // __CHUNKED_BUFFER_H
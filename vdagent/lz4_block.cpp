@@ -0,0 +1,203 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+#include "lz4_block.h"
+
+// A sequence is a token with the literal and match lengths, the literals,
+// a little endian 16-bit offset and the match. The last sequence only has
+// literals. Lengths of 15 or more continue in bytes of 255 and a remainder.
+static const size_t MIN_MATCH = 4;
+// The last LAST_LITERALS bytes are literals, and the last match starts at
+// least MF_LIMIT bytes before the end
+static const size_t LAST_LITERALS = 5;
+static const size_t MF_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 12;
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uint8_t *put_length(uint8_t *op, size_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Bytes taken by a sequence, in the worst case for the match
+static inline size_t sequence_size(size_t literals, size_t match)
+{
+    return 1 + (literals + 240) / 255 + literals + 2 + (match + 240) / 255;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals, size_t literal_count,
+                             size_t offset, size_t match)
+{
+    uint8_t *token = op++;
+    if (literal_count >= 15) {
+        *token = 15 << 4;
+        op = put_length(op, literal_count - 15);
+    } else {
+        *token = (uint8_t)(literal_count << 4);
+    }
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match -= MIN_MATCH;
+    if (match >= 15) {
+        *token |= 15;
+        op = put_length(op, match - 15);
+    } else {
+        *token |= (uint8_t)match;
+    }
+    return op;
+}
+
+size_t lz4_compress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+    if (size > LZ4_MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    const uint8_t *ip = src, *anchor = src, *end = src + size;
+    uint8_t *op = dst, *op_end = dst + capacity;
+
+    if (size > MF_LIMIT) {
+        // Positions of the last sequence of 4 bytes with each hash. Empty
+        // entries point at the start, which the byte compare rejects.
+        uint16_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const uint8_t *match_limit = end - MF_LIMIT;
+        const uint8_t *match_end = end - LAST_LITERALS;
+        // Data that does not match is skipped faster and faster
+        unsigned misses = 0;
+        ++ip;
+        while (ip <= match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash32(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET || read32(ref) != sequence) {
+                ip += 1 + (misses++ >> 5);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < match_end && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+            size_t literal_count = ip - anchor, match = mp - ip;
+            if (sequence_size(literal_count, match) > (size_t)(op_end - op)) {
+                return 0;
+            }
+            op = put_sequence(op, anchor, literal_count, ip - ref, match);
+            ip = anchor = mp;
+            if (ip <= match_limit) {
+                // The position before is likely to start a later match
+                table[hash32(read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    size_t literal_count = end - anchor;
+    if (1 + (literal_count + 240) / 255 + literal_count > (size_t)(op_end - op)) {
+        return 0;
+    }
+    if (literal_count >= 15) {
+        *op++ = 15 << 4;
+        op = put_length(op, literal_count - 15);
+    } else {
+        *op++ = (uint8_t)(literal_count << 4);
+    }
+    memcpy(op, anchor, literal_count);
+    op += literal_count;
+    return op - dst;
+}
+
+// Reads the rest of a length that does not fit in its token field
+static inline bool get_length(const uint8_t *&ip, const uint8_t *end, size_t &length)
+{
+    uint8_t byte;
+    do {
+        if (ip == end) {
+            return false;
+        }
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+int lz4_decompress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src, *end = src + size;
+    uint8_t *op = dst, *op_end = dst + capacity;
+
+    if (capacity > INT_MAX) {
+        return -1;
+    }
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !get_length(ip, end, literal_count)) {
+            return -1;
+        }
+        if (literal_count > (size_t)(end - ip) || literal_count > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+        size_t match = token & 15;
+        if (match == 15 && !get_length(ip, end, match)) {
+            return -1;
+        }
+        match += MIN_MATCH;
+        if (match > (size_t)(op_end - op)) {
+            return -1;
+        }
+        // A match longer than its offset repeats the last offset bytes. What
+        // is copied from ref is periodic, so the copies double in size.
+        const uint8_t *ref = op - offset;
+        while (match) {
+            size_t count = std::min(match, (size_t)(op - ref));
+            memcpy(op, ref, count);
+            op += count;
+            match -= count;
+        }
+    }
+    return (int)(op - dst);
+}
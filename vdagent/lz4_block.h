@@ -0,0 +1,27 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __LZ4_BLOCK_H
+#define __LZ4_BLOCK_H
+
+#include "vdcommon.h"
+
+/*
+ * Compression of independent blocks in the LZ4 block format, so that the
+ * other end can use any LZ4 implementation (LZ4_decompress_safe() and
+ * LZ4_compress_default() are compatible). Only the fast greedy matcher is
+ * implemented, and blocks are limited to LZ4_MAX_BLOCK_SIZE bytes.
+ */
+static const size_t LZ4_MAX_BLOCK_SIZE = 64 * 1024 - 1;
+
+// Returns the compressed size, or 0 when the input is too big or its
+// compressed form does not fit in capacity bytes
+size_t lz4_compress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+// Checks every length and offset against the input and output bounds, so
+// that it is safe on data from the other end. Returns the decompressed size,
+// or -1 when the block is malformed or bigger than capacity.
+int lz4_decompress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+#endif // __LZ4_BLOCK_H
@@ -3,615 +3,1433 @@
  **/
 
 #include <algorithm>
+#include <deque>
+#include <new>
+#include <string>
+#ifdef _WIN32
 #include <winsock2.h>
-#include <winsock.h>
-#include <mswsock.h>
-#include <tchar.h>
-#include "port_forward.h"
-
-static const char* getErrorMessage(DWORD error)
-{
-    static TCHAR errmsg[512];
-    static char cerrmsg[512];
-    if (!FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, error, 0, errmsg, 511, NULL)) {
-        return (getErrorMessage(GetLastError()));
-    }
-#ifdef _UNICODE
-    WideCharToMultiByte(CP_UTF8, 0, errmsg, -1, cerrmsg, 512, NULL, NULL);
-    return cerrmsg;
 #else
-    return errmsg;
+#include <time.h>
+#include <unistd.h>
 #endif
-}
+#include "lz4_block.h"
+#include "port_forward.h"
+
+// A data message read from a connection fills at most one chunk
+static const size_t MAX_MSG_SIZE = VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage);
+static const size_t DATA_HEAD_SIZE = sizeof(VDAgentPortForwardDataMessage);
+static const size_t READ_BUFFER_SIZE = MAX_MSG_SIZE - DATA_HEAD_SIZE;
+// DATA_COMPRESSED messages carry an LZ4 block of original_size bytes, which
+// is what windows and ACKs count
+static const size_t COMPRESSED_HEAD_SIZE = sizeof(VDAgentPortForwardCompressedDataMessage);
+// Smaller reads are not worth compressing. A read that does not compress
+// makes its connection send the next ones as they are, for a number of reads
+// that doubles every time up to MAX_COMPRESS_BACKOFF.
+static const size_t MIN_COMPRESS_SIZE = 64;
+static const uint32_t MAX_COMPRESS_BACKOFF = 64;
+// Write queues are made of slabs of this size, and a send gathers at most
+// MAX_WRITE_SIZE bytes
+static const size_t WRITE_SLAB_SIZE = 16 * 1024;
+static const size_t MAX_WRITE_SIZE = 256 * 1024;
+static const uint32_t MAX_FREE_SLABS = 64;
+// Bound of the data read from all connections and not ACKed yet, shared
+// evenly by the live connections of all shards; see may_read()
+static const uint64_t GLOBAL_WINDOW = 64 * 1024 * 1024;
 
-struct Buffer {
-    uint8_t *buff;
-    size_t size, pos;
+// Client data waiting to be written to a connection, in a chain of fixed-size
+// slabs from the forwarder's pool. Appending fills the last slab and consuming
+// releases the slabs written out, so nothing is allocated per message.
+struct WriteQueue {
+    struct Slab {
+        Slab *next;
+        size_t start, end;
+        uint8_t data[WRITE_SLAB_SIZE];
+    };
 
-    Buffer() : buff(NULL), size(0), pos(0) {}
-    ~Buffer() {
-        if (buff) delete[] buff;
+    BufferPool *pool;
+    Slab *head, *tail;
+    size_t size;
+
+    WriteQueue() : pool(NULL), head(NULL), tail(NULL), size(0) {}
+    ~WriteQueue() {
+        clear();
     }
-    void copy_data(const uint8_t * data, size_t s) {
-        if (buff) delete[] buff;
-        buff = new uint8_t[size = s];
-        pos = 0;
-        std::copy(data, data + s, buff);
+    bool empty() const {
+        return size == 0;
     }
-    void getWSABuffer(WSABUF* buffer) {
-        buffer->len = size - pos;
-        buffer->buf = (char *)&buff[pos];
+    void append(const uint8_t *data, size_t n) {
+        size += n;
+        while (n) {
+            if (!tail || tail->end == WRITE_SLAB_SIZE) {
+                Slab *slab = (Slab *)pool->alloc(sizeof(Slab));
+                slab->next = NULL;
+                slab->start = slab->end = 0;
+                if (tail) {
+                    tail->next = slab;
+                } else {
+                    head = slab;
+                }
+                tail = slab;
+            }
+            size_t count = std::min(n, WRITE_SLAB_SIZE - tail->end);
+            std::copy(data, data + count, tail->data + tail->end);
+            tail->end += count;
+            data += count;
+            n -= count;
+        }
+    }
+    void consume(size_t n) {
+        size -= n;
+        while (n) {
+            size_t count = std::min(n, head->end - head->start);
+            head->start += count;
+            n -= count;
+            // A partly filled slab is the last one, and data may still be
+            // appended to it until the queue is empty
+            if (head->start == WRITE_SLAB_SIZE || !size) {
+                pop_slab();
+            }
+        }
+    }
+    // Returns the number of segments stored in iov
+    int get_iov(VDIOVec *iov, int max, size_t max_bytes) const {
+        int count = 0;
+        size_t total = 0;
+        for (Slab *slab = head; slab && count < max && total < max_bytes; slab = slab->next) {
+            iov[count].base = slab->data + slab->start;
+            iov[count].len = slab->end - slab->start;
+            total += iov[count++].len;
+        }
+        return count;
+    }
+    void clear() {
+        while (head) {
+            pop_slab();
+        }
+        size = 0;
+    }
+
+private:
+    void pop_slab() {
+        Slab *slab = head;
+        head = slab->next;
+        if (!head) {
+            tail = NULL;
+        }
+        pool->free(slab);
     }
 };
 
+static uint64_t now_us()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / freq.QuadPart * 1000000 +
+           count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 struct Connection {
     PortForwarder::conn_id_t id;
+    // Names the connection to the backend and the resolver. Unlike the id,
+    // which the client may reuse as soon as the connection is closed, it is
+    // unique while operations are pending.
+    PortForwarder::conn_id_t handle;
+    PFIOBackend *io;
     SOCKET sock;
+    // The local port, listened to or connected to
+    uint16_t port;
     bool closing;
+    // The socket is closed and the connection waits for its pending
+    // operations to complete before it is removed
+    bool closed;
     bool acked;
-    std::list<Buffer> write_buffer;
+    bool connecting;
+    bool writing;
+    // In the waiting list of its shard, see wait_transport()
+    bool waiting_transport;
+    // Reads posted and not completed yet
+    int reading;
+    // Reads are delivered in the order they were posted, whatever the order
+    // they complete in. read_seq is the next to post and deliver_seq the next
+    // to deliver; the reads in between are in reads[seq % MAX_READS].
+    struct Read {
+        void *buf;
+        size_t bytes;
+        bool done;
+    };
+    Read reads[PFIOBackend::MAX_READS];
+    uint32_t read_seq, deliver_seq;
+    WriteQueue write_buffer;
     uint32_t data_sent, data_received, ack_interval;
+    // Data we receive from the client is bounded by its own window
     static const uint32_t WINDOW_SIZE = 10*1024*1024;
 
-    Connection() : sock(INVALID_SOCKET), closing(false), acked(false), data_sent(0),
-        data_received(0), ack_interval(0) {}
+    // Our send window, see update_window(). The client is asked to ACK every
+    // ACK_INTERVAL bytes, well below the smallest window.
+    static const uint32_t MIN_WINDOW = 256*1024;
+    static const uint32_t INITIAL_WINDOW = 1024*1024;
+    static const uint32_t MAX_WINDOW = 16*1024*1024;
+    static const uint32_t ACK_INTERVAL = 64*1024;
+    static const int RTT_MIN_SAMPLES = 16;
+    uint32_t window;
+    uint64_t total_acked;
+    // The RTT sample in progress ends when the data sent up to sample_mark
+    // is ACKed. The drain rate is measured between the ends of two samples.
+    bool sampling;
+    uint64_t sample_mark, sample_start;
+    uint64_t rate_acked, rate_start;
+    uint64_t rtt_min, rtt_min_next;
+    int rtt_samples;
+
+    // Metrics. Reading stalls when the window is full and no read is posted,
+    // until an ACK opens it.
+    uint64_t created;
+    uint64_t bytes_read, bytes_written;
+    uint32_t stalls;
+    uint64_t stall_start, stalled_us;
+    // Bytes of DATA payloads, after compression
+    uint64_t bytes_sent;
+    uint32_t compress_skip, compress_backoff;
+    // Small reads waiting to be sent together, in the message buffer of the
+    // first one; see deliver_data()
+    uint8_t *batch;
+    size_t batch_size;
+    uint64_t batch_deadline, last_data;
+
+    Connection() : io(NULL), sock(INVALID_SOCKET), port(0), closing(false), closed(false), acked(false),
+        connecting(false), writing(false), waiting_transport(false), reading(0), read_seq(0), deliver_seq(0),
+        data_sent(0), data_received(0), ack_interval(0),
+        window(INITIAL_WINDOW), total_acked(0), sampling(false), sample_mark(0),
+        sample_start(0), rate_acked(0), rate_start(0), rtt_min(UINT64_MAX),
+        rtt_min_next(UINT64_MAX), rtt_samples(0), created(0), bytes_read(0),
+        bytes_written(0), stalls(0), stall_start(0), stalled_us(0), bytes_sent(0),
+        compress_skip(0), compress_backoff(1), batch(NULL), batch_size(0), batch_deadline(0),
+        last_data(0) {}
     ~Connection() {
         if (sock != INVALID_SOCKET) {
-            shutdown(sock, SD_BOTH);
-            closesocket(sock);
+            io->close(sock);
         }
-        // TODO Cancel all pending operations on this connection
     }
 
-    static PortForwarder::conn_id_t generateConnectionId();
-    void add_data_to_write_buffer(const uint8_t * data, size_t size) {
-        write_buffer.push_back(Buffer());
-        write_buffer.back().copy_data(data, size);
+    // A connect in progress includes resolving the host
+    bool pending() const {
+        return connecting || reading || writing;
+    }
+
+    int reads_queued() const {
+        return read_seq - deliver_seq;
     }
-    void getWSABuffer(WSABUF *buffer) {
-        write_buffer.front().getWSABuffer(buffer);
+    Read &queued_read(uint32_t seq) {
+        return reads[seq % PFIOBackend::MAX_READS];
+    }
+    Read *find_read(void *buf) {
+        for (uint32_t seq = deliver_seq; seq != read_seq; ++seq) {
+            if (queued_read(seq).buf == buf) {
+                return &queued_read(seq);
+            }
+        }
+        return NULL;
+    }
+
+    // Timing starts with the data of a read and ends with its ACK
+    void data_read(uint32_t bytes) {
+        data_sent += bytes;
+        bytes_read += bytes;
+        if (!sampling) {
+            sampling = true;
+            sample_mark = total_acked + data_sent;
+            sample_start = now_us();
+        }
+    }
+    void data_acked(uint32_t bytes) {
+        data_sent -= bytes;
+        total_acked += bytes;
+        if (sampling && total_acked >= sample_mark) {
+            sampling = false;
+            update_window(now_us());
+        }
+    }
+
+private:
+    // The shortest sample in the last RTT_MIN_SAMPLES is the round trip time
+    // without our own queueing. The window is kept at twice the drain rate
+    // times that, so that it doubles every round trip while it is what limits
+    // the rate, and settles at twice the bandwidth-delay product of the path
+    // when it is not.
+    void update_window(uint64_t now) {
+        uint64_t rtt = now - sample_start;
+        rtt_min_next = std::min(rtt_min_next, rtt);
+        rtt_min = std::min(rtt_min, rtt_min_next);
+        if (++rtt_samples == RTT_MIN_SAMPLES) {
+            rtt_min = rtt_min_next;
+            rtt_min_next = UINT64_MAX;
+            rtt_samples = 0;
+        }
+        if (rate_start && now > rate_start) {
+            uint64_t target = 2 * (total_acked - rate_acked) * rtt_min / (now - rate_start);
+            window = (uint32_t)std::max<uint64_t>(MIN_WINDOW,
+                                                  std::min<uint64_t>(MAX_WINDOW, target));
+            LOG(LOG_DEBUG, "Connection %d window %u, rtt %lu us", id, window,
+                (unsigned long)rtt);
+        }
+        rate_acked = total_acked;
+        rate_start = now;
     }
 };
 
-PortForwarder::conn_id_t Connection::generateConnectionId()
-{
-    static uint32_t seq = 0;
-    return ++seq;
-}
+/*
+ * The connections of a shard, in slots that never move. Every connection gets
+ * a handle that names its slot, with a generation count that changes every
+ * time the slot is reused so that a stale handle finds nothing; it is found
+ * with a bounds check and a compare. Accepted connections use their handle as
+ * id. Ids chosen by the client with CONNECT are mapped to their slot by an
+ * open-addressing hash index.
+ *
+ * Handles are ((generation << SLOT_BITS) | slot) * shard_count + shard, so
+ * that they map back to their shard like any other id.
+ */
+class ConnectionTable {
+public:
+    typedef PortForwarder::conn_id_t conn_id_t;
 
-struct Acceptor {
-    static const size_t sizeOfAddress = sizeof(SOCKADDR_IN) + 16;
-    static const GUID acceptex_guid, get_sockaddr_guid;
+    ConnectionTable(uint32_t shard, uint32_t shard_count)
+        : _shard(shard), _shard_count(shard_count), _free(NO_SLOT), _size(0)
+        , _index_used(0) {}
+    ~ConnectionTable() {
+        clear();
+        for (size_t i = 0; i < _chunks.size(); ++i) {
+            delete[] _chunks[i];
+        }
+    }
 
+    size_t size() const {
+        return _size;
+    }
+
+    // Returns NULL when the table is full
+    Connection *add() {
+        uint32_t slot_index = alloc_slot();
+        if (slot_index == NO_SLOT) {
+            return NULL;
+        }
+        Slot &slot = get_slot(slot_index);
+        // A client id may already be using the natural id of the slot
+        do {
+            slot.conn.handle = next_handle(slot_index);
+        } while (index_find(slot.conn.handle) != NO_SLOT);
+        slot.conn.id = slot.conn.handle;
+        return &slot.conn;
+    }
+
+    // Returns NULL when the id is taken or the table is full
+    Connection *add(conn_id_t id) {
+        if (find(id)) {
+            return NULL;
+        }
+        uint32_t slot_index = alloc_slot();
+        if (slot_index == NO_SLOT) {
+            return NULL;
+        }
+        Slot &slot = get_slot(slot_index);
+        slot.conn.handle = next_handle(slot_index);
+        slot.conn.id = id;
+        slot.indexed = true;
+        index_insert(id, slot_index);
+        return &slot.conn;
+    }
+
+    // Closed connections are not found by their id
+    Connection *find(conn_id_t id) {
+        uint32_t slot_index = ((uint32_t)id / _shard_count) & SLOT_MASK;
+        if (slot_index < _chunks.size() * CHUNK_SIZE) {
+            Slot &slot = get_slot(slot_index);
+            if (slot.used && !slot.conn.closed && slot.conn.id == id) {
+                return &slot.conn;
+            }
+        }
+        slot_index = index_find(id);
+        return slot_index == NO_SLOT ? NULL : &get_slot(slot_index).conn;
+    }
+
+    Connection *find_handle(conn_id_t handle) {
+        uint32_t slot_index = ((uint32_t)handle / _shard_count) & SLOT_MASK;
+        if (slot_index < _chunks.size() * CHUNK_SIZE) {
+            Slot &slot = get_slot(slot_index);
+            if (slot.used && slot.conn.handle == handle) {
+                return &slot.conn;
+            }
+        }
+        return NULL;
+    }
+
+    // Frees the id of a closed connection for the client to reuse
+    void detach(Connection &conn) {
+        Slot &slot = slot_of(conn);
+        if (slot.indexed) {
+            index_remove(conn.id);
+            slot.indexed = false;
+        }
+    }
+
+    void remove(Connection &conn) {
+        uint32_t slot_index = ((uint32_t)conn.handle / _shard_count) & SLOT_MASK;
+        Slot &slot = get_slot(slot_index);
+        detach(conn);
+        // Closes the socket and frees the write queue
+        slot.conn.~Connection();
+        new (&slot.conn) Connection();
+        slot.used = false;
+        slot.next_free = _free;
+        _free = slot_index;
+        _size--;
+    }
+
+    void list(std::vector<Connection *> &conns) {
+        for (uint32_t i = 0; i < _chunks.size() * CHUNK_SIZE; ++i) {
+            Slot &slot = get_slot(i);
+            if (slot.used) {
+                conns.push_back(&slot.conn);
+            }
+        }
+    }
+
+    void clear() {
+        for (uint32_t i = 0; i < _chunks.size() * CHUNK_SIZE && _size; ++i) {
+            Slot &slot = get_slot(i);
+            if (slot.used) {
+                remove(slot.conn);
+            }
+        }
+    }
+
+private:
+    static const uint32_t SLOT_BITS = 16;
+    static const uint32_t SLOT_MASK = (1 << SLOT_BITS) - 1;
+    // Generated ids stay below 2^31 with up to 16 shards
+    static const uint32_t GENERATION_MASK = (1 << 11) - 1;
+    static const uint32_t CHUNK_SIZE = 256;
+    static const uint32_t NO_SLOT = 0xffffffff;
+
+    struct Slot {
+        Connection conn;
+        uint32_t next_free;
+        uint16_t generation;
+        bool used;
+        // The id was chosen by the client
+        bool indexed;
+    };
+    struct IndexEntry {
+        conn_id_t id;
+        uint32_t slot;
+    };
+
+    uint32_t _shard, _shard_count;
+    std::vector<Slot *> _chunks;
+    uint32_t _free;
+    size_t _size;
+    std::vector<IndexEntry> _index;
+    size_t _index_used;
+
+    Slot &get_slot(uint32_t index) {
+        return _chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+    }
+
+    Slot &slot_of(const Connection &conn) {
+        return get_slot(((uint32_t)conn.handle / _shard_count) & SLOT_MASK);
+    }
+
+    conn_id_t next_handle(uint32_t slot_index) {
+        Slot &slot = get_slot(slot_index);
+        do {
+            slot.generation = (slot.generation + 1) & GENERATION_MASK;
+        } while (!slot.generation);
+        return (conn_id_t)(((slot.generation << SLOT_BITS) | slot_index) * _shard_count + _shard);
+    }
+
+    uint32_t alloc_slot() {
+        if (_free == NO_SLOT) {
+            uint32_t first = _chunks.size() * CHUNK_SIZE;
+            if (first > SLOT_MASK) {
+                return NO_SLOT;
+            }
+            Slot *chunk = new Slot[CHUNK_SIZE];
+            for (uint32_t i = 0; i < CHUNK_SIZE; ++i) {
+                chunk[i].next_free = i + 1 < CHUNK_SIZE ? first + i + 1 : NO_SLOT;
+                chunk[i].generation = 0;
+                chunk[i].used = false;
+                chunk[i].indexed = false;
+            }
+            _chunks.push_back(chunk);
+            _free = first;
+        }
+        uint32_t slot_index = _free;
+        Slot &slot = get_slot(slot_index);
+        _free = slot.next_free;
+        slot.used = true;
+        _size++;
+        return slot_index;
+    }
+
+    // Linear probing over a power of two number of entries, at most half of
+    // them used
+    size_t index_start(conn_id_t id) const {
+        return ((uint32_t)id * 2654435761u) & (_index.size() - 1);
+    }
+
+    uint32_t index_find(conn_id_t id) const {
+        if (!_index_used) {
+            return NO_SLOT;
+        }
+        for (size_t i = index_start(id);; i = (i + 1) & (_index.size() - 1)) {
+            if (_index[i].slot == NO_SLOT) {
+                return NO_SLOT;
+            }
+            if (_index[i].id == id) {
+                return _index[i].slot;
+            }
+        }
+    }
+
+    void index_insert(conn_id_t id, uint32_t slot) {
+        if ((_index_used + 1) * 2 > _index.size()) {
+            std::vector<IndexEntry> old;
+            old.swap(_index);
+            IndexEntry empty = {0, NO_SLOT};
+            _index.assign(std::max<size_t>(16, old.size() * 2), empty);
+            _index_used = 0;
+            for (size_t i = 0; i < old.size(); ++i) {
+                if (old[i].slot != NO_SLOT) {
+                    index_insert(old[i].id, old[i].slot);
+                }
+            }
+        }
+        size_t i = index_start(id);
+        while (_index[i].slot != NO_SLOT) {
+            i = (i + 1) & (_index.size() - 1);
+        }
+        _index[i].id = id;
+        _index[i].slot = slot;
+        _index_used++;
+    }
+
+    // Moves back the entries after the removed one that would not be found
+    // across the hole otherwise
+    void index_remove(conn_id_t id) {
+        size_t mask = _index.size() - 1;
+        size_t i = index_start(id);
+        while (_index[i].id != id || _index[i].slot == NO_SLOT) {
+            i = (i + 1) & mask;
+        }
+        for (size_t j = (i + 1) & mask; _index[j].slot != NO_SLOT; j = (j + 1) & mask) {
+            size_t start = index_start(_index[j].id);
+            if (((j - start) & mask) >= ((j - i) & mask)) {
+                _index[i] = _index[j];
+                i = j;
+            }
+        }
+        _index[i].slot = NO_SLOT;
+        _index_used--;
+    }
+
+    // no copy
+    ConnectionTable(const ConnectionTable&);
+    void operator=(const ConnectionTable&);
+};
+
+struct Acceptor {
     PortForwarder::port_t port;
+    PFIOBackend *io;
     SOCKET sock;
-    uint8_t addrBuffer[sizeOfAddress * 2];
 
-    Acceptor() : sock(INVALID_SOCKET) {}
+    Acceptor() : io(NULL), sock(INVALID_SOCKET) {}
     ~Acceptor() {
         if (sock != INVALID_SOCKET) {
-            closesocket(sock);
+            io->close(sock);
         }
-        // TODO Cancel all pending operations on this connection
     }
+};
+
+// Totals of a shard, including its closed connections
+struct ShardMetrics {
+    uint64_t accepted, connected, closed, failed;
+    uint64_t bytes_read, bytes_written, bytes_sent;
+    uint64_t data_messages, batched_reads;
+    uint64_t stalls, stalled_us;
+    uint64_t transport_waits;
+};
 
-    bool accept_ex(SOCKET accSock, LPOVERLAPPED pOverlapped);
-    void get_accept_sockaddrs(LPSOCKADDR_IN *localAddr, LPSOCKADDR_IN *remoteAddr);
+// A connection always goes to the same shard, so its completions are handled
+// in order by one thread; different shards only share the sender.
+struct PortForwarder::Shard {
+    // A batch to send by the given time
+    struct BatchTimeout {
+        conn_id_t handle;
+        uint64_t deadline;
+    };
+
+    mutex_t mutex;
+    uint32_t index;
+    ConnectionTable connections;
+    PFIOBackend *io;
+    ShardMetrics metrics;
+    // All batches wait for the same delay, so they time out in the order
+    // they were started. The timer of the backend is set for the first one.
+    std::deque<BatchTimeout> batches;
+    uint64_t timer_deadline;
+    // Handles of the connections that stopped reading because the sender is
+    // over budget
+    std::vector<conn_id_t> waiting;
+
+    Shard(uint32_t index, uint32_t count) : index(index), connections(index, count), io(NULL)
+        , metrics(ShardMetrics()), timer_deadline(0) {}
 };
-const GUID Acceptor::acceptex_guid = WSAID_ACCEPTEX;
-const GUID Acceptor::get_sockaddr_guid = WSAID_GETACCEPTEXSOCKADDRS;
 
-static void* load_function(SOCKET sock, GUID guid) {
-    void* result = NULL;
-    DWORD dwBytes = 0;
+// The host of a LISTEN (passive) or CONNECT command, for the connection with
+// the given handle
+struct PortForwarder::HostRequest : public Resolver::Request {
+    conn_id_t handle;
+};
 
-    WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(GUID),
-             &result, sizeof(void *), &dwBytes, 0, 0);
-    return result;
+static int processor_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 }
 
-bool Acceptor::accept_ex(SOCKET accSock, LPOVERLAPPED pOverlapped)
+PortForwarder::PortForwarder(Sender& s, const Options &opts, Resolver::Lookup *lookup)
+    : sender(s)
+    , next_shard(0)
+    , options(opts)
+    , last_dump_us(now_us())
+    , last_dump_accepted(0)
+    , compress(false)
+    , live_connections(0)
 {
-    static LPFN_ACCEPTEX real_accept_ex =
-        (LPFN_ACCEPTEX)load_function(sock, acceptex_guid);
-    DWORD bytes;
-    if (real_accept_ex) {
-        LOG(LOG_DEBUG, "Calling accept_ex for operation %p", this);
-        return real_accept_ex(sock, accSock, addrBuffer, 0,
-                              sizeOfAddress, sizeOfAddress, &bytes, pOverlapped);
-    } else {
-        WSASetLastError(WSASYSCALLFAILURE);
-        return false;
+    static const int MAX_THREADS = 16;
+    static const int RESOLVER_THREADS = 2;
+
+    int threads = options.threads > 0 ? options.threads : processor_count();
+    threads = std::max(1, std::min(threads, MAX_THREADS));
+    options.threads = threads;
+    options.read_depth = std::max(1, std::min(options.read_depth, (int)PFIOBackend::MAX_READS));
+    options.listen_backlog = std::max(1, options.listen_backlog);
+    options.accept_depth = std::max(1, std::min(options.accept_depth,
+                                                (int)PFIOBackend::MAX_ACCEPTS));
+    options.batch_delay_us = std::max(0, options.batch_delay_us);
+    options.batch_bytes = std::max(1, std::min(options.batch_bytes, (int)READ_BUFFER_SIZE));
+    write_pool.add_class(sizeof(WriteQueue::Slab), MAX_FREE_SLABS);
+    if (options.outbound_budget) {
+        sender.set_low_water(options.outbound_budget / 2);
+    }
+    // The shard count is part of the connection ids, so the backends that
+    // fail to start are dropped before the shards are made
+    std::vector<PFIOBackend *> backends;
+    for (int i = 0; i < threads; ++i) {
+        PFIOBackend *io = PFIOBackend::create(*this);
+        if (io->start()) {
+            backends.push_back(io);
+        } else {
+            LOG(LOG_ERROR, "Failed to start port forwarding thread %d", i);
+            delete io;
+        }
     }
+    threads = (int)backends.size();
+    options.threads = threads;
+    for (int i = 0; i < threads; ++i) {
+        Shard *shard = new Shard(i, threads);
+        shard->io = backends[i];
+        shards.push_back(shard);
+    }
+    resolver = new Resolver(*this, RESOLVER_THREADS, lookup);
+    LOG(LOG_INFO, "Port forwarding with %d threads, %d reads per connection", threads,
+        options.read_depth);
 }
 
-void Acceptor::get_accept_sockaddrs(LPSOCKADDR_IN *localAddr, LPSOCKADDR_IN *remoteAddr)
+PortForwarder::~PortForwarder()
 {
-    static LPFN_GETACCEPTEXSOCKADDRS real_get_accept_sockaddrs =
-        (LPFN_GETACCEPTEXSOCKADDRS)load_function(sock, get_sockaddr_guid);
-    int addrLen = sizeof(SOCKADDR_IN);
-    if (real_get_accept_sockaddrs) {
-        real_get_accept_sockaddrs(addrBuffer, 0, sizeOfAddress, sizeOfAddress,
-                                  (LPSOCKADDR *)localAddr, &addrLen,
-                                  (LPSOCKADDR *)remoteAddr, &addrLen);
-    } else {
-        WSASetLastError(WSASYSCALLFAILURE);
+    LOG(LOG_INFO, "Client disconnected, removing port redirections");
+    delete resolver;
+    close_all();
+    // The operations that did not complete yet are abandoned by the backends
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards[i]->io->stop();
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        std::vector<Connection *> conns;
+        shards[i]->connections.list(conns);
+        for (size_t j = 0; j < conns.size(); ++j) {
+            Connection &conn = *conns[j];
+            for (uint32_t seq = conn.deliver_seq; seq != conn.read_seq; ++seq) {
+                if (conn.queued_read(seq).buf) {
+                    free_read_buffer(conn.queued_read(seq).buf);
+                }
+            }
+        }
+        shards[i]->connections.clear();
+        delete shards[i]->io;
+        delete shards[i];
     }
+    write_pool.log_stats("Port forwarding write");
 }
 
-struct OverlappedOperation : public OVERLAPPED {
-    OverlappedOperation() {
-        uint8_t *p = (uint8_t *)static_cast<OVERLAPPED *>(this);
-        std::fill(p, p + sizeof(OVERLAPPED), 0);
+void PortForwarder::close_all()
+{
+    MutexLocker lock(mutex);
+    acceptors.clear();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        Shard &shard = *shards[i];
+        MutexLocker shard_lock(shard.mutex);
+        std::vector<Connection *> conns;
+        shard.connections.list(conns);
+        for (size_t j = 0; j < conns.size(); ++j) {
+            close_connection(shard, *conns[j]);
+        }
     }
-    virtual ~OverlappedOperation() {}
-    virtual void handle_to(PortForwarder &pf, DWORD bytes) = 0;
-    bool check_pending() {
-        const DWORD lastError = ::WSAGetLastError();
-        if (lastError != ERROR_IO_PENDING) {
-            LOG(LOG_WARN, "Overlapped IO error: %s", getErrorMessage(lastError));
-            return false;
-        } else {
-            LOG(LOG_DEBUG, "Pending io operation %p", this);
-            return true;
+}
+
+// Closing the socket cancels the pending operations, and the connection is
+// removed when the last one completes
+void PortForwarder::close_connection(Shard &shard, Connection &conn)
+{
+    if (conn.sock != INVALID_SOCKET) {
+        conn.io->close(conn.sock);
+        conn.sock = INVALID_SOCKET;
+    }
+    if (!conn.closed) {
+        end_stall(shard, conn);
+        shard.metrics.closed++;
+        vd_atomic_add(&live_connections, -1);
+    }
+    conn.closed = true;
+    if (conn.batch) {
+        free_read_buffer(conn.batch);
+        conn.batch = NULL;
+    }
+    // Completed reads waiting for an earlier one are dropped
+    for (uint32_t seq = conn.deliver_seq; seq != conn.read_seq; ++seq) {
+        Connection::Read &read = conn.queued_read(seq);
+        if (read.done && read.buf) {
+            free_read_buffer(read.buf);
+            read.buf = NULL;
         }
     }
-};
+    shard.connections.detach(conn);
+    if (!conn.pending()) {
+        shard.connections.remove(conn);
+    }
+}
 
-struct AcceptOperation : public OverlappedOperation {
-    uint16_t port;
-    SOCKET client;
+void PortForwarder::free_read_buffer(void *buf)
+{
+    sender.free_buffer((uint8_t *)buf - DATA_HEAD_SIZE);
+}
 
-    AcceptOperation() : OverlappedOperation() {
-        client = socket(AF_INET, SOCK_STREAM, 0);
-        LOG(LOG_DEBUG, "Created accept operation %p for client socket %d", this, client);
+bool PortForwarder::post_read(Connection &conn)
+{
+    VDAgentPortForwardDataMessage *msg =
+        (VDAgentPortForwardDataMessage *)sender.get_buffer(MAX_MSG_SIZE);
+    if (!msg) {
+        return false;
     }
-    virtual ~AcceptOperation() {
-        if (client != INVALID_SOCKET) {
-            LOG(LOG_DEBUG, "Closing unaccepted client in operation %p for client socket %d",
-                this, client);
-            shutdown(client, SD_BOTH);
-            closesocket(client);
-        }
+    if (!conn.io->post_read(conn.sock, conn.handle, msg->data, READ_BUFFER_SIZE)) {
+        sender.free_buffer(msg);
+        return false;
     }
-    virtual void handle_to(PortForwarder &pf, DWORD bytes) {
-        pf.handle_accept(port, client);
-        client = INVALID_SOCKET;
+    Connection::Read &read = conn.queued_read(conn.read_seq++);
+    read.buf = msg->data;
+    read.done = false;
+    conn.reading++;
+    return true;
+}
+
+// Keeps up to options.read_depth reads queued while the window and the
+// outbound budget allow. A connection that cannot post any read would never
+// be heard from again, so it is aborted; returns false then, and conn may be
+// gone. A connection the client closed only waits for its writes, and its
+// reads would be dropped, so it posts none.
+bool PortForwarder::post_reads(Shard &shard, Connection &conn)
+{
+    if (conn.closing) {
+        return true;
     }
-    static bool post(Acceptor & acceptor, HANDLE iocp)
-    {
-        AcceptOperation *operation = new AcceptOperation;
-        operation->port = acceptor.port;
-        if(!acceptor.accept_ex(operation->client, operation)) {
-            if(!operation->check_pending()) {
-                // TODO: Error
-                LOG(LOG_DEBUG, "Posting accept operation %p failed", operation);
-                delete operation;
-                return false;
+    while (conn.reads_queued() < options.read_depth) {
+        if (!may_read(conn)) {
+            if (!conn.reads_queued() && !conn.stall_start) {
+                conn.stall_start = now_us();
+                conn.stalls++;
+                shard.metrics.stalls++;
             }
-        } else {
-            // Operation completed synchronously, post data to io thread.
-            LOG(LOG_DEBUG, "Accept operation %p completed synchronously, posting", operation);
-            ::PostQueuedCompletionStatus(iocp, 0, 0, operation);
+            break;
         }
-        return true;
-    }
-};
-
-struct ReadOperation : public OverlappedOperation {
-    static const size_t MAX_MSG_SIZE = VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage);
-    static const size_t DATA_HEAD_SIZE = sizeof(VDAgentPortForwardDataMessage);
-    static const size_t BUFFER_SIZE = MAX_MSG_SIZE - DATA_HEAD_SIZE;
-    int id;
-    char *data_msg_buffer;
-    WSABUF buffer[1];
-
-    ReadOperation(char *b) : OverlappedOperation(), data_msg_buffer(b) {
-        buffer->len = BUFFER_SIZE;
-        buffer->buf = data_msg_buffer + DATA_HEAD_SIZE;
-        LOG(LOG_DEBUG, "Created read operation %p", this);
-    }
-    virtual ~ReadOperation() {}
-    virtual void handle_to(PortForwarder &pf, DWORD bytes) {
-        pf.handle_read(id, (VDAgentPortForwardDataMessage *)data_msg_buffer, bytes);
-    }
-    static bool post(Connection & conn, PortForwarder::Sender &sender) {
-        char *read_buffer = (char *)sender.get_buffer(MAX_MSG_SIZE);
-        ReadOperation *operation = new ReadOperation(read_buffer);
-        operation->id = conn.id;
-        DWORD f = 0;
-        if (WSARecv(conn.sock, operation->buffer,
-                    1, NULL, &f, operation, NULL) == SOCKET_ERROR) {
-            if (!operation->check_pending()) {
-                // TODO: Error
-                LOG(LOG_DEBUG, "Posting read operation %p failed", operation);
-                delete operation;
+        end_stall(shard, conn);
+        if (wait_transport(shard, conn)) {
+            break;
+        }
+        if (!post_read(conn)) {
+            if (!conn.reads_queued()) {
+                LOG(LOG_WARN, "Failed to read from connection %d", conn.id);
+                abort_connection(shard, conn);
                 return false;
             }
-        } else
-            LOG(LOG_DEBUG, "Read operation %p completed synchronously", operation);
-        return true;
+            break;
+        }
     }
-};
+    return true;
+}
 
-struct WriteOperation : public OverlappedOperation {
-    int id;
-    WSABUF buffer[1];
+void PortForwarder::end_stall(Shard &shard, Connection &conn)
+{
+    if (conn.stall_start) {
+        uint64_t stalled = now_us() - conn.stall_start;
+        conn.stalled_us += stalled;
+        shard.metrics.stalled_us += stalled;
+        conn.stall_start = 0;
+    }
+}
 
-    WriteOperation() : OverlappedOperation() {
-        LOG(LOG_DEBUG, "Created write operation %p", this);
+// Sends the completed reads that are next in order, then posts new ones
+void PortForwarder::deliver_reads(Shard &shard, Connection &conn)
+{
+    while (conn.reads_queued() && conn.queued_read(conn.deliver_seq).done) {
+        Connection::Read &read = conn.queued_read(conn.deliver_seq++);
+        VDAgentPortForwardDataMessage *msg =
+            (VDAgentPortForwardDataMessage *)((uint8_t *)read.buf - DATA_HEAD_SIZE);
+        if (read.bytes == 0) {
+            // Connection closed by peer
+            sender.free_buffer(msg);
+            flush_batch(shard, conn);
+            VDAgentPortForwardCloseMessage *closeMsg =
+                sender.get_buffer<VDAgentPortForwardCloseMessage>();
+            closeMsg->id = conn.id;
+            sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
+            close_connection(shard, conn);
+            return;
+        } else if (conn.closing) {
+            sender.free_buffer(msg);
+        } else {
+            LOG(LOG_DEBUG, "%d bytes read on connection %d", (int)read.bytes, conn.id);
+            deliver_data(shard, conn, msg->data, read.bytes);
+        }
     }
-    virtual ~WriteOperation() {}
-    virtual void handle_to(PortForwarder &pf, DWORD bytes) {
-        pf.handle_write(id, bytes);
+    post_reads(shard, conn);
+}
+
+// Small reads that follow the previous data closely, like a stream of small
+// writes, are gathered in a batch while it fits in a message. The batch is
+// sent once it has batch_bytes, when a read does not fit or is not small, or
+// after batch_delay_us. An isolated small read, like a keystroke, is sent at
+// once.
+void PortForwarder::deliver_data(Shard &shard, Connection &conn, uint8_t *data, size_t bytes)
+{
+    if (!options.batch_delay_us) {
+        send_read_data(shard, conn, data, bytes);
+        return;
     }
-    static bool post(Connection & conn) {
-        WriteOperation *operation = new WriteOperation;
-        operation->id = conn.id;
-        conn.getWSABuffer(operation->buffer);
-        if(WSASend(conn.sock, operation->buffer,
-                   1, NULL, 0, operation, NULL) == SOCKET_ERROR) {
-            if (!operation->check_pending()) {
-                // TODO: Error
-                LOG(LOG_DEBUG, "Posting write operation %p failed", operation);
-                delete operation;
-                return false;
+    uint64_t now = now_us();
+    bool follows = now - conn.last_data < (uint64_t)options.batch_delay_us;
+    conn.last_data = now;
+    if (conn.batch) {
+        if (conn.batch_size + bytes <= READ_BUFFER_SIZE) {
+            std::copy(data, data + bytes, conn.batch + conn.batch_size);
+            conn.batch_size += bytes;
+            free_read_buffer(data);
+            shard.metrics.batched_reads++;
+            if (conn.batch_size >= (size_t)options.batch_bytes) {
+                flush_batch(shard, conn);
             }
-        } else
-            LOG(LOG_DEBUG, "Write operation %p completed synchronously", operation);
-        return true;
+            return;
+        }
+        flush_batch(shard, conn);
     }
-};
-
-struct ConnectOperation : public OverlappedOperation {
-    int id;
-
-    ConnectOperation() : OverlappedOperation() {
-        LOG(LOG_DEBUG, "Created connect operation %p", this);
+    if (!follows || bytes >= (size_t)options.batch_bytes) {
+        send_read_data(shard, conn, data, bytes);
+        return;
     }
-    virtual ~ConnectOperation() {}
-    virtual void handle_to(PortForwarder &pf, DWORD bytes) {
-        pf.handle_connect(id);
+    conn.batch = data;
+    conn.batch_size = bytes;
+    conn.batch_deadline = now + options.batch_delay_us;
+    Shard::BatchTimeout timeout = {conn.handle, conn.batch_deadline};
+    shard.batches.push_back(timeout);
+    if (!shard.timer_deadline) {
+        shard.timer_deadline = conn.batch_deadline;
+        shard.io->set_timer(shard.index, options.batch_delay_us);
     }
-    static const GUID connectex_guid;
-    bool connect_ex(SOCKET sock, const SOCKADDR_IN &addr) {
-        static LPFN_CONNECTEX real_connect_ex =
-                (LPFN_CONNECTEX)load_function(sock, connectex_guid);
-        if (real_connect_ex) {
-            LOG(LOG_DEBUG, "Calling connect_ex for operation %p", this);
-            return real_connect_ex(sock, (const sockaddr*)&addr, sizeof(addr),
-                                   NULL, 0, NULL, this);
+}
+
+void PortForwarder::flush_batch(Shard &shard, Connection &conn)
+{
+    if (conn.batch) {
+        uint8_t *batch = conn.batch;
+        conn.batch = NULL;
+        if (conn.closing) {
+            free_read_buffer(batch);
         } else {
-            WSASetLastError(WSASYSCALLFAILURE);
-            return false;
+            send_read_data(shard, conn, batch, conn.batch_size);
         }
     }
-    static bool post(Connection & conn, const SOCKADDR_IN & serv_addr, HANDLE iocp) {
-        CreateIoCompletionPort((HANDLE)conn.sock, iocp, 0, 0);
-        SOCKADDR_IN host_addr;
-        std::fill_n((char *)&host_addr, sizeof(host_addr), 0);
-        host_addr.sin_family = AF_INET;
-        host_addr.sin_addr.s_addr = INADDR_ANY;
-        host_addr.sin_port = 0;
-        if (bind(conn.sock, (const sockaddr *)&host_addr, sizeof(host_addr)) == SOCKET_ERROR) {
-            LOG(LOG_ERROR, "Could not bind to local port on connect");
-            return false;
-        }
-        ConnectOperation *operation = new ConnectOperation;
-        operation->id = conn.id;
-        if (!operation->connect_ex(conn.sock, serv_addr)) {
-            if (!operation->check_pending()) {
-                // TODO: Error
-                LOG(LOG_DEBUG, "Posting connect operation %p failed", operation);
-                delete operation;
-                return false;
-            }
-        } else
-            LOG(LOG_DEBUG, "Connect operation %p completed synchronously", operation);
-        return true;
+}
+
+// Sends data in the message buffer of a read, which it releases
+void PortForwarder::send_read_data(Shard &shard, Connection &conn, uint8_t *data, size_t bytes)
+{
+    VDAgentPortForwardDataMessage *msg =
+        (VDAgentPortForwardDataMessage *)(data - DATA_HEAD_SIZE);
+    size_t sent = send_compressed(conn, data, bytes);
+    if (sent) {
+        sender.free_buffer(msg);
+    } else {
+        msg->id = conn.id;
+        msg->size = bytes;
+        sender.send(VD_AGENT_PORT_FORWARD_DATA, bytes + DATA_HEAD_SIZE, msg);
+        sent = bytes;
     }
-};
-const GUID ConnectOperation::connectex_guid = WSAID_CONNECTEX;
+    conn.data_read(bytes);
+    conn.bytes_sent += sent;
+    shard.metrics.bytes_read += bytes;
+    shard.metrics.bytes_sent += sent;
+    shard.metrics.data_messages++;
+}
 
-PortForwarder::PortForwarder(Sender& s)
-    : sender(s), has_client(true)
+// Sends the data of a read as a compressed message if the client takes them
+// and it saves an eighth at least. Returns the compressed size, or 0 if the
+// data is to be sent as it is.
+size_t PortForwarder::send_compressed(Connection &conn, const uint8_t *data, size_t bytes)
 {
-    WSADATA WsaDat;
-    // TODO: Check for errors and throw
-    WSAStartup(MAKEWORD(2, 2), &WsaDat);
-    iocp = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-    iocpThread = ::CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+    if (!compress || bytes < MIN_COMPRESS_SIZE) {
+        return 0;
+    }
+    if (conn.compress_skip) {
+        conn.compress_skip--;
+        return 0;
+    }
+    VDAgentPortForwardCompressedDataMessage *msg =
+        (VDAgentPortForwardCompressedDataMessage *)sender.get_buffer(MAX_MSG_SIZE);
+    if (!msg) {
+        return 0;
+    }
+    // The compressor gives up as soon as it goes over the limit, so data that
+    // does not compress costs little more than a scan
+    size_t limit = bytes - bytes / 8 - (COMPRESSED_HEAD_SIZE - DATA_HEAD_SIZE);
+    size_t size = lz4_compress_block(data, bytes, msg->data, limit);
+    if (!size) {
+        sender.free_buffer(msg);
+        conn.compress_skip = conn.compress_backoff;
+        conn.compress_backoff = std::min(conn.compress_backoff * 2, MAX_COMPRESS_BACKOFF);
+        return 0;
+    }
+    conn.compress_backoff = 1;
+    msg->id = conn.id;
+    msg->size = size;
+    msg->original_size = bytes;
+    sender.send(VD_AGENT_PORT_FORWARD_DATA_COMPRESSED, size + COMPRESSED_HEAD_SIZE, msg);
+    return size;
 }
 
-PortForwarder::~PortForwarder()
+// Each live connection gets an even share of GLOBAL_WINDOW, whatever its
+// shard. The MIN_WINDOW floor overrides that cap, so that the client always
+// has something to ACK and a paused connection is resumed by its own ACKs:
+// with more than GLOBAL_WINDOW / MIN_WINDOW connections, more than
+// GLOBAL_WINDOW may be unACKed.
+bool PortForwarder::may_read(Connection &conn)
 {
-    LOG(LOG_INFO, "Client disconnected, removing port redirections");
-    {
-        MutexLocker lock(mutex);
-        has_client = false;
-        connections.clear();
-        acceptors.clear();
-    }
-    PostQueuedCompletionStatus(iocp, 0, 0, NULL);
-    CloseHandle(iocp);
-    WaitForSingleObject(iocpThread, INFINITE);
-    CloseHandle(iocpThread);
-    WSACleanup();
-}
-
-void PortForwarder::handle_io_events()
-{
-    LOG(LOG_INFO, "Starting port forwarding thread.");
-    while (has_client) {
-        DWORD bytes;
-        ULONG_PTR key;
-        LPOVERLAPPED overlapped = NULL;
-        bool success = GetQueuedCompletionStatus(iocp, &bytes, &key, &overlapped, INFINITE);
-        OverlappedOperation * operation = static_cast<OverlappedOperation *>(overlapped);
-        if (operation) {
-            if (!success) {
-                // Operation failed (probably canceled)
-                LOG(LOG_DEBUG, "IO operation %p failed: %s", operation,
-                    getErrorMessage(WSAGetLastError()));
-            } else {
-                LOG(LOG_DEBUG, "IO operation %p finished", operation);
-                MutexLocker lock(mutex);
-                operation->handle_to(*this, bytes);
+    long live = std::max(1L, vd_atomic_load(&live_connections));
+    uint64_t window = std::min<uint64_t>(conn.window, GLOBAL_WINDOW / live);
+    return conn.data_sent < std::max<uint64_t>(window, Connection::MIN_WINDOW);
+}
+
+// The data of every read ends up in the sender's queue, which is only
+// drained as fast as the port is written. Over budget, the connection waits
+// for transport_drained(). The sender can only go down to the low water mark
+// after this check, and the shard lock keeps transport_drained() from
+// looking at the waiting list before the connection is in it.
+bool PortForwarder::wait_transport(Shard &shard, Connection &conn)
+{
+    if (!options.outbound_budget || sender.queued_bytes() < options.outbound_budget) {
+        return false;
+    }
+    if (!conn.waiting_transport) {
+        conn.waiting_transport = true;
+        shard.waiting.push_back(conn.handle);
+        shard.metrics.transport_waits++;
+    }
+    return true;
+}
+
+void PortForwarder::transport_drained()
+{
+    for (size_t i = 0; i < shards.size(); ++i) {
+        Shard &shard = *shards[i];
+        MutexLocker lock(shard.mutex);
+        std::vector<conn_id_t> waiting;
+        waiting.swap(shard.waiting);
+        for (size_t j = 0; j < waiting.size(); ++j) {
+            Connection *conn = shard.connections.find_handle(waiting[j]);
+            if (!conn) {
+                continue;
+            }
+            conn->waiting_transport = false;
+            if (!conn->closed) {
+                post_reads(shard, *conn);
             }
-            delete operation;
         }
     }
-    LOG(LOG_INFO, "Ending port forwarding thread.");
+}
+
+// A connection whose queued data cannot be written would stall for good, so
+// it is aborted like one that cannot read, unless the client already closed
+// it; returns false then, and conn is gone.
+bool PortForwarder::post_write(Shard &shard, Connection &conn)
+{
+    VDIOVec iov[PFIOBackend::MAX_IOV];
+    int count = conn.write_buffer.get_iov(iov, PFIOBackend::MAX_IOV, MAX_WRITE_SIZE);
+    conn.writing = conn.io->post_write(conn.sock, conn.handle, iov, count);
+    if (!conn.writing) {
+        LOG(LOG_WARN, "Failed to write to connection %d", conn.id);
+        if (conn.closing) {
+            close_connection(shard, conn);
+        } else {
+            abort_connection(shard, conn);
+        }
+        return false;
+    }
+    return true;
 }
 
 void PortForwarder::handle_accept(uint16_t port, SOCKET client)
 {
-    accept_iter acceptit = acceptors.find(port);
-    if (acceptit == acceptors.end()) {
-        LOG(LOG_ERROR, "Unknown port %d in operation %p", port, this);
-        // TODO: Error
+    PFIOBackend *listen_io = shards[0]->io;
+    size_t shard_index;
+    {
+        MutexLocker lock(mutex);
+        accept_iter acceptit = acceptors.find(port);
+        if (acceptit == acceptors.end()) {
+            LOG(LOG_ERROR, "Unknown port %d in operation %p", port, this);
+            listen_io->close(client);
+            return;
+        }
+        listen_io->post_accept(acceptit->second.sock, port);
+        // Accepted connections are spread in turns
+        shard_index = next_shard;
+        next_shard = (next_shard + 1) % shards.size();
+    }
+    Shard &shard = *shards[shard_index];
+    if (!shard.io->adopt(client)) {
+        LOG(LOG_WARN, "Failed to set up a connection on port %d", port);
+        listen_io->close(client);
         return;
     }
-    Acceptor &acceptor = acceptit->second;
-    char update_context[sizeof(DWORD)];
-    *((DWORD *)update_context) = acceptor.sock;
-    setsockopt(client, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, update_context, sizeof(DWORD));
-    conn_id_t id = Connection::generateConnectionId();
+    MutexLocker lock(shard.mutex);
+    Connection *new_conn = shard.connections.add();
+    if (!new_conn) {
+        LOG(LOG_WARN, "Too many connections, refusing one on port %d", port);
+        shard.io->close(client);
+        return;
+    }
+    vd_atomic_add(&live_connections, 1);
+    Connection &conn = *new_conn;
+    conn_id_t id = conn.id;
     LOG(LOG_DEBUG, "Connection %d accepted on port %d", id, port);
-    Connection &conn = connections[id];
+    conn.io = shard.io;
+    conn.write_buffer.pool = &write_pool;
     conn.sock = client;
-    conn.id = id;
-    CreateIoCompletionPort((HANDLE)client, iocp, 0, 0);
+    conn.port = port;
+    conn.created = now_us();
+    shard.metrics.accepted++;
     VDAgentPortForwardAcceptedMessage *msg =
         sender.get_buffer<VDAgentPortForwardAcceptedMessage>();
     msg->port = port;
     msg->id = id;
-    msg->ack_interval = Connection::WINDOW_SIZE / 2;
+    msg->ack_interval = Connection::ACK_INTERVAL;
     sender.send(VD_AGENT_PORT_FORWARD_ACCEPTED, msg);
-    AcceptOperation::post(acceptor, iocp);
 }
 
-void PortForwarder::handle_read(int id, VDAgentPortForwardDataMessage *msg, DWORD bytes)
+// Backend callbacks get the handle of the connection. Completions of a closed
+// connection only release their resources.
+void PortForwarder::handle_read(int handle, void *buf, size_t bytes)
 {
-    conn_iter connit = connections.find(id);
-    if (connit == connections.end()) {
-        LOG(LOG_ERROR, "Unknown connection %d in operation %p", id, this);
-        // TODO: Error
+    VDAgentPortForwardDataMessage *msg =
+        (VDAgentPortForwardDataMessage *)((uint8_t *)buf - DATA_HEAD_SIZE);
+    Shard &shard = shard_of(handle);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find_handle(handle);
+    if (!connp) {
+        LOG(LOG_ERROR, "Unknown connection %d in operation %p", handle, this);
+        sender.free_buffer(msg);
         return;
     }
-    if (bytes == 0) {
-        // Connection closed by peer
-        VDAgentPortForwardCloseMessage *closeMsg =
-            sender.get_buffer<VDAgentPortForwardCloseMessage>();
-        closeMsg->id = id;
-        sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
-        connections.erase(connit);
-    } else if (!connit->second.closing) {
-        Connection &conn = connit->second;
-        LOG(LOG_DEBUG, "%d bytes read on connection %d", bytes, id);
-        msg->id = id;
-        msg->size = bytes;
-        sender.send(VD_AGENT_PORT_FORWARD_DATA, bytes + ReadOperation::DATA_HEAD_SIZE, msg);
-        conn.data_sent += bytes;
-        if (conn.data_sent < Connection::WINDOW_SIZE) {
-            if (!ReadOperation::post(conn, sender)) {
-                // TODO: Error
-            }
-        }
+    Connection &conn = *connp;
+    Connection::Read *read = conn.find_read(buf);
+    conn.reading--;
+    if (conn.closed) {
+        read->buf = NULL;
+        sender.free_buffer(msg);
+        close_connection(shard, conn);
+    } else {
+        read->done = true;
+        read->bytes = bytes;
+        deliver_reads(shard, conn);
     }
 }
 
-void PortForwarder::handle_write(int id, DWORD bytes)
+void PortForwarder::handle_write(int handle, size_t bytes)
 {
-    conn_iter connit = connections.find(id);
-    if (connit == connections.end()) {
-        LOG(LOG_ERROR, "Unknown connection %d in operation %p", id, this);
-        // TODO: Error
+    Shard &shard = shard_of(handle);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find_handle(handle);
+    if (!connp) {
+        LOG(LOG_ERROR, "Unknown connection %d in operation %p", handle, this);
         return;
     }
-    if (bytes == 0) {
-        LOG(LOG_DEBUG, "We read 0 bytes in connection %d", id);
+    Connection &conn = *connp;
+    conn.writing = false;
+    if (conn.closed) {
+        close_connection(shard, conn);
+    } else if (bytes == 0) {
+        LOG(LOG_DEBUG, "We read 0 bytes in connection %d", conn.id);
         // TODO: is this a closed connection??
     } else {
-        Connection &conn = connit->second;
         conn.data_received += bytes;
+        conn.bytes_written += bytes;
+        shard.metrics.bytes_written += bytes;
         if (conn.data_received >= conn.ack_interval) {
             VDAgentPortForwardAckMessage *ackMsg =
                 sender.get_buffer<VDAgentPortForwardAckMessage>();
-            ackMsg->id = id;
+            ackMsg->id = conn.id;
             ackMsg->size = conn.data_received;
             conn.data_received = 0;
             sender.send(VD_AGENT_PORT_FORWARD_ACK, ackMsg);
         }
-        Buffer &buffer = conn.write_buffer.front();
-        buffer.pos += bytes;
-        if (buffer.pos == buffer.size) {
-            conn.write_buffer.pop_front();
-        }
+        conn.write_buffer.consume(bytes);
         if (!conn.write_buffer.empty()) {
-            if (!WriteOperation::post(conn)) {
-                // TODO: Error
-            }
+            post_write(shard, conn);
         } else if (conn.closing) {
-            connections.erase(connit);
+            close_connection(shard, conn);
         }
     }
 }
 
-void PortForwarder::handle_connect(int id)
+void PortForwarder::handle_connect(int handle)
 {
-    conn_iter connit = connections.find(id);
-    if (connit == connections.end()) {
-        LOG(LOG_ERROR, "Unknown connection %d in operation %p", id, this);
-        // TODO: Error
+    Shard &shard = shard_of(handle);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find_handle(handle);
+    if (!connp) {
+        LOG(LOG_ERROR, "Unknown connection %d in operation %p", handle, this);
         return;
+    } else if (connp->closed) {
+        connp->connecting = false;
+        close_connection(shard, *connp);
     } else {
-        Connection &conn = connit->second;
-        conn.acked = TRUE;
+        Connection &conn = *connp;
+        conn_id_t id = conn.id;
+        conn.acked = true;
+        conn.connecting = false;
+        shard.metrics.connected++;
         LOG(LOG_DEBUG, "Connection established with id %d", id);
         VDAgentPortForwardAckMessage *ackMsg =
             sender.get_buffer<VDAgentPortForwardAckMessage>();
         ackMsg->id = id;
-        ackMsg->size = Connection::WINDOW_SIZE / 2;
+        ackMsg->size = Connection::ACK_INTERVAL;
         sender.send(VD_AGENT_PORT_FORWARD_ACK, ackMsg);
-        // Program a read operation
-        if (!ReadOperation::post(conn, sender)) {
-            // TODO: Error
+        if (!post_reads(shard, conn)) {
+            return;
         }
+        if (!conn.write_buffer.empty()) {
+            post_write(shard, conn);
+        }
+    }
+}
+
+// The client is told that the connection is lost, unless it closed it
+void PortForwarder::handle_failed(int handle, Operation op, void *buf)
+{
+    Shard &shard = shard_of(handle);
+    MutexLocker lock(shard.mutex);
+    if (op == OP_READ) {
+        free_read_buffer(buf);
+    }
+    Connection *connp = shard.connections.find_handle(handle);
+    if (!connp) {
+        LOG(LOG_ERROR, "Unknown connection %d in operation %p", handle, this);
+        return;
+    }
+    Connection &conn = *connp;
+    switch (op) {
+    case OP_CONNECT:
+        conn.connecting = false;
+        break;
+    case OP_READ:
+        conn.reading--;
+        conn.find_read(buf)->buf = NULL;
+        break;
+    case OP_WRITE:
+        conn.writing = false;
+        break;
+    }
+    if (!conn.closed) {
+        shard.metrics.failed++;
+    }
+    if (!conn.closed && !conn.closing) {
+        LOG(LOG_DEBUG, "Connection %d failed", conn.id);
+        VDAgentPortForwardCloseMessage *closeMsg =
+            sender.get_buffer<VDAgentPortForwardCloseMessage>();
+        closeMsg->id = conn.id;
+        sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
+    }
+    close_connection(shard, conn);
+}
+
+// Sends the batches that timed out. A batch that was sent before its timeout
+// is skipped, even if its connection started another one since.
+void PortForwarder::handle_timer(int index)
+{
+    Shard &shard = *shards[index];
+    MutexLocker lock(shard.mutex);
+    uint64_t now = now_us();
+    shard.timer_deadline = 0;
+    while (!shard.batches.empty()) {
+        const Shard::BatchTimeout &timeout = shard.batches.front();
+        if (timeout.deadline > now) {
+            shard.timer_deadline = timeout.deadline;
+            shard.io->set_timer(index, (uint32_t)(timeout.deadline - now));
+            break;
+        }
+        Connection *connp = shard.connections.find_handle(timeout.handle);
+        if (connp && connp->batch && connp->batch_deadline == timeout.deadline) {
+            flush_batch(shard, *connp);
+        }
+        shard.batches.pop_front();
     }
 }
 
 void PortForwarder::connect_remote(VDAgentPortForwardConnectMessage& msg)
 {
-    SOCKADDR_IN serv_addr;
-    int addr_len = sizeof(serv_addr);
-    std::fill_n((char *)&serv_addr, addr_len, 0);
-    int id = msg.id;
-    int port = msg.port;
+    Shard &shard = shard_of(msg.id);
+    HostRequest *request = new HostRequest;
+    {
+        MutexLocker lock(shard.mutex);
+        Connection *connp = shard.connections.add(msg.id);
+        if (!connp) {
+            LOG(LOG_WARN, "Connection %d already exists or too many connections", msg.id);
+            VDAgentPortForwardCloseMessage *closeMsg =
+                sender.get_buffer<VDAgentPortForwardCloseMessage>();
+            closeMsg->id = msg.id;
+            sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
+            delete request;
+            return;
+        }
+        vd_atomic_add(&live_connections, 1);
+        // Data for the connection is queued until it is established
+        Connection &conn = *connp;
+        conn.io = shard.io;
+        conn.write_buffer.pool = &write_pool;
+        conn.ack_interval = msg.ack_interval;
+        conn.connecting = true;
+        conn.port = msg.port;
+        conn.created = now_us();
+        request->handle = conn.handle;
+    }
+    request->host = msg.host;
+    request->port = msg.port;
+    request->passive = false;
+    resolver->resolve(request);
+}
 
-    // TODO: gethostbyname is potentially blocking...
-    struct hostent *server = gethostbyname(msg.host);
-    if (!server) {
-        LOG(LOG_WARN, "Host %s not found", msg.host);
+void PortForwarder::connect_resolved(HostRequest &request, const ResolvedAddress *addr)
+{
+    Shard &shard = shard_of(request.handle);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find_handle(request.handle);
+    if (!connp) {
+        LOG(LOG_ERROR, "Unknown connection %d resolving %s", request.handle,
+            request.host.c_str());
         return;
     }
-    serv_addr.sin_family = AF_INET;
-    std::copy((char *)server->h_addr, (char *)server->h_addr + server->h_length,
-              (char *)&serv_addr.sin_addr.s_addr);
-    serv_addr.sin_port = htons(port);
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd != INVALID_SOCKET) {
-        LOG(LOG_DEBUG, "Connecting ID %d to %s:%d", id, msg.host, port);
-        Connection &conn = connections[id];
-        conn.sock = sockfd;
-        conn.id = id;
-        conn.ack_interval = msg.ack_interval;
-        ConnectOperation::post(conn, serv_addr, iocp);
+    Connection &conn = *connp;
+    if (conn.closed) {
+        LOG(LOG_DEBUG, "Connection %d closed while resolving %s", conn.id,
+            request.host.c_str());
+        conn.connecting = false;
+        close_connection(shard, conn);
+        return;
+    }
+    if (!addr) {
+        LOG(LOG_WARN, "Host %s not found", request.host.c_str());
     } else {
-        LOG(LOG_WARN, "Error creating socket");
+        LOG(LOG_DEBUG, "Connecting ID %d to %s:%d", conn.id, request.host.c_str(),
+            (int)request.port);
+        conn.sock = shard.io->connect(&addr->addr, addr->len, conn.handle);
+    }
+    if (conn.sock == INVALID_SOCKET) {
+        VDAgentPortForwardCloseMessage *closeMsg =
+            sender.get_buffer<VDAgentPortForwardCloseMessage>();
+        closeMsg->id = conn.id;
+        sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
+        conn.connecting = false;
+        close_connection(shard, conn);
     }
 }
 
 void PortForwarder::ack_data(VDAgentPortForwardAckMessage& msg)
 {
-    conn_iter connit = connections.find(msg.id);
-    if (connit == connections.end()) {
+    Shard &shard = shard_of(msg.id);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find(msg.id);
+    if (!connp) {
         LOG(LOG_ERROR, "Unknown connection %d from client ACK", msg.id);
         // TODO: Error
     } else {
-        Connection &conn = connit->second;
+        Connection &conn = *connp;
         if (conn.acked) {
-            uint32_t data_sent_before = conn.data_sent;
-            conn.data_sent -= msg.size;
-            if (conn.data_sent < Connection::WINDOW_SIZE &&
-                    data_sent_before >= Connection::WINDOW_SIZE) {
-                // Program a read operation
-                if (!ReadOperation::post(conn, sender)) {
-                    // TODO: Error
-                }
-            }
+            conn.data_acked(msg.size);
+            post_reads(shard, conn);
         } else {
             conn.acked = true;
             conn.ack_interval = msg.size;
-            // Program a read operation
-            if (!ReadOperation::post(conn, sender)) {
-                // TODO: Error
-            }
+            post_reads(shard, conn);
         }
     }
 }
 
 void PortForwarder::start_closing(VDAgentPortForwardCloseMessage& msg)
 {
-    conn_iter connit = connections.find(msg.id);
-    if (connit == connections.end()) {
+    Shard &shard = shard_of(msg.id);
+    MutexLocker lock(shard.mutex);
+    Connection *connp = shard.connections.find(msg.id);
+    if (!connp) {
         LOG(LOG_ERROR, "Unknown connection %d from client", msg.id);
         // TODO: Error
     } else {
-        Connection &conn = connit->second;
+        Connection &conn = *connp;
         LOG(LOG_DEBUG, "Client closed connection %d", msg.id);
         if (!conn.write_buffer.empty()) {
             conn.closing = true;
             conn.acked = false;
         } else {
-            connections.erase(connit);
+            close_connection(shard, conn);
         }
     }
 }
 
 void PortForwarder::listen_to(VDAgentPortForwardListenMessage& msg)
 {
-    SOCKET sock;
-    SOCKADDR_IN addr;
     LOG(LOG_DEBUG, "Listening to %s:%d", msg.bind_address, (int)msg.port);
-
-    if (acceptors.find(msg.port) != acceptors.end()) {
-        LOG(LOG_INFO, "Already listening to port %d", (int)msg.port);
-    } else {
-        // TODO: gethostbyname is potentially blocking...
-        struct hostent *host = gethostbyname(msg.bind_address);
-        if (!host) {
-            LOG(LOG_WARN, "Host %s not found", msg.bind_address);
+    {
+        MutexLocker lock(mutex);
+        if (acceptors.find(msg.port) != acceptors.end()) {
+            LOG(LOG_INFO, "Already listening to port %d", (int)msg.port);
             return;
         }
-        addr.sin_family = AF_INET;
-        std::copy((char *)host->h_addr, (char *)host->h_addr + host->h_length,
-                  (char *)&addr.sin_addr.s_addr);
-        addr.sin_port = htons(msg.port);
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        char true_placeholder[sizeof(BOOL)];
-        *((BOOL *)true_placeholder) = 1;
-        if (sock == INVALID_SOCKET ||
-            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, true_placeholder, sizeof(BOOL)) ||
-            bind(sock, (LPSOCKADDR) &addr, sizeof(addr)) == SOCKET_ERROR ||
-            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, true_placeholder, sizeof(BOOL)) ||
-            listen(sock, 5)) {
-            LOG(LOG_ERROR, "Failed to listen to port %d: %s", (int)msg.port,
-                getErrorMessage(WSAGetLastError()));
-        } else {
-            CreateIoCompletionPort((HANDLE)sock, iocp, 0, 0);
-            Acceptor &acceptor = acceptors[msg.port];
-            acceptor.sock = sock;
-            acceptor.port = msg.port;
-            if (!AcceptOperation::post(acceptor, iocp)) {
+    }
+    HostRequest *request = new HostRequest;
+    request->host = msg.bind_address;
+    request->port = msg.port;
+    request->passive = true;
+    request->handle = 0;
+    resolver->resolve(request);
+}
+
+void PortForwarder::listen_resolved(HostRequest &request, const ResolvedAddress *addr)
+{
+    PFIOBackend *io = shards[0]->io;
+    if (!addr) {
+        LOG(LOG_WARN, "Host %s not found", request.host.c_str());
+        return;
+    }
+    MutexLocker lock(mutex);
+    if (acceptors.find(request.port) != acceptors.end()) {
+        LOG(LOG_INFO, "Already listening to port %d", (int)request.port);
+        return;
+    }
+    SOCKET sock = io->listen(&addr->addr, addr->len, options.listen_backlog);
+    if (sock != INVALID_SOCKET) {
+        Acceptor &acceptor = acceptors[request.port];
+        acceptor.io = io;
+        acceptor.sock = sock;
+        acceptor.port = request.port;
+        // Each accepted connection posts another one, so that a burst of
+        // connections does not wait for the handler in between
+        for (int i = 0; i < options.accept_depth; ++i) {
+            if (!io->post_accept(sock, request.port)) {
                 // TODO: Error
             }
         }
     }
 }
 
+void PortForwarder::handle_resolved(Resolver::Request &request, const ResolvedAddress *addr)
+{
+    HostRequest &host_request = static_cast<HostRequest &>(request);
+    if (request.passive) {
+        listen_resolved(host_request, addr);
+    } else {
+        connect_resolved(host_request, addr);
+    }
+}
+
 void PortForwarder::send_data(const VDAgentPortForwardDataMessage& msg)
 {
-    if (msg.size) {
-        conn_iter it = connections.find(msg.id);
-        if (it != connections.end()) {
-            Connection & conn = it->second;
-            conn.add_data_to_write_buffer(msg.data, msg.size);
-            if (conn.write_buffer.size() == 1) {
-                if (!WriteOperation::post(conn)) {
-                    // TODO: Error
-                }
+    queue_data(msg.id, msg.data, msg.size);
+}
+
+void PortForwarder::send_compressed_data(const VDAgentPortForwardCompressedDataMessage& msg)
+{
+    if (!msg.original_size) {
+        return;
+    }
+    int size = -1;
+    if (msg.original_size <= Connection::WINDOW_SIZE) {
+        if (inflate_buffer.size() < msg.original_size) {
+            inflate_buffer.resize(msg.original_size);
+        }
+        size = lz4_decompress_block(msg.data, msg.size, &inflate_buffer[0], msg.original_size);
+    }
+    if (size != (int)msg.original_size) {
+        Shard &shard = shard_of(msg.id);
+        MutexLocker lock(shard.mutex);
+        Connection *connp = shard.connections.find(msg.id);
+        if (connp) {
+            LOG(LOG_WARN, "Client sent bad compressed data on connection %d, closing it",
+                msg.id);
+            abort_connection(shard, *connp);
+        }
+        return;
+    }
+    queue_data(msg.id, &inflate_buffer[0], size);
+}
+
+void PortForwarder::queue_data(conn_id_t id, const uint8_t *data, size_t size)
+{
+    if (size) {
+        Shard &shard = shard_of(id);
+        MutexLocker lock(shard.mutex);
+        Connection *connp = shard.connections.find(id);
+        if (connp) {
+            Connection & conn = *connp;
+            if (conn.write_buffer.size + size > Connection::WINDOW_SIZE) {
+                // The client should wait for our ACKs before sending more
+                LOG(LOG_WARN, "Client overflowed the window of connection %d, closing it", id);
+                abort_connection(shard, conn);
+                return;
+            }
+            conn.write_buffer.append(data, size);
+            if (!conn.writing && !conn.connecting) {
+                post_write(shard, conn);
             }
         }
         /* Ignore unknown connections, they happen when data messages
@@ -620,22 +1438,174 @@ void PortForwarder::send_data(const VDAgentPortForwardDataMessage& msg)
     }
 }
 
+// Closes a connection the client still thinks open, and tells it
+void PortForwarder::abort_connection(Shard &shard, Connection &conn)
+{
+    VDAgentPortForwardCloseMessage *closeMsg =
+        sender.get_buffer<VDAgentPortForwardCloseMessage>();
+    closeMsg->id = conn.id;
+    sender.send(VD_AGENT_PORT_FORWARD_CLOSE, closeMsg);
+    close_connection(shard, conn);
+}
+
 void PortForwarder::shutdown_port(uint16_t port)
 {
     if (port == 0) {
         LOG(LOG_DEBUG, "Resetting port forwarder by client");
-        connections.clear();
-        acceptors.clear();
-    } else if (!acceptors.erase(port)) {
+        close_all();
+        return;
+    }
+    MutexLocker lock(mutex);
+    if (!acceptors.erase(port)) {
         LOG(LOG_WARN, "Not listening to port %d on shutdown command", port);
     }
 }
 
-bool PortForwarder::dispatch(uint32_t command, void* data)
+static void append_metric(std::string &out, const char *key, uint64_t value)
 {
-    LOG(LOG_DEBUG, "Receiving command %d", (int)command);
-    has_client = true;
+    char digits[21];
+    char *p = digits + sizeof(digits);
+    *--p = '\0';
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    out += ' ';
+    out += key;
+    out += '=';
+    out += p;
+}
+
+// A line for the forwarder, then one per open connection, each of them a
+// name followed by key=value pairs. Times are in milliseconds, the stalls of
+// the connections that are stalled at the moment included.
+std::string PortForwarder::metrics()
+{
+    uint64_t now = now_us();
+    ShardMetrics totals = ShardMetrics();
+    uint64_t open = 0, queued = 0;
+    std::string lines;
+
+    for (size_t i = 0; i < shards.size(); ++i) {
+        Shard &shard = *shards[i];
+        MutexLocker lock(shard.mutex);
+        const ShardMetrics &metrics = shard.metrics;
+        totals.accepted += metrics.accepted;
+        totals.connected += metrics.connected;
+        totals.closed += metrics.closed;
+        totals.failed += metrics.failed;
+        totals.bytes_read += metrics.bytes_read;
+        totals.bytes_written += metrics.bytes_written;
+        totals.bytes_sent += metrics.bytes_sent;
+        totals.data_messages += metrics.data_messages;
+        totals.batched_reads += metrics.batched_reads;
+        totals.stalls += metrics.stalls;
+        totals.stalled_us += metrics.stalled_us;
+        totals.transport_waits += metrics.transport_waits;
+        std::vector<Connection *> conns;
+        shard.connections.list(conns);
+        for (size_t j = 0; j < conns.size(); ++j) {
+            const Connection &conn = *conns[j];
+            if (conn.closed) {
+                continue;
+            }
+            uint64_t stalled_us = conn.stalled_us;
+            if (conn.stall_start) {
+                stalled_us += now - conn.stall_start;
+                totals.stalled_us += now - conn.stall_start;
+            }
+            open++;
+            queued += conn.write_buffer.size;
+            lines += "connection";
+            append_metric(lines, "id", (uint32_t)conn.id);
+            append_metric(lines, "port", conn.port);
+            append_metric(lines, "age_ms", (now - conn.created) / 1000);
+            append_metric(lines, "bytes_read", conn.bytes_read);
+            append_metric(lines, "bytes_written", conn.bytes_written);
+            append_metric(lines, "bytes_sent", conn.bytes_sent);
+            append_metric(lines, "unacked", conn.data_sent);
+            append_metric(lines, "window", conn.window);
+            append_metric(lines, "rtt_us", conn.rtt_min == UINT64_MAX ? 0 : conn.rtt_min);
+            append_metric(lines, "stalls", conn.stalls);
+            append_metric(lines, "stalled_ms", stalled_us / 1000);
+            append_metric(lines, "queued", conn.write_buffer.size);
+            lines += '\n';
+        }
+    }
+
+    std::string out = "port_forward";
     MutexLocker lock(mutex);
+    append_metric(out, "threads", shards.size());
+    append_metric(out, "listening", acceptors.size());
+    append_metric(out, "connections", open);
+    append_metric(out, "accepted", totals.accepted);
+    append_metric(out, "accepts_per_s", now > last_dump_us ?
+                  (totals.accepted - last_dump_accepted) * 1000000 / (now - last_dump_us) : 0);
+    append_metric(out, "connected", totals.connected);
+    append_metric(out, "closed", totals.closed);
+    append_metric(out, "failed", totals.failed);
+    append_metric(out, "bytes_read", totals.bytes_read);
+    append_metric(out, "bytes_written", totals.bytes_written);
+    append_metric(out, "bytes_sent", totals.bytes_sent);
+    append_metric(out, "data_messages", totals.data_messages);
+    append_metric(out, "batched_reads", totals.batched_reads);
+    append_metric(out, "stalls", totals.stalls);
+    append_metric(out, "stalled_ms", totals.stalled_us / 1000);
+    append_metric(out, "queued", queued);
+    append_metric(out, "transport_waits", totals.transport_waits);
+    append_metric(out, "transport_queued", sender.queued_bytes());
+    out += '\n';
+    last_dump_us = now;
+    last_dump_accepted = totals.accepted;
+    return out + lines;
+}
+
+void PortForwarder::set_client_compression(bool supported)
+{
+    compress = supported && options.compression;
+    LOG(LOG_INFO, "Port forwarding compression %s", compress ? "enabled" : "disabled");
+}
+
+void PortForwarder::log_metrics()
+{
+    std::string text = metrics();
+    size_t start = 0, end;
+    while ((end = text.find('\n', start)) != std::string::npos) {
+        LOG(LOG_INFO, "%s", text.substr(start, end - start).c_str());
+        start = end + 1;
+    }
+}
+
+// The fixed part of each command, 0 for unknown ones
+static size_t command_head_size(uint32_t command)
+{
+    switch (command) {
+        case VD_AGENT_PORT_FORWARD_LISTEN:
+            return sizeof(VDAgentPortForwardListenMessage);
+        case VD_AGENT_PORT_FORWARD_CONNECT:
+            return sizeof(VDAgentPortForwardConnectMessage);
+        case VD_AGENT_PORT_FORWARD_DATA:
+            return DATA_HEAD_SIZE;
+        case VD_AGENT_PORT_FORWARD_DATA_COMPRESSED:
+            return COMPRESSED_HEAD_SIZE;
+        case VD_AGENT_PORT_FORWARD_ACK:
+            return sizeof(VDAgentPortForwardAckMessage);
+        case VD_AGENT_PORT_FORWARD_CLOSE:
+            return sizeof(VDAgentPortForwardCloseMessage);
+        case VD_AGENT_PORT_FORWARD_SHUTDOWN:
+            return sizeof(VDAgentPortForwardShutdownMessage);
+        default:
+            return 0;
+    }
+}
+
+bool PortForwarder::dispatch(uint32_t command, void* data, uint32_t size)
+{
+    LOG(LOG_DEBUG, "Receiving command %d", (int)command);
+    if (size < command_head_size(command)) {
+        LOG(LOG_WARN, "Command %d too short: %u bytes", (int)command, size);
+        return false;
+    }
     switch (command) {
         case VD_AGENT_PORT_FORWARD_LISTEN:
             listen_to(*(VDAgentPortForwardListenMessage *)data);
@@ -643,9 +1613,26 @@ bool PortForwarder::dispatch(uint32_t command, void* data)
         case VD_AGENT_PORT_FORWARD_CONNECT:
             connect_remote(*(VDAgentPortForwardConnectMessage *)data);
             break;
-        case VD_AGENT_PORT_FORWARD_DATA:
-            send_data(*(VDAgentPortForwardDataMessage *)data);
+        case VD_AGENT_PORT_FORWARD_DATA: {
+            VDAgentPortForwardDataMessage *msg = (VDAgentPortForwardDataMessage *)data;
+            if (msg->size != size - DATA_HEAD_SIZE) {
+                LOG(LOG_WARN, "Data of %u bytes in a message of %u", msg->size, size);
+                return false;
+            }
+            send_data(*msg);
+            break;
+        }
+        case VD_AGENT_PORT_FORWARD_DATA_COMPRESSED: {
+            VDAgentPortForwardCompressedDataMessage *msg =
+                (VDAgentPortForwardCompressedDataMessage *)data;
+            if (msg->size != size - COMPRESSED_HEAD_SIZE) {
+                LOG(LOG_WARN, "Compressed data of %u bytes in a message of %u", msg->size,
+                    size);
+                return false;
+            }
+            send_compressed_data(*msg);
             break;
+        }
         case VD_AGENT_PORT_FORWARD_ACK:
             ack_data(*(VDAgentPortForwardAckMessage *)data);
             break;
@@ -656,7 +1643,6 @@ bool PortForwarder::dispatch(uint32_t command, void* data)
             shutdown_port(((VDAgentPortForwardShutdownMessage *)data)->port);
             break;
         default:
-            has_client = false;
             LOG(LOG_WARN, "Unknown command %d\n", (int)command);
             return false;
     }
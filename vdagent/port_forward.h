@@ -6,17 +6,28 @@
 #define __PORT_FORWARD_H
 
 #include <map>
-#include <list>
+#include <string>
+#include <vector>
 #include "vdcommon.h"
+#include "buffer_pool.h"
+#include "port_forward_io.h"
+#include "resolver.h"
 
 struct Connection;
 struct Acceptor;
 
-class PortForwarder {
+// Completion port waits cannot time out in less than a tick of the system
+// timer, often 15.6 ms, too long to hold data for by default
+#ifdef _WIN32
+#define PF_BATCH_DELAY_US 0
+#else
+#define PF_BATCH_DELAY_US 200
+#endif
+
+class PortForwarder : public PFIOBackend::Handler, public Resolver::Handler {
 public:
     typedef uint16_t port_t;
     typedef int conn_id_t;
-    typedef std::map<conn_id_t, Connection>::iterator conn_iter;
     typedef std::map<port_t, Acceptor>::iterator accept_iter;
 
     class Sender {
@@ -29,41 +40,130 @@ public:
         template <typename T> void send(uint32_t type, T* data) {
             send(type, sizeof(T), data);
         }
+        // Releases a buffer that will not be sent
+        void free_buffer(void *data) {
+            send(0, 0, data);
+        }
+        // Bytes of the messages sent and not written out yet. Once they go
+        // down to the low water mark, the sender has to call
+        // PortForwarder::transport_drained(). A sender that does not queue
+        // keeps the defaults.
+        virtual size_t queued_bytes() { return 0; }
+        virtual void set_low_water(size_t bytes) {}
+    };
+
+    // threads == 0 starts one I/O thread per processor. Each connection keeps
+    // up to read_depth reads posted, and each listening port accept_depth
+    // accepts, at most PFIOBackend::MAX_READS and MAX_ACCEPTS. Data is only
+    // compressed if compression is set and the client supports it.
+    //
+    // Reads of less than batch_bytes that come within batch_delay_us of the
+    // previous data of their connection are held for up to batch_delay_us,
+    // and sent in one message with the ones that follow. A delay of 0 sends
+    // every read as it completes.
+    //
+    // No connection posts more reads while the sender holds outbound_budget
+    // bytes or more, until half of them are written. 0 disables the budget.
+    struct Options {
+        int threads;
+        int read_depth;
+        int listen_backlog;
+        int accept_depth;
+        bool compression;
+        int batch_delay_us;
+        int batch_bytes;
+        size_t outbound_budget;
+
+        Options() : threads(0), read_depth(4), listen_backlog(128), accept_depth(8)
+            , compression(true), batch_delay_us(PF_BATCH_DELAY_US), batch_bytes(1024)
+            , outbound_budget(8 * 1024 * 1024) {}
     };
 
-    PortForwarder(Sender& cb);
+    // Connections are spread over a number of I/O threads, each with its own
+    // backend and lock. Host names are resolved with lookup, or getaddrinfo()
+    // by default.
+    PortForwarder(Sender& cb, const Options &options = Options(),
+                  Resolver::Lookup *lookup = NULL);
     ~PortForwarder();
 
-    // Main thread methods
-    bool dispatch(uint32_t command, void* data);
+    // False when no I/O thread could be started, the forwarder must not be
+    // used then
+    bool started() const { return !shards.empty(); }
+
+    // Main thread methods. False if the message is too short for the
+    // command, or its data does not fill it exactly.
+    bool dispatch(uint32_t command, void* data, uint32_t size);
+    // Whether the client announced VD_AGENT_CAP_PORT_FORWARD_COMPRESSION
+    void set_client_compression(bool supported);
+    // The sender went down to its low water mark
+    void transport_drained();
+
+    // Counters of the forwarder and its connections, as text. Cheap enough
+    // to be always kept; accepts_per_s is measured since the previous call.
+    std::string metrics();
+    void log_metrics();
 
     // Event thread callbacks
     void handle_accept(uint16_t port, SOCKET client);
-    void handle_read(int id, VDAgentPortForwardDataMessage *msg, DWORD bytes);
-    void handle_write(int id, DWORD bytes);
+    void handle_read(int id, void *buf, size_t bytes);
+    void handle_write(int id, size_t bytes);
     void handle_connect(int id);
+    void handle_failed(int id, Operation op, void *buf);
+    void handle_timer(int id);
+
+    // Resolver thread callback
+    void handle_resolved(Resolver::Request &request, const ResolvedAddress *addr);
 
 private:
+    struct Shard;
+    struct HostRequest;
+
     Sender& sender;
+    // Acceptors are all served by the first shard, under mutex
     std::map<port_t, Acceptor> acceptors;
-    std::map<conn_id_t, Connection> connections;
-    bool has_client;
-    HANDLE iocp;
-    HANDLE iocpThread;
     mutex_t mutex;
+    std::vector<Shard *> shards;
+    size_t next_shard;
+    Options options;
+    // Under mutex
+    uint64_t last_dump_us, last_dump_accepted;
+    // Slabs of the connection write queues
+    BufferPool write_pool;
+    Resolver *resolver;
+    volatile bool compress;
+    // Connections not closed yet, in all shards
+    volatile long live_connections;
+    // Decompressed client data, on the main thread
+    std::vector<uint8_t> inflate_buffer;
 
-    void handle_io_events();
-    static DWORD WINAPI ThreadProc(LPVOID lpParameter) {
-        try {
-            ((PortForwarder *)lpParameter)->handle_io_events();
-        } catch (...) {}
-        return 0;
+    Shard &shard_of(conn_id_t id) {
+        return *shards[(uint32_t)id % shards.size()];
     }
 
+    void close_all();
+    void close_connection(Shard &shard, Connection &conn);
+    void free_read_buffer(void *buf);
+    bool post_read(Connection &conn);
+    bool post_reads(Shard &shard, Connection &conn);
+    void end_stall(Shard &shard, Connection &conn);
+    void deliver_reads(Shard &shard, Connection &conn);
+    void deliver_data(Shard &shard, Connection &conn, uint8_t *data, size_t bytes);
+    void send_read_data(Shard &shard, Connection &conn, uint8_t *data, size_t bytes);
+    void flush_batch(Shard &shard, Connection &conn);
+    size_t send_compressed(Connection &conn, const uint8_t *data, size_t bytes);
+    bool may_read(Connection &conn);
+    bool wait_transport(Shard &shard, Connection &conn);
+    bool post_write(Shard &shard, Connection &conn);
+
     void listen_to(VDAgentPortForwardListenMessage &msg);
     void send_data(const VDAgentPortForwardDataMessage &msg);
+    void send_compressed_data(const VDAgentPortForwardCompressedDataMessage &msg);
+    void queue_data(conn_id_t id, const uint8_t *data, size_t size);
+    void abort_connection(Shard &shard, Connection &conn);
     void remote_connected(VDAgentPortForwardConnectMessage &msg);
     void connect_remote(VDAgentPortForwardConnectMessage &msg);
+    void listen_resolved(HostRequest &request, const ResolvedAddress *addr);
+    void connect_resolved(HostRequest &request, const ResolvedAddress *addr);
     void ack_data(VDAgentPortForwardAckMessage &msg);
     void start_closing(VDAgentPortForwardCloseMessage &msg);
     void shutdown_port(uint16_t port);
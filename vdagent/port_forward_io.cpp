@@ -0,0 +1,898 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <algorithm>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <winsock.h>
+#include <mswsock.h>
+#include <tchar.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
+#endif
+#include "port_forward_io.h"
+
+// The port is at the same offset in sockaddr_in and sockaddr_in6
+static int addr_port(const sockaddr *addr)
+{
+    return ntohs(((const sockaddr_in *)addr)->sin_port);
+}
+
+#ifdef _WIN32
+PFIOBackend *PFIOBackend::create(Handler &handler)
+{
+    return new IOCPBackend(handler);
+}
+
+static const char* getErrorMessage(DWORD error)
+{
+    static TCHAR errmsg[512];
+    static char cerrmsg[512];
+    if (!FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, 0, error, 0, errmsg, 511, NULL)) {
+        return (getErrorMessage(GetLastError()));
+    }
+#ifdef _UNICODE
+    WideCharToMultiByte(CP_UTF8, 0, errmsg, -1, cerrmsg, 512, NULL, NULL);
+    return cerrmsg;
+#else
+    return errmsg;
+#endif
+}
+
+static void* load_function(SOCKET sock, GUID guid) {
+    void* result = NULL;
+    DWORD dwBytes = 0;
+
+    WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(GUID),
+             &result, sizeof(void *), &dwBytes, 0, 0);
+    return result;
+}
+
+struct OverlappedOperation : public OVERLAPPED {
+    OverlappedOperation() {
+        uint8_t *p = (uint8_t *)static_cast<OVERLAPPED *>(this);
+        std::fill(p, p + sizeof(OVERLAPPED), 0);
+    }
+    virtual ~OverlappedOperation() {}
+    virtual void handle_to(IOCPBackend &io, DWORD bytes) = 0;
+    virtual void handle_failure(IOCPBackend &io) {}
+    bool check_pending() {
+        const DWORD lastError = ::WSAGetLastError();
+        if (lastError != ERROR_IO_PENDING) {
+            LOG(LOG_WARN, "Overlapped IO error: %s", getErrorMessage(lastError));
+            return false;
+        } else {
+            LOG(LOG_DEBUG, "Pending io operation %p", this);
+            return true;
+        }
+    }
+};
+
+struct AcceptOperation : public OverlappedOperation {
+    static const size_t sizeOfAddress = sizeof(SOCKADDR_STORAGE) + 16;
+    static const GUID acceptex_guid;
+
+    uint16_t port;
+    SOCKET listener;
+    SOCKET client;
+    uint8_t addrBuffer[sizeOfAddress * 2];
+
+    AcceptOperation(int family) : OverlappedOperation() {
+        client = socket(family, SOCK_STREAM, 0);
+        LOG(LOG_DEBUG, "Created accept operation %p for client socket %d", this, client);
+    }
+    virtual ~AcceptOperation() {
+        if (client != INVALID_SOCKET) {
+            LOG(LOG_DEBUG, "Closing unaccepted client in operation %p for client socket %d",
+                this, client);
+            shutdown(client, SD_BOTH);
+            closesocket(client);
+        }
+    }
+    virtual void handle_to(IOCPBackend &io, DWORD bytes) {
+        char update_context[sizeof(SOCKET)];
+        *((SOCKET *)update_context) = listener;
+        setsockopt(client, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, update_context,
+                   sizeof(SOCKET));
+        io.handler().handle_accept(port, client);
+        client = INVALID_SOCKET;
+    }
+    bool accept_ex() {
+        static LPFN_ACCEPTEX real_accept_ex =
+            (LPFN_ACCEPTEX)load_function(listener, acceptex_guid);
+        DWORD bytes;
+        if (real_accept_ex) {
+            LOG(LOG_DEBUG, "Calling accept_ex for operation %p", this);
+            return real_accept_ex(listener, client, addrBuffer, 0,
+                                  sizeOfAddress, sizeOfAddress, &bytes, this);
+        } else {
+            WSASetLastError(WSASYSCALLFAILURE);
+            return false;
+        }
+    }
+    static bool post(SOCKET listener, uint16_t port, HANDLE iocp)
+    {
+        SOCKADDR_STORAGE addr;
+        int len = sizeof(addr);
+        if (getsockname(listener, (sockaddr *)&addr, &len) == SOCKET_ERROR) {
+            LOG(LOG_WARN, "Listener of port %d is gone", port);
+            return false;
+        }
+        AcceptOperation *operation = new AcceptOperation(addr.ss_family);
+        operation->port = port;
+        operation->listener = listener;
+        if(!operation->accept_ex()) {
+            if(!operation->check_pending()) {
+                // TODO: Error
+                LOG(LOG_DEBUG, "Posting accept operation %p failed", operation);
+                delete operation;
+                return false;
+            }
+        } else {
+            // Operation completed synchronously, post data to io thread.
+            LOG(LOG_DEBUG, "Accept operation %p completed synchronously, posting", operation);
+            ::PostQueuedCompletionStatus(iocp, 0, 0, operation);
+        }
+        return true;
+    }
+};
+const GUID AcceptOperation::acceptex_guid = WSAID_ACCEPTEX;
+
+struct ReadOperation : public OverlappedOperation {
+    int id;
+    WSABUF buffer[1];
+
+    ReadOperation() : OverlappedOperation() {
+        LOG(LOG_DEBUG, "Created read operation %p", this);
+    }
+    virtual ~ReadOperation() {}
+    virtual void handle_to(IOCPBackend &io, DWORD bytes) {
+        io.handler().handle_read(id, buffer->buf, bytes);
+    }
+    virtual void handle_failure(IOCPBackend &io) {
+        io.handler().handle_failed(id, PFIOBackend::Handler::OP_READ, buffer->buf);
+    }
+    static bool post(SOCKET sock, int id, void *buf, size_t size) {
+        ReadOperation *operation = new ReadOperation;
+        operation->id = id;
+        operation->buffer->len = size;
+        operation->buffer->buf = (char *)buf;
+        DWORD f = 0;
+        if (WSARecv(sock, operation->buffer,
+                    1, NULL, &f, operation, NULL) == SOCKET_ERROR) {
+            if (!operation->check_pending()) {
+                // TODO: Error
+                LOG(LOG_DEBUG, "Posting read operation %p failed", operation);
+                delete operation;
+                return false;
+            }
+        } else
+            LOG(LOG_DEBUG, "Read operation %p completed synchronously", operation);
+        return true;
+    }
+};
+
+struct WriteOperation : public OverlappedOperation {
+    int id;
+    WSABUF buffer[PFIOBackend::MAX_IOV];
+
+    WriteOperation() : OverlappedOperation() {
+        LOG(LOG_DEBUG, "Created write operation %p", this);
+    }
+    virtual ~WriteOperation() {}
+    virtual void handle_to(IOCPBackend &io, DWORD bytes) {
+        io.handler().handle_write(id, bytes);
+    }
+    virtual void handle_failure(IOCPBackend &io) {
+        io.handler().handle_failed(id, PFIOBackend::Handler::OP_WRITE, NULL);
+    }
+    static bool post(SOCKET sock, int id, const VDIOVec *iov, int count) {
+        WriteOperation *operation = new WriteOperation;
+        operation->id = id;
+        for (int i = 0; i < count; ++i) {
+            operation->buffer[i].len = iov[i].len;
+            operation->buffer[i].buf = (char *)iov[i].base;
+        }
+        if(WSASend(sock, operation->buffer,
+                   count, NULL, 0, operation, NULL) == SOCKET_ERROR) {
+            if (!operation->check_pending()) {
+                // TODO: Error
+                LOG(LOG_DEBUG, "Posting write operation %p failed", operation);
+                delete operation;
+                return false;
+            }
+        } else
+            LOG(LOG_DEBUG, "Write operation %p completed synchronously", operation);
+        return true;
+    }
+};
+
+struct ConnectOperation : public OverlappedOperation {
+    int id;
+
+    ConnectOperation() : OverlappedOperation() {
+        LOG(LOG_DEBUG, "Created connect operation %p", this);
+    }
+    virtual ~ConnectOperation() {}
+    virtual void handle_to(IOCPBackend &io, DWORD bytes) {
+        io.handler().handle_connect(id);
+    }
+    virtual void handle_failure(IOCPBackend &io) {
+        io.handler().handle_failed(id, PFIOBackend::Handler::OP_CONNECT, NULL);
+    }
+    static const GUID connectex_guid;
+    bool connect_ex(SOCKET sock, const sockaddr *addr, int len) {
+        static LPFN_CONNECTEX real_connect_ex =
+                (LPFN_CONNECTEX)load_function(sock, connectex_guid);
+        if (real_connect_ex) {
+            LOG(LOG_DEBUG, "Calling connect_ex for operation %p", this);
+            return real_connect_ex(sock, addr, len, NULL, 0, NULL, this);
+        } else {
+            WSASetLastError(WSASYSCALLFAILURE);
+            return false;
+        }
+    }
+    static bool post(SOCKET sock, int id, const sockaddr *serv_addr, int len, HANDLE iocp) {
+        CreateIoCompletionPort((HANDLE)sock, iocp, 0, 0);
+        // ConnectEx needs a bound socket; all zeroes is the any address and
+        // port of both families
+        SOCKADDR_STORAGE host_addr;
+        std::fill_n((char *)&host_addr, sizeof(host_addr), 0);
+        host_addr.ss_family = serv_addr->sa_family;
+        if (bind(sock, (const sockaddr *)&host_addr, len) == SOCKET_ERROR) {
+            LOG(LOG_ERROR, "Could not bind to local port on connect");
+            return false;
+        }
+        ConnectOperation *operation = new ConnectOperation;
+        operation->id = id;
+        if (!operation->connect_ex(sock, serv_addr, len)) {
+            if (!operation->check_pending()) {
+                // TODO: Error
+                LOG(LOG_DEBUG, "Posting connect operation %p failed", operation);
+                delete operation;
+                return false;
+            }
+        } else
+            LOG(LOG_DEBUG, "Connect operation %p completed synchronously", operation);
+        return true;
+    }
+};
+const GUID ConnectOperation::connectex_guid = WSAID_CONNECTEX;
+
+IOCPBackend::IOCPBackend(Handler &handler)
+    : PFIOBackend(handler)
+    , _iocp(NULL)
+    , _thread(NULL)
+    , _running(false)
+    , _timer_id(0)
+    , _timer_deadline(0)
+{
+    WSADATA WsaDat;
+    // TODO: Check for errors and throw
+    WSAStartup(MAKEWORD(2, 2), &WsaDat);
+    _iocp = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+}
+
+IOCPBackend::~IOCPBackend()
+{
+    stop();
+    CloseHandle(_iocp);
+    WSACleanup();
+}
+
+bool IOCPBackend::start()
+{
+    _running = true;
+    _thread = ::CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+    if (!_thread) {
+        LOG(LOG_ERROR, "Failed to create port forwarding thread: %lu", GetLastError());
+        _running = false;
+        return false;
+    }
+    return true;
+}
+
+void IOCPBackend::stop()
+{
+    if (_thread) {
+        _running = false;
+        PostQueuedCompletionStatus(_iocp, 0, 0, NULL);
+        WaitForSingleObject(_thread, INFINITE);
+        CloseHandle(_thread);
+        _thread = NULL;
+        // Abandon the operations that completed meanwhile
+        for (;;) {
+            DWORD bytes;
+            ULONG_PTR key;
+            LPOVERLAPPED overlapped = NULL;
+            GetQueuedCompletionStatus(_iocp, &bytes, &key, &overlapped, 0);
+            if (!overlapped) {
+                break;
+            }
+            delete static_cast<OverlappedOperation *>(overlapped);
+        }
+    }
+}
+
+DWORD WINAPI IOCPBackend::thread_proc(LPVOID param)
+{
+    try {
+        ((IOCPBackend *)param)->handle_io_events();
+    } catch (...) {}
+    return 0;
+}
+
+static uint64_t now_us()
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / freq.QuadPart * 1000000 +
+           count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+void IOCPBackend::set_timer(int id, uint32_t delay_us)
+{
+    _timer_id = id;
+    _timer_deadline = now_us() + std::max<uint32_t>(delay_us, 1);
+}
+
+void IOCPBackend::handle_io_events()
+{
+    LOG(LOG_INFO, "Starting port forwarding thread.");
+    while (_running) {
+        DWORD bytes;
+        ULONG_PTR key;
+        LPOVERLAPPED overlapped = NULL;
+        DWORD timeout = INFINITE;
+        if (_timer_deadline) {
+            uint64_t now = now_us();
+            timeout = _timer_deadline > now ? (DWORD)((_timer_deadline - now + 999) / 1000) : 0;
+        }
+        bool success = GetQueuedCompletionStatus(_iocp, &bytes, &key, &overlapped, timeout);
+        if (_timer_deadline && now_us() >= _timer_deadline) {
+            _timer_deadline = 0;
+            _handler.handle_timer(_timer_id);
+        }
+        OverlappedOperation * operation = static_cast<OverlappedOperation *>(overlapped);
+        if (operation) {
+            if (!success) {
+                // Operation failed (probably canceled)
+                LOG(LOG_DEBUG, "IO operation %p failed: %s", operation,
+                    getErrorMessage(WSAGetLastError()));
+                operation->handle_failure(*this);
+            } else {
+                LOG(LOG_DEBUG, "IO operation %p finished", operation);
+                operation->handle_to(*this, bytes);
+            }
+            delete operation;
+        }
+    }
+    LOG(LOG_INFO, "Ending port forwarding thread.");
+}
+
+SOCKET IOCPBackend::listen(const sockaddr *addr, int len, int backlog)
+{
+    SOCKET sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    char true_placeholder[sizeof(BOOL)];
+    *((BOOL *)true_placeholder) = 1;
+    if (sock == INVALID_SOCKET ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, true_placeholder, sizeof(BOOL)) ||
+        bind(sock, addr, len) == SOCKET_ERROR ||
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, true_placeholder, sizeof(BOOL)) ||
+        ::listen(sock, backlog)) {
+        LOG(LOG_ERROR, "Failed to listen to port %d: %s", addr_port(addr),
+            getErrorMessage(WSAGetLastError()));
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+        }
+        return INVALID_SOCKET;
+    }
+    CreateIoCompletionPort((HANDLE)sock, _iocp, 0, 0);
+    return sock;
+}
+
+SOCKET IOCPBackend::connect(const sockaddr *addr, int len, int id)
+{
+    SOCKET sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        LOG(LOG_WARN, "Error creating socket");
+    } else if (!ConnectOperation::post(sock, id, addr, len, _iocp)) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    return sock;
+}
+
+bool IOCPBackend::adopt(SOCKET sock)
+{
+    return CreateIoCompletionPort((HANDLE)sock, _iocp, 0, 0) != NULL;
+}
+
+bool IOCPBackend::post_accept(SOCKET listener, uint16_t port)
+{
+    return AcceptOperation::post(listener, port, _iocp);
+}
+
+bool IOCPBackend::post_read(SOCKET sock, int id, void *buf, size_t size)
+{
+    return ReadOperation::post(sock, id, buf, size);
+}
+
+bool IOCPBackend::post_write(SOCKET sock, int id, const VDIOVec *iov, int count)
+{
+    return WriteOperation::post(sock, id, iov, count);
+}
+
+// Pending operations complete with an error and go to handle_failure()
+void IOCPBackend::close(SOCKET sock)
+{
+    shutdown(sock, SD_BOTH);
+    closesocket(sock);
+}
+#else
+PFIOBackend *PFIOBackend::create(Handler &handler)
+{
+    return new EpollBackend(handler);
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+EpollBackend::EpollBackend(Handler &handler)
+    : PFIOBackend(handler)
+    , _timer_id(0)
+    , _running(false)
+    , _stopping(0)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    _epoll_fd = epoll_create(64);
+    if (pipe(_wakeup_fds) < 0 || !set_nonblocking(_wakeup_fds[0]) ||
+            !set_nonblocking(_wakeup_fds[1])) {
+        _wakeup_fds[0] = _wakeup_fds[1] = -1;
+    } else {
+        ev.data.fd = _wakeup_fds[0];
+        epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wakeup_fds[0], &ev);
+    }
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (_timer_fd != -1) {
+        ev.data.fd = _timer_fd;
+        epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _timer_fd, &ev);
+    }
+}
+
+EpollBackend::~EpollBackend()
+{
+    stop();
+    for (std::map<SOCKET, Watch>::iterator it = _watches.begin(); it != _watches.end(); ++it) {
+        ::close(it->first);
+    }
+    if (_wakeup_fds[0] != -1) {
+        ::close(_wakeup_fds[0]);
+        ::close(_wakeup_fds[1]);
+    }
+    if (_timer_fd != -1) {
+        ::close(_timer_fd);
+    }
+    ::close(_epoll_fd);
+}
+
+bool EpollBackend::start()
+{
+    if (_epoll_fd < 0 || _wakeup_fds[0] < 0 || _timer_fd < 0) {
+        LOG(LOG_ERROR, "Failed to create epoll instance: %d", errno);
+        return false;
+    }
+    _stopping = 0;
+    if (pthread_create(&_thread, NULL, thread_proc, this)) {
+        LOG(LOG_ERROR, "Failed to create port forwarding thread");
+        return false;
+    }
+    _running = true;
+    return true;
+}
+
+void EpollBackend::wakeup()
+{
+    char c = 0;
+    if (write(_wakeup_fds[1], &c, 1) < 0 && errno != EAGAIN) {
+        LOG(LOG_WARN, "Failed to wake up port forwarding thread: %d", errno);
+    }
+}
+
+void EpollBackend::stop()
+{
+    if (_running) {
+        vd_atomic_add(&_stopping, 1);
+        wakeup();
+        pthread_join(_thread, NULL);
+        _running = false;
+        _cancelled.clear();
+    }
+}
+
+void *EpollBackend::thread_proc(void *param)
+{
+    ((EpollBackend *)param)->handle_io_events();
+    return NULL;
+}
+
+// The socket enters the epoll set when an operation is posted on it
+bool EpollBackend::add_watch(SOCKET sock)
+{
+    Watch watch = Watch();
+
+    if (!set_nonblocking(sock)) {
+        LOG(LOG_WARN, "Failed to watch socket %d: %d", sock, errno);
+        return false;
+    }
+    MutexLocker lock(_mutex);
+    _watches[sock] = watch;
+    return true;
+}
+
+EpollBackend::Watch *EpollBackend::find_watch(SOCKET sock)
+{
+    std::map<SOCKET, Watch>::iterator it = _watches.find(sock);
+    return it == _watches.end() ? NULL : &it->second;
+}
+
+// Called with _mutex held. EPOLLHUP and EPOLLERR are reported even with no
+// events requested, so a socket with nothing pending is taken out of the
+// epoll set; otherwise a reset peer would wake up the thread in a loop.
+void EpollBackend::update_watch(SOCKET sock, Watch &watch)
+{
+    struct epoll_event ev;
+    int op;
+
+    ev.events = 0;
+    if (watch.accepts || watch.read_count) {
+        ev.events |= EPOLLIN;
+    }
+    if (watch.connecting || watch.writing) {
+        ev.events |= EPOLLOUT;
+    }
+    if (ev.events != watch.events) {
+        op = !watch.events ? EPOLL_CTL_ADD : !ev.events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        ev.data.fd = sock;
+        if (epoll_ctl(_epoll_fd, op, sock, &ev)) {
+            LOG(LOG_WARN, "Failed to update socket %d: %d", sock, errno);
+        }
+        watch.events = ev.events;
+    }
+}
+
+SOCKET EpollBackend::listen(const sockaddr *addr, int len, int backlog)
+{
+    SOCKET sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    int one = 1;
+    if (sock == INVALID_SOCKET ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(sock, addr, len) ||
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ||
+        ::listen(sock, backlog) || !add_watch(sock)) {
+        LOG(LOG_ERROR, "Failed to listen to port %d: %d", addr_port(addr), errno);
+        if (sock != INVALID_SOCKET) {
+            ::close(sock);
+        }
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+SOCKET EpollBackend::connect(const sockaddr *addr, int len, int id)
+{
+    SOCKET sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET || !add_watch(sock)) {
+        LOG(LOG_WARN, "Error creating socket");
+        if (sock != INVALID_SOCKET) {
+            ::close(sock);
+        }
+    } else if (::connect(sock, addr, len) && errno != EINPROGRESS) {
+        LOG(LOG_WARN, "Connect operation for connection %d failed: %d", id, errno);
+        close(sock);
+    } else {
+        MutexLocker lock(_mutex);
+        Watch &watch = *find_watch(sock);
+        watch.connecting = true;
+        watch.connect_id = id;
+        update_watch(sock, watch);
+        return sock;
+    }
+    return INVALID_SOCKET;
+}
+
+bool EpollBackend::adopt(SOCKET sock)
+{
+    return add_watch(sock);
+}
+
+bool EpollBackend::post_accept(SOCKET listener, uint16_t port)
+{
+    MutexLocker lock(_mutex);
+    Watch *watch = find_watch(listener);
+    if (!watch || watch->accepts == MAX_ACCEPTS) {
+        return false;
+    }
+    watch->accepts++;
+    watch->port = port;
+    update_watch(listener, *watch);
+    return true;
+}
+
+bool EpollBackend::post_read(SOCKET sock, int id, void *buf, size_t size)
+{
+    MutexLocker lock(_mutex);
+    Watch *watch = find_watch(sock);
+    if (!watch) {
+        return false;
+    }
+    if (watch->read_count == MAX_READS) {
+        return false;
+    }
+    PendingRead &read = watch->reads[watch->read_count++];
+    read.id = id;
+    read.buf = buf;
+    read.size = size;
+    update_watch(sock, *watch);
+    return true;
+}
+
+bool EpollBackend::post_write(SOCKET sock, int id, const VDIOVec *iov, int count)
+{
+    MutexLocker lock(_mutex);
+    Watch *watch = find_watch(sock);
+    if (!watch) {
+        return false;
+    }
+    watch->writing = true;
+    watch->write_id = id;
+    std::copy(iov, iov + count, watch->write_iov);
+    watch->write_count = count;
+    update_watch(sock, *watch);
+    return true;
+}
+
+// Closing removes the socket from the epoll set; an event for it that was
+// already returned finds no watch, or the watch of a new socket that reused
+// the descriptor, and just retries. The pending operations are reported as
+// failed by the event thread.
+void EpollBackend::close(SOCKET sock)
+{
+    MutexLocker lock(_mutex);
+    Watch *watch = find_watch(sock);
+    if (watch) {
+        Completion done = Completion();
+        done.type = Completion::FAILED;
+        if (watch->connecting) {
+            done.op = Handler::OP_CONNECT;
+            done.id = watch->connect_id;
+            _cancelled.push_back(done);
+        }
+        for (int i = 0; i < watch->read_count; ++i) {
+            done.op = Handler::OP_READ;
+            done.id = watch->reads[i].id;
+            done.buf = watch->reads[i].buf;
+            _cancelled.push_back(done);
+            done.buf = NULL;
+        }
+        if (watch->writing) {
+            done.op = Handler::OP_WRITE;
+            done.id = watch->write_id;
+            _cancelled.push_back(done);
+        }
+        if (!_cancelled.empty()) {
+            wakeup();
+        }
+        _watches.erase(sock);
+    }
+    shutdown(sock, SHUT_RDWR);
+    ::close(sock);
+}
+
+void EpollBackend::set_timer(int id, uint32_t delay_us)
+{
+    struct itimerspec spec;
+    std::fill_n((char *)&spec, sizeof(spec), 0);
+    // A zero value would disarm the timer
+    delay_us = std::max<uint32_t>(delay_us, 1);
+    spec.it_value.tv_sec = delay_us / 1000000;
+    spec.it_value.tv_nsec = delay_us % 1000000 * 1000;
+    _timer_id = id;
+    if (timerfd_settime(_timer_fd, 0, &spec, NULL)) {
+        LOG(LOG_WARN, "Failed to set port forwarding timer: %d", errno);
+    }
+}
+
+// Does the pending operations the socket is ready for. Called with _mutex
+// held; returns the number of completions stored in done.
+int EpollBackend::handle_ready(SOCKET sock, uint32_t events, Completion *done)
+{
+    Watch *watch = find_watch(sock);
+    int count = 0;
+
+    if (!watch) {
+        return 0;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while (watch->accepts) {
+            SOCKET client = accept(sock, NULL, NULL);
+            if (client == INVALID_SOCKET) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    LOG(LOG_WARN, "Accept on port %d failed: %d", watch->port, errno);
+                }
+                break;
+            }
+            watch->accepts--;
+            done[count].type = Completion::ACCEPT;
+            done[count].port = watch->port;
+            done[count++].client = client;
+        }
+        // Reads are filled while there is data, a short one means there
+        // is no more for now
+        int reads = 0;
+        while (reads < watch->read_count) {
+            PendingRead &read = watch->reads[reads];
+            ssize_t bytes = recv(sock, read.buf, read.size, 0);
+            if (bytes >= 0) {
+                done[count].type = Completion::READ;
+                done[count].id = read.id;
+                done[count].buf = read.buf;
+                done[count++].bytes = bytes;
+                reads++;
+                if ((size_t)bytes < read.size) {
+                    break;
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG(LOG_DEBUG, "Read on connection %d failed: %d", read.id, errno);
+                done[count].type = Completion::FAILED;
+                done[count].op = Handler::OP_READ;
+                done[count].id = read.id;
+                done[count++].buf = read.buf;
+                reads++;
+            } else {
+                break;
+            }
+        }
+        watch->read_count -= reads;
+        std::copy(watch->reads + reads, watch->reads + reads + watch->read_count, watch->reads);
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        if (watch->connecting) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            watch->connecting = false;
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (!err) {
+                done[count].type = Completion::CONNECT;
+                done[count++].id = watch->connect_id;
+            } else {
+                LOG(LOG_DEBUG, "Connect on connection %d failed: %d", watch->connect_id, err);
+                done[count].type = Completion::FAILED;
+                done[count].op = Handler::OP_CONNECT;
+                done[count].id = watch->connect_id;
+                done[count++].buf = NULL;
+            }
+        }
+        if (watch->writing) {
+            struct iovec iov[MAX_IOV];
+            struct msghdr msg;
+            for (int i = 0; i < watch->write_count; ++i) {
+                iov[i].iov_base = (void *)watch->write_iov[i].base;
+                iov[i].iov_len = watch->write_iov[i].len;
+            }
+            std::fill_n((char *)&msg, sizeof(msg), 0);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = watch->write_count;
+            ssize_t bytes = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            if (bytes >= 0) {
+                watch->writing = false;
+                done[count].type = Completion::WRITE;
+                done[count].id = watch->write_id;
+                done[count++].bytes = bytes;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG(LOG_DEBUG, "Write on connection %d failed: %d", watch->write_id, errno);
+                watch->writing = false;
+                done[count].type = Completion::FAILED;
+                done[count].op = Handler::OP_WRITE;
+                done[count].id = watch->write_id;
+                done[count++].buf = NULL;
+            }
+        }
+    }
+    update_watch(sock, *watch);
+    return count;
+}
+
+void EpollBackend::handle_io_events()
+{
+    static const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
+    bool stopping = false;
+
+    LOG(LOG_INFO, "Starting port forwarding thread.");
+    while (!stopping) {
+        int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(LOG_ERROR, "epoll_wait failed: %d", errno);
+            break;
+        }
+        for (int i = 0; i < n && !stopping; ++i) {
+            Completion done[MAX_COMPLETIONS];
+            int count;
+            if (events[i].data.fd == _wakeup_fds[0]) {
+                char buf[64];
+                std::vector<Completion> cancelled;
+                while (read(_wakeup_fds[0], buf, sizeof(buf)) > 0) {}
+                // stop() raises the flag before it writes the byte read here
+                if (vd_atomic_load(&_stopping)) {
+                    stopping = true;
+                    continue;
+                }
+                {
+                    MutexLocker lock(_mutex);
+                    cancelled.swap(_cancelled);
+                }
+                for (size_t j = 0; j < cancelled.size(); ++j) {
+                    deliver(cancelled[j]);
+                }
+                continue;
+            }
+            if (events[i].data.fd == _timer_fd) {
+                uint64_t expirations;
+                if (read(_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    _handler.handle_timer(_timer_id);
+                }
+                continue;
+            }
+            {
+                MutexLocker lock(_mutex);
+                count = handle_ready(events[i].data.fd, events[i].events, done);
+            }
+            for (int j = 0; j < count; ++j) {
+                deliver(done[j]);
+            }
+        }
+    }
+    LOG(LOG_INFO, "Ending port forwarding thread.");
+}
+
+void EpollBackend::deliver(const Completion &done)
+{
+    switch (done.type) {
+    case Completion::ACCEPT:
+        _handler.handle_accept(done.port, done.client);
+        break;
+    case Completion::CONNECT:
+        _handler.handle_connect(done.id);
+        break;
+    case Completion::READ:
+        _handler.handle_read(done.id, done.buf, done.bytes);
+        break;
+    case Completion::WRITE:
+        _handler.handle_write(done.id, done.bytes);
+        break;
+    case Completion::FAILED:
+        _handler.handle_failed(done.id, done.op, done.buf);
+        break;
+    }
+}
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __PORT_FORWARD_IO_H
+#define __PORT_FORWARD_IO_H
+
+#include "vdcommon.h"
+#ifndef _WIN32
+#include <map>
+#include <vector>
+#include <netinet/in.h>
+typedef int SOCKET;
+typedef uint32_t DWORD;
+#define INVALID_SOCKET (-1)
+#endif
+
+/*
+ * Socket I/O under the port forwarder. Operations are asynchronous and
+ * complete on the backend's event thread through the Handler callbacks. At
+ * most one connect and write, MAX_ACCEPTS accepts and MAX_READS reads are
+ * pending on a socket; reads are filled in the order they were posted, but
+ * may complete in any order. Connects, reads and writes always complete,
+ * failed ones and the ones cancelled by close() through handle_failed(), so
+ * that their owner knows when their buffers are released. Failed accepts are
+ * logged and dropped. Once stop() returns the handler is not called any more,
+ * and pending operations are abandoned.
+ *
+ * Each backend also has a one-shot timer, for the handler to do delayed work
+ * on the event thread.
+ */
+class PFIOBackend {
+public:
+    class Handler {
+    public:
+        enum Operation {
+            OP_CONNECT,
+            OP_READ,
+            OP_WRITE
+        };
+
+        virtual ~Handler() {}
+        virtual void handle_accept(uint16_t port, SOCKET client) = 0;
+        // bytes is 0 when the peer closed the connection
+        virtual void handle_read(int id, void *buf, size_t bytes) = 0;
+        virtual void handle_write(int id, size_t bytes) = 0;
+        virtual void handle_connect(int id) = 0;
+        // buf is the buffer of a read
+        virtual void handle_failed(int id, Operation op, void *buf) = 0;
+        virtual void handle_timer(int id) = 0;
+    };
+
+    // The default backend of the platform
+    static PFIOBackend *create(Handler &handler);
+
+    PFIOBackend(Handler &handler) : _handler(handler) {}
+    virtual ~PFIOBackend() {}
+
+    // Start and stop the event thread
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+
+    // Addresses are IPv4 or IPv6. Return INVALID_SOCKET on errors.
+    virtual SOCKET listen(const sockaddr *addr, int len, int backlog) = 0;
+    virtual SOCKET connect(const sockaddr *addr, int len, int id) = 0;
+
+    // Accepted sockets are handed over to the backend that will do their I/O
+    virtual bool adopt(SOCKET sock) = 0;
+
+    static const int MAX_IOV = 16;
+    static const int MAX_READS = 16;
+    static const int MAX_ACCEPTS = 16;
+
+    virtual bool post_accept(SOCKET listener, uint16_t port) = 0;
+    virtual bool post_read(SOCKET sock, int id, void *buf, size_t size) = 0;
+    // Gathers at most MAX_IOV segments. Writes may complete partially.
+    virtual bool post_write(SOCKET sock, int id, const VDIOVec *iov, int count) = 0;
+    // Pending operations on the socket are cancelled
+    virtual void close(SOCKET sock) = 0;
+    // Calls handle_timer(id) once delay_us have passed, replacing the timer
+    // set before if it did not expire yet. Only called on the event thread.
+    virtual void set_timer(int id, uint32_t delay_us) = 0;
+
+protected:
+    Handler &_handler;
+};
+
+#ifdef _WIN32
+// Overlapped sockets on an I/O completion port, with AcceptEx and ConnectEx
+class IOCPBackend : public PFIOBackend {
+public:
+    IOCPBackend(Handler &handler);
+    ~IOCPBackend();
+    bool start();
+    void stop();
+    SOCKET listen(const sockaddr *addr, int len, int backlog);
+    SOCKET connect(const sockaddr *addr, int len, int id);
+    bool adopt(SOCKET sock);
+    bool post_accept(SOCKET listener, uint16_t port);
+    bool post_read(SOCKET sock, int id, void *buf, size_t size);
+    bool post_write(SOCKET sock, int id, const VDIOVec *iov, int count);
+    void close(SOCKET sock);
+    void set_timer(int id, uint32_t delay_us);
+
+    Handler &handler() { return _handler; }
+    HANDLE iocp() { return _iocp; }
+
+private:
+    HANDLE _iocp;
+    HANDLE _thread;
+    bool _running;
+    // The timer is the timeout of the wait for completions, so it is as
+    // coarse as the system timer (often 15.6 ms) unless its resolution was
+    // raised. The deadline is 0 when it is not set.
+    int _timer_id;
+    uint64_t _timer_deadline;
+
+    void handle_io_events();
+    static DWORD WINAPI thread_proc(LPVOID param);
+};
+#else
+// Non-blocking sockets and epoll. An operation is kept pending until its
+// socket is ready, then done and completed on the event thread.
+class EpollBackend : public PFIOBackend {
+public:
+    EpollBackend(Handler &handler);
+    ~EpollBackend();
+    bool start();
+    void stop();
+    SOCKET listen(const sockaddr *addr, int len, int backlog);
+    SOCKET connect(const sockaddr *addr, int len, int id);
+    bool adopt(SOCKET sock);
+    bool post_accept(SOCKET listener, uint16_t port);
+    bool post_read(SOCKET sock, int id, void *buf, size_t size);
+    bool post_write(SOCKET sock, int id, const VDIOVec *iov, int count);
+    void close(SOCKET sock);
+    void set_timer(int id, uint32_t delay_us);
+
+private:
+    struct PendingRead {
+        int id;
+        void *buf;
+        size_t size;
+    };
+    struct Watch {
+        // 0 while the socket is out of the epoll set
+        uint32_t events;
+        bool connecting, writing;
+        int accepts;
+        uint16_t port;
+        int connect_id, write_id;
+        // In the order they were posted
+        PendingRead reads[MAX_READS];
+        int read_count;
+        VDIOVec write_iov[MAX_IOV];
+        int write_count;
+    };
+    // An operation done on the event thread, reported once the lock is
+    // released
+    struct Completion {
+        enum { ACCEPT, CONNECT, READ, WRITE, FAILED } type;
+        Handler::Operation op;
+        int id;
+        uint16_t port;
+        SOCKET client;
+        void *buf;
+        size_t bytes;
+    };
+
+    int _epoll_fd;
+    int _wakeup_fds[2];
+    // A timerfd in the epoll set
+    int _timer_fd;
+    int _timer_id;
+    pthread_t _thread;
+    bool _running;
+    // Raised by stop(), read by the event thread when it is woken up
+    volatile long _stopping;
+    mutex_t _mutex;
+    std::map<SOCKET, Watch> _watches;
+    // Operations cancelled by close(), reported by the event thread
+    std::vector<Completion> _cancelled;
+
+    bool add_watch(SOCKET sock);
+    Watch *find_watch(SOCKET sock);
+    void update_watch(SOCKET sock, Watch &watch);
+    void wakeup();
+    // Room for the completions of one handle_ready()
+    static const int MAX_COMPLETIONS = MAX_ACCEPTS + MAX_READS + 2;
+    int handle_ready(SOCKET sock, uint32_t events, Completion *done);
+    void deliver(const Completion &done);
+    void handle_io_events();
+    static void *thread_proc(void *param);
+};
+#endif
+
+#endif // __PORT_FORWARD_IO_H
@@ -0,0 +1,205 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include <algorithm>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <time.h>
+#endif
+#include "resolver.h"
+
+static const uint32_t FOUND_TTL = 60;
+static const uint32_t NOT_FOUND_TTL = 5;
+static const size_t MAX_CACHE_ENTRIES = 256;
+
+static uint32_t now_seconds()
+{
+#ifdef _WIN32
+    return GetTickCount() / 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+#endif
+}
+
+class GetAddrInfoLookup : public Resolver::Lookup {
+public:
+    bool lookup(const std::string &host, bool passive, ResolvedAddress &addr) {
+        struct addrinfo hints, *result;
+        std::fill_n((char *)&hints, sizeof(hints), 0);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : AI_ADDRCONFIG;
+        int err = getaddrinfo(host.c_str(), NULL, &hints, &result);
+        if (err) {
+            LOG(LOG_DEBUG, "getaddrinfo(%s) failed: %d", host.c_str(), err);
+            return false;
+        }
+        addr.len = std::min<int>(result->ai_addrlen, sizeof(addr.storage));
+        std::copy((char *)result->ai_addr, (char *)result->ai_addr + addr.len, addr.storage);
+        freeaddrinfo(result);
+        return true;
+    }
+};
+
+Resolver::Resolver(Handler &handler, int threads, Lookup *lookup)
+    : _handler(handler)
+    , _lookup(lookup ? lookup : new GetAddrInfoLookup)
+    , _stopping(false)
+{
+#ifdef _WIN32
+    _semaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    for (int i = 0; i < threads; ++i) {
+        HANDLE thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+        if (!thread) {
+            LOG(LOG_ERROR, "Failed to create resolver thread: %lu", GetLastError());
+            continue;
+        }
+        _threads.push_back(thread);
+    }
+#else
+    sem_init(&_semaphore, 0, 0);
+    for (int i = 0; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thread_proc, this)) {
+            LOG(LOG_ERROR, "Failed to create resolver thread");
+            continue;
+        }
+        _threads.push_back(thread);
+    }
+#endif
+}
+
+// Lookups in progress are waited for
+Resolver::~Resolver()
+{
+    _stopping = true;
+    for (size_t i = 0; i < _threads.size(); ++i) {
+#ifdef _WIN32
+        ReleaseSemaphore(_semaphore, 1, NULL);
+#else
+        sem_post(&_semaphore);
+#endif
+    }
+    for (size_t i = 0; i < _threads.size(); ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(_threads[i], INFINITE);
+        CloseHandle(_threads[i]);
+#else
+        pthread_join(_threads[i], NULL);
+#endif
+    }
+#ifdef _WIN32
+    CloseHandle(_semaphore);
+#else
+    sem_destroy(&_semaphore);
+#endif
+    while (!_requests.empty()) {
+        delete _requests.front();
+        _requests.pop_front();
+    }
+    delete _lookup;
+}
+
+#ifdef _WIN32
+DWORD WINAPI Resolver::thread_proc(LPVOID param)
+{
+    ((Resolver *)param)->handle_requests();
+    return 0;
+}
+#else
+void *Resolver::thread_proc(void *param)
+{
+    ((Resolver *)param)->handle_requests();
+    return NULL;
+}
+#endif
+
+static std::string cache_key(const Resolver::Request &request)
+{
+    return request.passive ? "<" + request.host : request.host;
+}
+
+bool Resolver::find_cached(const std::string &key, CacheEntry &entry)
+{
+    MutexLocker lock(_mutex);
+    std::map<std::string, CacheEntry>::iterator it = _cache.find(key);
+    if (it == _cache.end()) {
+        return false;
+    }
+    if ((int32_t)(it->second.expires - now_seconds()) <= 0) {
+        _cache.erase(it);
+        return false;
+    }
+    entry = it->second;
+    return true;
+}
+
+void Resolver::complete(Request *request, const CacheEntry &entry)
+{
+    if (entry.found) {
+        ResolvedAddress addr = entry.addr;
+        // The port is at the same offset in sockaddr_in and sockaddr_in6
+        ((sockaddr_in *)&addr.addr)->sin_port = htons(request->port);
+        _handler.handle_resolved(*request, &addr);
+    } else {
+        _handler.handle_resolved(*request, NULL);
+    }
+    delete request;
+}
+
+void Resolver::resolve(Request *request)
+{
+    CacheEntry entry;
+    if (find_cached(cache_key(*request), entry)) {
+        complete(request, entry);
+        return;
+    }
+    {
+        MutexLocker lock(_mutex);
+        _requests.push_back(request);
+    }
+#ifdef _WIN32
+    ReleaseSemaphore(_semaphore, 1, NULL);
+#else
+    sem_post(&_semaphore);
+#endif
+}
+
+void Resolver::handle_requests()
+{
+    for (;;) {
+#ifdef _WIN32
+        WaitForSingleObject(_semaphore, INFINITE);
+#else
+        while (sem_wait(&_semaphore) && errno == EINTR);
+#endif
+        if (_stopping) {
+            break;
+        }
+        Request *request;
+        {
+            MutexLocker lock(_mutex);
+            request = _requests.front();
+            _requests.pop_front();
+        }
+        // Another thread may have looked it up meanwhile
+        std::string key = cache_key(*request);
+        CacheEntry entry;
+        if (!find_cached(key, entry)) {
+            entry.found = _lookup->lookup(request->host, request->passive, entry.addr);
+            entry.expires = now_seconds() + (entry.found ? FOUND_TTL : NOT_FOUND_TTL);
+            MutexLocker lock(_mutex);
+            if (_cache.size() >= MAX_CACHE_ENTRIES) {
+                _cache.clear();
+            }
+            _cache[key] = entry;
+        }
+        complete(request, entry);
+    }
+}
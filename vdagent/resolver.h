@@ -0,0 +1,104 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __RESOLVER_H
+#define __RESOLVER_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "vdcommon.h"
+#ifndef _WIN32
+#include <semaphore.h>
+#include <sys/socket.h>
+#endif
+
+// Room for an address of any family; sockaddr_storage is not in winsock.h
+struct ResolvedAddress {
+    int len;
+    union {
+        sockaddr addr;
+        char storage[128];
+    };
+};
+
+/*
+ * Host name lookups for the port forwarder. They are done on a small pool of
+ * threads so that a slow name server never blocks the caller, and results are
+ * cached for a while (failures for a shorter one). Both IPv4 and IPv6
+ * addresses are returned.
+ */
+class Resolver {
+public:
+    // The blocking lookup, which tests may replace. Returns false when the
+    // host is not found; the port of the address is ignored.
+    class Lookup {
+    public:
+        virtual ~Lookup() {}
+        virtual bool lookup(const std::string &host, bool passive, ResolvedAddress &addr) = 0;
+    };
+
+    // Requests are deleted by the resolver once handled, or when it is
+    // destroyed with them still pending
+    struct Request {
+        std::string host;
+        uint16_t port;
+        // The address is to listen to
+        bool passive;
+
+        virtual ~Request() {}
+    };
+
+    class Handler {
+    public:
+        virtual ~Handler() {}
+        // addr is NULL when the host was not found
+        virtual void handle_resolved(Request &request, const ResolvedAddress *addr) = 0;
+    };
+
+    // getaddrinfo() is used if no lookup is given; the resolver owns it
+    Resolver(Handler &handler, int threads = 2, Lookup *lookup = NULL);
+    ~Resolver();
+
+    // Completes on a pool thread, or on the calling thread before returning
+    // if the result is cached
+    void resolve(Request *request);
+
+private:
+    struct CacheEntry {
+        bool found;
+        ResolvedAddress addr;
+        uint32_t expires;
+    };
+
+    Handler &_handler;
+    Lookup *_lookup;
+    mutex_t _mutex;
+    std::deque<Request *> _requests;
+    std::map<std::string, CacheEntry> _cache;
+    volatile bool _stopping;
+#ifdef _WIN32
+    HANDLE _semaphore;
+    std::vector<HANDLE> _threads;
+#else
+    sem_t _semaphore;
+    std::vector<pthread_t> _threads;
+#endif
+
+    bool find_cached(const std::string &key, CacheEntry &entry);
+    void complete(Request *request, const CacheEntry &entry);
+    void handle_requests();
+#ifdef _WIN32
+    static DWORD WINAPI thread_proc(LPVOID param);
+#else
+    static void *thread_proc(void *param);
+#endif
+
+    // no copy
+    Resolver(const Resolver&);
+    void operator=(const Resolver&);
+};
+
+#endif // __RESOLVER_H
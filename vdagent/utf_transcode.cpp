@@ -0,0 +1,303 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#include "utf_transcode.h"
+
+// With GCC the vector versions are built for their instruction set whatever
+// the target, and picked at run time. Visual Studio only has the SSE2 one,
+// where SSE2 is always there.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define UTF_SSE2 __attribute__((target("sse2")))
+#define UTF_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define UTF_SSE2
+#endif
+
+static const uint32_t REPLACEMENT = 0xfffd;
+
+// Converts the characters that start before stop; a surrogate pair may end
+// at stop. Returns where it stopped.
+static inline size_t utf16_chars(const uint16_t *src, size_t i, size_t stop, size_t count,
+                                 uint8_t *&dst)
+{
+    uint8_t *d = dst;
+    while (i < stop) {
+        uint32_t c = src[i++];
+        if (c < 0x80) {
+            *d++ = (uint8_t)c;
+            continue;
+        }
+        if (c < 0x800) {
+            d[0] = (uint8_t)(0xc0 | (c >> 6));
+            d[1] = (uint8_t)(0x80 | (c & 0x3f));
+            d += 2;
+            continue;
+        }
+        if ((c & 0xf800) == 0xd800) {
+            if (c < 0xdc00 && i < count && (src[i] & 0xfc00) == 0xdc00) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (src[i++] - 0xdc00);
+                d[0] = (uint8_t)(0xf0 | (c >> 18));
+                d[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3f));
+                d[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+                d[3] = (uint8_t)(0x80 | (c & 0x3f));
+                d += 4;
+                continue;
+            }
+            c = REPLACEMENT;
+        }
+        d[0] = (uint8_t)(0xe0 | (c >> 12));
+        d[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+        d[2] = (uint8_t)(0x80 | (c & 0x3f));
+        d += 3;
+    }
+    dst = d;
+    return i;
+}
+
+// Converts the sequences that start before stop, like utf16_chars(). The
+// first continuation byte has a narrower range after some lead bytes, which
+// rules out overlongs, surrogates and code points above U+10FFFF.
+static inline size_t utf8_chars(const uint8_t *src, size_t i, size_t stop, size_t size,
+                                uint16_t *&dst)
+{
+    uint16_t *d = dst;
+    while (i < stop) {
+        uint32_t c = src[i];
+        if (c < 0x80) {
+            *d++ = (uint16_t)c;
+            i++;
+            continue;
+        }
+        int need;
+        uint8_t low = 0x80, high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            need = 1;
+            c &= 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            need = 2;
+            c &= 0x0f;
+            if (c == 0x00) {
+                low = 0xa0;
+            } else if (c == 0x0d) {
+                high = 0x9f;
+            }
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            need = 3;
+            c &= 0x07;
+            if (c == 0) {
+                low = 0x90;
+            } else if (c == 4) {
+                high = 0x8f;
+            }
+        } else {
+            *d++ = REPLACEMENT;
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        for (; need; --need, ++j) {
+            if (j == size || src[j] < low || src[j] > high) {
+                break;
+            }
+            c = (c << 6) | (src[j] & 0x3f);
+            low = 0x80;
+            high = 0xbf;
+        }
+        i = j;
+        if (need) {
+            // The valid prefix is one invalid sequence
+            *d++ = REPLACEMENT;
+        } else if (c >= 0x10000) {
+            c -= 0x10000;
+            d[0] = (uint16_t)(0xd800 | (c >> 10));
+            d[1] = (uint16_t)(0xdc00 | (c & 0x3ff));
+            d += 2;
+        } else {
+            *d++ = (uint16_t)c;
+        }
+    }
+    dst = d;
+    return i;
+}
+
+static size_t utf16_to_utf8_scalar(const uint16_t *src, size_t count, uint8_t *dst)
+{
+    uint8_t *d = dst;
+    utf16_chars(src, 0, count, count, d);
+    return d - dst;
+}
+
+static size_t utf8_to_utf16_scalar(const uint8_t *src, size_t size, uint16_t *dst)
+{
+    uint16_t *d = dst;
+    utf8_chars(src, 0, size, size, d);
+    return d - dst;
+}
+
+// The vector versions take blocks of ASCII at once, and leave a block with
+// anything else to the scalar code. Text that is not mostly ASCII would fail
+// every check, so the scalar code takes twice as many blocks after every
+// failed one, up to MAX_SCALAR_BLOCKS, until a check succeeds.
+static const size_t MAX_SCALAR_BLOCKS = 64;
+
+static inline size_t scalar_end(size_t i, size_t block, size_t &scalar_blocks, size_t limit)
+{
+    size_t end = i + block * scalar_blocks;
+    scalar_blocks = scalar_blocks < MAX_SCALAR_BLOCKS ? scalar_blocks * 2 : MAX_SCALAR_BLOCKS;
+    return end < limit ? end : limit;
+}
+
+#ifdef UTF_SSE2
+UTF_SSE2
+static size_t utf16_to_utf8_sse2(const uint16_t *src, size_t count, uint8_t *dst)
+{
+    const __m128i non_ascii = _mm_set1_epi16((short)0xff80);
+    const __m128i zero = _mm_setzero_si128();
+    uint8_t *d = dst;
+    size_t i = 0, scalar_blocks = 1;
+    while (count - i >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        __m128i high = _mm_and_si128(_mm_or_si128(a, b), non_ascii);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) == 0xffff) {
+            _mm_storeu_si128((__m128i *)d, _mm_packus_epi16(a, b));
+            d += 16;
+            i += 16;
+            scalar_blocks = 1;
+        } else {
+            i = utf16_chars(src, i, scalar_end(i, 16, scalar_blocks, count), count, d);
+        }
+    }
+    utf16_chars(src, i, count, count, d);
+    return d - dst;
+}
+
+UTF_SSE2
+static size_t utf8_to_utf16_sse2(const uint8_t *src, size_t size, uint16_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint16_t *d = dst;
+    size_t i = 0, scalar_blocks = 1;
+    while (size - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (!_mm_movemask_epi8(v)) {
+            _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *)(d + 8), _mm_unpackhi_epi8(v, zero));
+            d += 16;
+            i += 16;
+            scalar_blocks = 1;
+        } else {
+            i = utf8_chars(src, i, scalar_end(i, 16, scalar_blocks, size), size, d);
+        }
+    }
+    utf8_chars(src, i, size, size, d);
+    return d - dst;
+}
+#endif
+
+#ifdef UTF_AVX2
+UTF_AVX2
+static size_t utf16_to_utf8_avx2(const uint16_t *src, size_t count, uint8_t *dst)
+{
+    const __m256i non_ascii = _mm256_set1_epi16((short)0xff80);
+    uint8_t *d = dst;
+    size_t i = 0, scalar_blocks = 1;
+    while (count - i >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), non_ascii)) {
+            // Packing works within each half, the quarters are put back in order
+            __m256i packed = _mm256_packus_epi16(a, b);
+            _mm256_storeu_si256((__m256i *)d, _mm256_permute4x64_epi64(packed, 0xd8));
+            d += 32;
+            i += 32;
+            scalar_blocks = 1;
+        } else {
+            i = utf16_chars(src, i, scalar_end(i, 32, scalar_blocks, count), count, d);
+        }
+    }
+    utf16_chars(src, i, count, count, d);
+    return d - dst;
+}
+
+UTF_AVX2
+static size_t utf8_to_utf16_avx2(const uint8_t *src, size_t size, uint16_t *dst)
+{
+    uint16_t *d = dst;
+    size_t i = 0, scalar_blocks = 1;
+    while (size - i >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (!_mm256_movemask_epi8(v)) {
+            _mm256_storeu_si256((__m256i *)d, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+            _mm256_storeu_si256((__m256i *)(d + 16),
+                                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+            d += 32;
+            i += 32;
+            scalar_blocks = 1;
+        } else {
+            i = utf8_chars(src, i, scalar_end(i, 32, scalar_blocks, size), size, d);
+        }
+    }
+    utf8_chars(src, i, size, size, d);
+    return d - dst;
+}
+#endif
+
+enum SimdLevel {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+// Checked once; threads that race to it get the same answer
+static SimdLevel simd_level()
+{
+#ifdef UTF_AVX2
+    static volatile int level = -1;
+    if (level < 0) {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 :
+                __builtin_cpu_supports("sse2") ? SIMD_SSE2 : SIMD_NONE;
+    }
+    return (SimdLevel)level;
+#elif defined(UTF_SSE2)
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+size_t utf16_to_utf8(const uint16_t *src, size_t count, uint8_t *dst)
+{
+    switch (simd_level()) {
+#ifdef UTF_AVX2
+    case SIMD_AVX2:
+        return utf16_to_utf8_avx2(src, count, dst);
+#endif
+#ifdef UTF_SSE2
+    case SIMD_SSE2:
+        return utf16_to_utf8_sse2(src, count, dst);
+#endif
+    default:
+        return utf16_to_utf8_scalar(src, count, dst);
+    }
+}
+
+size_t utf8_to_utf16(const uint8_t *src, size_t size, uint16_t *dst)
+{
+    switch (simd_level()) {
+#ifdef UTF_AVX2
+    case SIMD_AVX2:
+        return utf8_to_utf16_avx2(src, size, dst);
+#endif
+#ifdef UTF_SSE2
+    case SIMD_SSE2:
+        return utf8_to_utf16_sse2(src, size, dst);
+#endif
+    default:
+        return utf8_to_utf16_scalar(src, size, dst);
+    }
+}
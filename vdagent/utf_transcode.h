@@ -0,0 +1,31 @@
+/**
+ * Copyright Flexible Software Solutions S.L. 2014
+ **/
+
+#ifndef __UTF_TRANSCODE_H
+#define __UTF_TRANSCODE_H
+
+#include <stddef.h>
+#include "vdcommon.h"
+
+/*
+ * Single pass conversions between UTF-16 (as in WCHAR strings) and UTF-8,
+ * for clipboard text. Runs of ASCII are converted with SSE2 or AVX2, when
+ * the processor has them, and everything else one character at a time.
+ *
+ * Invalid input is not an error: an unpaired surrogate, or a UTF-8 sequence
+ * that is truncated, overlong, a surrogate or above U+10FFFF, becomes one
+ * U+FFFD per maximal invalid subsequence, like MultiByteToWideChar() and
+ * WideCharToMultiByte() do without MB_ERR_INVALID_CHARS. Nothing is
+ * null-terminated.
+ */
+
+// The output never takes more than this
+#define UTF8_MAX_SIZE(utf16_count) ((utf16_count) * 3)
+#define UTF16_MAX_COUNT(utf8_size) (utf8_size)
+
+// Return the bytes or units written to dst
+size_t utf16_to_utf8(const uint16_t *src, size_t count, uint8_t *dst);
+size_t utf8_to_utf16(const uint8_t *src, size_t size, uint16_t *dst);
+
+#endif // __UTF_TRANSCODE_H
@@ -21,12 +21,15 @@
 #include "file_xfer.h"
 #include "ximage.h"
 #include "port_forward.h"
+#include "chunk_transport.h"
+#include "chunked_buffer.h"
+#include "utf_transcode.h"
 #undef max
 #undef min
 #include <spice/macros.h>
 #include <wtsapi32.h>
 #include <lmcons.h>
-#include <queue>
+#include <algorithm>
 #include <set>
 #include <vector>
 
@@ -66,19 +69,11 @@ static const ImageType image_types[] = {
     {VD_AGENT_CLIPBOARD_IMAGE_BMP, CXIMAGE_FORMAT_BMP},
 };
 
-typedef struct ALIGN_VC VDIChunk {
-    VDIChunkHeader hdr;
-    uint8_t data[0];
-} ALIGN_GCC VDIChunk;
-
-#define VD_MESSAGE_HEADER_SIZE (sizeof(VDIChunk) + sizeof(VDAgentMessage))
-#define VD_READ_BUF_SIZE       (sizeof(VDIChunk) + VD_AGENT_MAX_DATA_SIZE)
-
 typedef BOOL (WINAPI *PCLIPBOARD_OP)(HWND);
 
 struct VDAgentSendPFCommand;
 
-class VDAgent {
+class VDAgent : public ChunkTransport::Handler {
 public:
     static VDAgent* get();
     ~VDAgent();
@@ -98,7 +93,10 @@ private:
     void handle_clipboard_release();
     bool handle_display_config(VDAgentDisplayConfig* display_config, uint32_t port);
     bool handle_max_clipboard(VDAgentMaxClipboard *msg, uint32_t size);
-    void handle_chunk(VDIChunk* chunk);
+    void handle_message(VDAgentMessage* msg, uint32_t port);
+    void handle_partial_message(VDAgentMessage* msg);
+    void handle_transport_error();
+    void handle_queue_drained(int prio);
     void on_clipboard_grab();
     void on_clipboard_request(UINT format);
     void on_clipboard_release();
@@ -107,27 +105,21 @@ private:
     static HGLOBAL utf8_alloc(LPCSTR data, int size);
     static LRESULT CALLBACK wnd_proc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam);
     static DWORD WINAPI event_thread_proc(LPVOID param);
-    static VOID CALLBACK read_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped);
-    static VOID CALLBACK write_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped);
     void dispatch_message(VDAgentMessage* msg, uint32_t port);
     uint32_t get_clipboard_format(uint32_t type) const;
     uint32_t get_clipboard_type(uint32_t format) const;
     DWORD get_cximage_format(uint32_t type) const;
     enum { owner_none, owner_guest, owner_client };
     void set_clipboard_owner(int new_owner);
-    enum { CONTROL_STOP, CONTROL_RESET, CONTROL_DESKTOP_SWITCH, CONTROL_LOGON, CONTROL_CLIPBOARD, CONTROL_DATA };
+    enum { CONTROL_STOP, CONTROL_RESET, CONTROL_DESKTOP_SWITCH, CONTROL_LOGON, CONTROL_CLIPBOARD };
     void set_control_event(int control_command);
     void handle_control_event();
-    VDIChunk* new_chunk(DWORD bytes = 0);
-    void enqueue_chunk(VDIChunk* msg);
     bool write_message(uint32_t type, uint32_t size, void* data);
-    bool write_clipboard(VDAgentMessage* msg, uint32_t size);
     bool init_vio_serial();
     bool send_input();
     void set_display_depth(uint32_t depth);
     void load_display_setting();
     bool send_announce_capabilities(bool request);
-    void cleanup_in_msg();
     void cleanup();
     bool has_capability(unsigned int capability) const {
         return VD_AGENT_HAS_CAPABILITY(_client_caps.begin(), _client_caps.size(),
@@ -151,8 +143,7 @@ private:
     DWORD _input_time;
     HANDLE _control_event;
     HANDLE _stop_event;
-    VDAgentMessage* _in_msg;
-    uint32_t _in_msg_pos;
+    HANDLE _metrics_event;
     bool _pending_input;
     bool _running;
     bool _session_is_locked;
@@ -161,16 +152,13 @@ private:
     bool _updating_display_config;
     DisplaySetting _display_setting;
     FileXfer _file_xfer;
-    HANDLE _vio_serial;
-    OVERLAPPED _read_overlapped;
-    OVERLAPPED _write_overlapped;
-    CHAR _read_buf[VD_READ_BUF_SIZE];
-    DWORD _read_pos;
-    DWORD _write_pos;
+    ChunkTransport _transport;
+    VioSerialStream _vio_serial;
     mutex_t _control_mutex;
-    mutex_t _message_mutex;
-    std::queue<int> _control_queue;
-    std::queue<VDIChunk*> _message_queue;
+    // Pending control commands, one bit each; repeated ones coalesce
+    uint32_t _control_pending;
+    uint32_t _control_count;
+    uint32_t _control_coalesced;
 
     bool _logon_desktop;
     bool _display_setting_initialized;
@@ -190,39 +178,28 @@ private:
 
 VDAgent* VDAgent::_singleton = NULL;
 
+// Called from the port forwarder thread; messages go straight to the
+// transport, which wakes up the main thread to write them.
 struct VDAgentSendPFCommand : public PortForwarder::Sender {
-    std::list<VDIChunk *> commands;
-    mutex_t mutex;
     ~VDAgentSendPFCommand() {}
     void *get_buffer(size_t size) {
-        uint8_t* buffer = new uint8_t[VD_MESSAGE_HEADER_SIZE + size];
-        return buffer ? buffer + VD_MESSAGE_HEADER_SIZE : NULL;
+        VDIMessage* msg = VDAgent::_singleton->_transport.new_message(VDP_CLIENT_PORT, 0, size);
+        return msg ? msg->payload() : NULL;
     }
     void send(uint32_t type, size_t size, void* data) {
         LOG(LOG_DEBUG, "Sending command %d with %d bytes", (int)type, (int)size);
-        uint8_t *buffer = ((uint8_t *)data) - VD_MESSAGE_HEADER_SIZE;
+        VDIMessage* msg = VDIMessage::from_payload(data);
         if (size) {
-            VDIChunk* msg_chunk = (VDIChunk *)buffer;
-            msg_chunk->hdr.port = VDP_CLIENT_PORT;
-            msg_chunk->hdr.size = sizeof(VDAgentMessage) + size;
-            VDAgentMessage* msg = (VDAgentMessage*)msg_chunk->data;
-            msg->protocol = VD_AGENT_PROTOCOL;
-            msg->type = type;
-            msg->opaque = 0;
-            msg->size = size;
-            MutexLocker lock(mutex);
-            commands.push_back(msg_chunk);
-            VDAgent::_singleton->set_control_event(VDAgent::CONTROL_DATA);
-        } else delete[] buffer;
-    }
-    VDIChunk *get_chunk() {
-        VDIChunk *result = NULL;
-        MutexLocker lock(mutex);
-        if (!commands.empty()) {
-            result = commands.front();
-            commands.pop_front();
-        }
-        return result;
+            msg->hdr.msg.type = type;
+            msg->inline_size = size;
+            VDAgent::_singleton->_transport.enqueue_message(msg);
+        } else VDAgent::_singleton->_transport.free_message(msg);
+    }
+    size_t queued_bytes() {
+        return VDAgent::_singleton->_transport.queued_bytes(ChunkTransport::PRIO_PORT_FORWARD);
+    }
+    void set_low_water(size_t bytes) {
+        VDAgent::_singleton->_transport.set_low_water(ChunkTransport::PRIO_PORT_FORWARD, bytes);
     }
 };
 
@@ -250,17 +227,18 @@ VDAgent::VDAgent()
     , _input_time (0)
     , _control_event (NULL)
     , _stop_event (NULL)
-    , _in_msg (NULL)
-    , _in_msg_pos (0)
+    , _metrics_event (NULL)
     , _pending_input (false)
     , _running (false)
     , _session_is_locked (false)
     , _desktop_switch (false)
     , _desktop_layout (NULL)
     , _display_setting (VD_AGENT_REGISTRY_KEY)
-    , _vio_serial (NULL)
-    , _read_pos (0)
-    , _write_pos (0)
+    , _transport (*this)
+    , _vio_serial (_transport)
+    , _control_pending (0)
+    , _control_count (0)
+    , _control_coalesced (0)
     , _logon_desktop (false)
     , _display_setting_initialized (false)
     , _max_clipboard (-1)
@@ -277,9 +255,7 @@ VDAgent::VDAgent()
         _log = VDLog::get(log_path);
     }
     ZeroMemory(&_input, sizeof(_input));
-    ZeroMemory(&_read_overlapped, sizeof(_read_overlapped));
-    ZeroMemory(&_write_overlapped, sizeof(_write_overlapped));
-    ZeroMemory(_read_buf, sizeof(_read_buf));
+    _transport.set_stream(&_vio_serial);
     _send_command = new VDAgentSendPFCommand();
 
     _singleton = this;
@@ -355,6 +331,10 @@ bool VDAgent::run()
         return false;
     }
     _stop_event = OpenEvent(SYNCHRONIZE, FALSE, VD_AGENT_STOP_EVENT);
+    _metrics_event = CreateEvent(NULL, FALSE, FALSE, VD_AGENT_METRICS_EVENT);
+    if (!_metrics_event) {
+        vd_printf("CreateEvent() for metrics failed: %lu", GetLastError());
+    }
     memset(&wcls, 0, sizeof(wcls));
     wcls.lpfnWndProc = &VDAgent::wnd_proc;
     wcls.lpszClassName = VD_AGENT_WINCLASS_NAME;
@@ -371,9 +351,7 @@ bool VDAgent::run()
         cleanup();
         return false;
     }
-    if (!ReadFileEx(_vio_serial, _read_buf, sizeof(VDIChunk), &_read_overlapped, read_completion) &&
-            GetLastError() != ERROR_IO_PENDING) {
-        vd_printf("vio_serial read error %lu", GetLastError());
+    if (!_transport.start()) {
         cleanup();
         return false;
     }
@@ -385,6 +363,11 @@ bool VDAgent::run()
         return false;
     }
     _pf = new PortForwarder(*_send_command);
+    if (!_pf->started()) {
+        vd_printf("Port forwarding disabled");
+        delete _pf;
+        _pf = NULL;
+    }
     send_announce_capabilities(true);
     vd_printf("Connected to server");
 
@@ -404,8 +387,11 @@ void VDAgent::cleanup()
 {
     FreeLibrary(_user_lib);
     CloseHandle(_stop_event);
+    CloseHandle(_metrics_event);
     CloseHandle(_control_event);
-    CloseHandle(_vio_serial);
+    _vio_serial.close();
+    _transport.log_stats();
+    vd_printf("Control commands: %u, %u coalesced", _control_count, _control_coalesced);
     delete _desktop_layout;
     delete _pf;
     delete _send_command;
@@ -414,7 +400,13 @@ void VDAgent::cleanup()
 void VDAgent::set_control_event(int control_command)
 {
     MutexLocker lock(_control_mutex);
-    _control_queue.push(control_command);
+    _control_count++;
+    if (_control_pending & (1 << control_command)) {
+        // Already signaled and not handled yet
+        _control_coalesced++;
+        return;
+    }
+    _control_pending |= 1 << control_command;
     if (_control_event && !SetEvent(_control_event)) {
         vd_printf("SetEvent() failed: %lu", GetLastError());
     }
@@ -423,10 +415,13 @@ void VDAgent::set_control_event(int control_command)
 void VDAgent::handle_control_event()
 {
     MutexLocker lock(_control_mutex);
-    while (_control_queue.size()) {
-        int control_command = _control_queue.front();
-        _control_queue.pop();
-        vd_printf("Control command %d", control_command);
+    while (_control_pending) {
+        int control_command = 0;
+        while (!(_control_pending & (1 << control_command))) {
+            control_command++;
+        }
+        _control_pending &= ~(1 << control_command);
+        LOG(LOG_DEBUG, "Control command %d", control_command);
         switch (control_command) {
         case CONTROL_RESET:
             _file_xfer.reset();
@@ -453,9 +448,6 @@ void VDAgent::handle_control_event()
         case CONTROL_CLIPBOARD:
             _clipboard_tick = 0;
             break;
-        case CONTROL_DATA:
-            enqueue_chunk(_send_command->get_chunk());
-            break;
         default:
             vd_printf("Unsupported control command %u", control_command);
         }
@@ -536,13 +528,14 @@ void VDAgent::input_desktop_message_loop()
 
 void VDAgent::event_dispatcher(DWORD timeout, DWORD wake_mask)
 {
-    HANDLE events[2];
+    HANDLE events[3];
     DWORD event_count = 1;
     DWORD wait_ret;
     MSG msg;
     enum {
         CONTROL_ACTION,
         STOP_ACTION,
+        METRICS_ACTION,
     } actions[SPICE_N_ELEMENTS(events)], action;
 
     events[0] = _control_event;
@@ -552,6 +545,11 @@ void VDAgent::event_dispatcher(DWORD timeout, DWORD wake_mask)
         actions[event_count] = STOP_ACTION;
         event_count++;
     }
+    if (_metrics_event) {
+        events[event_count] = _metrics_event;
+        actions[event_count] = METRICS_ACTION;
+        event_count++;
+    }
 
     wait_ret = MsgWaitForMultipleObjectsEx(event_count, events, timeout, wake_mask, MWMO_ALERTABLE);
     if (wait_ret == WAIT_OBJECT_0 + event_count) {
@@ -577,6 +575,11 @@ void VDAgent::event_dispatcher(DWORD timeout, DWORD wake_mask)
         vd_printf("%s: received stop event", __func__);
         _running = false;
         break;
+    case METRICS_ACTION:
+        if (_pf) {
+            _pf->log_metrics();
+        }
+        break;
     default:
         vd_printf("%s: action not handled (%d)", __func__, action);
         _running = false;
@@ -694,8 +697,7 @@ bool VDAgent::handle_mouse_event(VDAgentMouseState* state)
 
 bool VDAgent::handle_mon_config(VDAgentMonitorsConfig* mon_config, uint32_t port)
 {
-    VDIChunk* reply_chunk;
-    VDAgentMessage* reply_msg;
+    VDIMessage* reply_msg;
     VDAgentReply* reply;
     size_t display_count;
     bool update_displays(false);
@@ -744,22 +746,14 @@ bool VDAgent::handle_mon_config(VDAgentMonitorsConfig* mon_config, uint32_t port
     /* refresh again, in case something else changed */
     _desktop_layout->get_displays();
 
-    DWORD msg_size = VD_MESSAGE_HEADER_SIZE + sizeof(VDAgentReply);
-    reply_chunk = new_chunk(msg_size);
-    if (!reply_chunk) {
+    reply_msg = _transport.new_message(port, VD_AGENT_REPLY, sizeof(VDAgentReply));
+    if (!reply_msg) {
         return false;
     }
-    reply_chunk->hdr.port = port;
-    reply_chunk->hdr.size = sizeof(VDAgentMessage) + sizeof(VDAgentReply);
-    reply_msg = (VDAgentMessage*)reply_chunk->data;
-    reply_msg->protocol = VD_AGENT_PROTOCOL;
-    reply_msg->type = VD_AGENT_REPLY;
-    reply_msg->opaque = 0;
-    reply_msg->size = sizeof(VDAgentReply);
-    reply = (VDAgentReply*)reply_msg->data;
+    reply = (VDAgentReply*)reply_msg->payload();
     reply->type = VD_AGENT_MONITORS_CONFIG;
     reply->error = display_count ? VD_AGENT_SUCCESS : VD_AGENT_ERROR;
-    enqueue_chunk(reply_chunk);
+    _transport.enqueue_message(reply_msg);
     return true;
 }
 
@@ -815,29 +809,30 @@ HGLOBAL VDAgent::utf8_alloc(LPCSTR data, int size)
 {
     HGLOBAL handle;
     LPVOID buf;
-    int len;
+    size_t len;
 
-    // Received utf8 string is not null-terminated
-    if (!(len = MultiByteToWideChar(CP_UTF8, 0, data, size, NULL, 0))) {
+    if (size <= 0) {
         return NULL;
     }
-    len++;
-    // Allocate and lock clipboard memory
-    if (!(handle = GlobalAlloc(GMEM_DDESHARE, len * sizeof(WCHAR)))) {
+    // Allocate for the longest result and translate in one pass, instead of
+    // translating once to size it. Received utf8 string is not null-terminated.
+    if (!(handle = GlobalAlloc(GMEM_DDESHARE, (UTF16_MAX_COUNT(size) + 1) * sizeof(WCHAR)))) {
         return NULL;
     }
     if (!(buf = GlobalLock(handle))) {
         GlobalFree(handle);
         return NULL;
     }
-    // Translate data and set clipboard content
-    if (!(MultiByteToWideChar(CP_UTF8, 0, data, size, (LPWSTR)buf, len))) {
-        GlobalUnlock(handle);
-        GlobalFree(handle);
-        return NULL;
-    }
-    ((LPWSTR)buf)[len - 1] = L'\0';
+    len = utf8_to_utf16((const uint8_t*)data, size, (uint16_t*)buf);
+    ((LPWSTR)buf)[len] = L'\0';
     GlobalUnlock(handle);
+    // Give back what non-ASCII text did not use; keep the block if that fails
+    if (len < (size_t)size) {
+        HGLOBAL shrunk = GlobalReAlloc(handle, (len + 1) * sizeof(WCHAR), 0);
+        if (shrunk) {
+            handle = shrunk;
+        }
+    }
     return handle;
 }
 
@@ -867,27 +862,18 @@ void VDAgent::load_display_setting()
 
 bool VDAgent::send_announce_capabilities(bool request)
 {
-    DWORD msg_size;
-    VDIChunk* caps_chunk;
-    VDAgentMessage* caps_msg;
+    VDIMessage* caps_msg;
     VDAgentAnnounceCapabilities* caps;
     uint32_t caps_size;
     uint32_t internal_msg_size = sizeof(VDAgentAnnounceCapabilities) + VD_AGENT_CAPS_BYTES;
 
-    msg_size = VD_MESSAGE_HEADER_SIZE + internal_msg_size;
-    caps_chunk = new_chunk(msg_size);
-    if (!caps_chunk) {
+    caps_msg = _transport.new_message(VDP_CLIENT_PORT, VD_AGENT_ANNOUNCE_CAPABILITIES,
+                                      internal_msg_size);
+    if (!caps_msg) {
         return false;
     }
     caps_size = VD_AGENT_CAPS_SIZE;
-    caps_chunk->hdr.port = VDP_CLIENT_PORT;
-    caps_chunk->hdr.size = sizeof(VDAgentMessage) + internal_msg_size;
-    caps_msg = (VDAgentMessage*)caps_chunk->data;
-    caps_msg->protocol = VD_AGENT_PROTOCOL;
-    caps_msg->type = VD_AGENT_ANNOUNCE_CAPABILITIES;
-    caps_msg->opaque = 0;
-    caps_msg->size = internal_msg_size;
-    caps = (VDAgentAnnounceCapabilities*)caps_msg->data;
+    caps = (VDAgentAnnounceCapabilities*)caps_msg->payload();
     caps->request = request;
     memset(caps->caps, 0, VD_AGENT_CAPS_BYTES);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MOUSE_STATE);
@@ -898,12 +884,15 @@ bool VDAgent::send_announce_capabilities(bool request)
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_SPARSE_MONITORS_CONFIG);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_GUEST_LINEEND_CRLF);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MAX_CLIPBOARD);
-    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_PORT_FORWARDING);
+    if (_pf) {
+        VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_PORT_FORWARDING);
+        VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_PORT_FORWARD_COMPRESSION);
+    }
     vd_printf("Sending capabilities:");
     for (uint32_t i = 0 ; i < caps_size; ++i) {
         vd_printf("%X", caps->caps[i]);
     }
-    enqueue_chunk(caps_chunk);
+    _transport.enqueue_message(caps_msg);
     return true;
 }
 
@@ -920,6 +909,8 @@ bool VDAgent::handle_announce_capabilities(VDAgentAnnounceCapabilities* announce
 
     if (has_capability(VD_AGENT_CAP_MONITORS_CONFIG_POSITION))
         _desktop_layout->set_position_configurable(true);
+    if (_pf)
+        _pf->set_client_compression(has_capability(VD_AGENT_CAP_PORT_FORWARD_COMPRESSION));
     if (announce_capabilities->request) {
         return send_announce_capabilities(false);
     }
@@ -929,10 +920,8 @@ bool VDAgent::handle_announce_capabilities(VDAgentAnnounceCapabilities* announce
 bool VDAgent::handle_display_config(VDAgentDisplayConfig* display_config, uint32_t port)
 {
     DisplaySettingOptions disp_setting_opts;
-    VDIChunk* reply_chunk;
-    VDAgentMessage* reply_msg;
+    VDIMessage* reply_msg;
     VDAgentReply* reply;
-    DWORD msg_size;
 
     if (display_config->flags & VD_AGENT_DISPLAY_CONFIG_FLAG_DISABLE_WALLPAPER) {
         disp_setting_opts._disable_wallpaper = TRUE;
@@ -952,22 +941,14 @@ bool VDAgent::handle_display_config(VDAgentDisplayConfig* display_config, uint32
         set_display_depth(display_config->depth);
     }
 
-    msg_size = VD_MESSAGE_HEADER_SIZE + sizeof(VDAgentReply);
-    reply_chunk = new_chunk(msg_size);
-    if (!reply_chunk) {
+    reply_msg = _transport.new_message(port, VD_AGENT_REPLY, sizeof(VDAgentReply));
+    if (!reply_msg) {
         return false;
     }
-    reply_chunk->hdr.port = port;
-    reply_chunk->hdr.size = sizeof(VDAgentMessage) + sizeof(VDAgentReply);
-    reply_msg = (VDAgentMessage*)reply_chunk->data;
-    reply_msg->protocol = VD_AGENT_PROTOCOL;
-    reply_msg->type = VD_AGENT_REPLY;
-    reply_msg->opaque = 0;
-    reply_msg->size = sizeof(VDAgentReply);
-    reply = (VDAgentReply*)reply_msg->data;
+    reply = (VDAgentReply*)reply_msg->payload();
     reply->type = VD_AGENT_DISPLAY_CONFIG;
     reply->error = VD_AGENT_SUCCESS;
-    enqueue_chunk(reply_chunk);
+    _transport.enqueue_message(reply_msg);
     return true;
 }
 
@@ -983,50 +964,18 @@ bool VDAgent::handle_max_clipboard(VDAgentMaxClipboard *msg, uint32_t size)
     return true;
 }
 
-bool VDAgent::write_clipboard(VDAgentMessage* msg, uint32_t size)
-{
-    uint32_t pos = 0;
-    bool ret = true;
-
-    ASSERT(msg && size);
-    //FIXME: do it smarter - no loop, no memcopy
-    MutexLocker lock(_message_mutex);
-    while (pos < size) {
-        DWORD n = MIN(sizeof(VDIChunk) + size - pos, VD_AGENT_MAX_DATA_SIZE);
-        VDIChunk* chunk = new_chunk(n);
-        if (!chunk) {
-            ret = false;
-            break;
-        }
-        chunk->hdr.port = VDP_CLIENT_PORT;
-        chunk->hdr.size = n - sizeof(VDIChunk);
-        memcpy(chunk->data, (char*)msg + pos, n - sizeof(VDIChunk));
-        enqueue_chunk(chunk);
-        pos += (n - sizeof(VDIChunk));
-    }
-    return ret;
-}
-
 bool VDAgent::write_message(uint32_t type, uint32_t size = 0, void* data = NULL)
 {
-    VDIChunk* chunk;
-    VDAgentMessage* msg;
+    VDIMessage* msg;
 
-    chunk = new_chunk(VD_MESSAGE_HEADER_SIZE + size);
-    if (!chunk) {
+    msg = _transport.new_message(VDP_CLIENT_PORT, type, size);
+    if (!msg) {
         return false;
     }
-    chunk->hdr.port = VDP_CLIENT_PORT;
-    chunk->hdr.size = sizeof(VDAgentMessage) + size;
-    msg = (VDAgentMessage*)chunk->data;
-    msg->protocol = VD_AGENT_PROTOCOL;
-    msg->type = type;
-    msg->opaque = 0;
-    msg->size = size;
     if (size && data) {
-        memcpy(msg->data, data, size);
+        memcpy(msg->payload(), data, size);
     }
-    enqueue_chunk(chunk);
+    _transport.enqueue_message(msg);
     return true;
 }
 
@@ -1099,7 +1048,7 @@ void VDAgent::on_clipboard_request(UINT format)
         _clipboard_tick = 0;
     } else {
         // reset incoming message state only upon completion (even after timeout)
-        cleanup_in_msg();
+        _transport.reset_in_msg();
     }
 }
 
@@ -1145,18 +1094,101 @@ bool VDAgent::handle_clipboard_grab(VDAgentClipboardGrab* clipboard_grab, uint32
     return true;
 }
 
+static void free_clipboard_image(void* data)
+{
+    CxImage image;
+    image.FreeMemory(data);
+}
+
+// Converts clipboard text to UTF-8 a slice at a time, so that the only copy
+// is the one that is sent. This is also the only pass over the text: it stops
+// as soon as the result is over limit (-1 for none), which the caller then
+// finds from its size. Returns NULL when out of memory.
+static ChunkedBuffer* clipboard_text(LPCWSTR text, size_t len, int32_t limit)
+{
+    static const size_t SLICE = 4096;
+    ChunkedBuffer* buf = new ChunkedBuffer;
+    uint8_t utf8[UTF8_MAX_SIZE(SLICE)];
+
+    for (size_t pos = 0; pos < len;) {
+        size_t count = std::min<size_t>(len - pos, SLICE);
+        // A surrogate pair is converted in one go
+        if (count < len - pos && IS_HIGH_SURROGATE(text[pos + count - 1])) {
+            count--;
+        }
+        size_t size = utf16_to_utf8((const uint16_t*)text + pos, count, utf8);
+        if (!buf->append(utf8, size)) {
+            delete buf;
+            return NULL;
+        }
+        if (limit != -1 && buf->size() > (size_t)limit) {
+            break;
+        }
+        pos += count;
+    }
+    return buf;
+}
+
+// A BMP file is the file header followed by the DIB of the image, which is
+// sent from where it is instead of being encoded into another copy
+struct ClipboardBitmap {
+    CxImage image;
+    BITMAPFILEHEADER file_header;
+    uint32_t pos;
+    uint32_t size;
+
+    // Images with an alpha channel are encoded with it instead
+    bool init() {
+        BITMAPINFOHEADER* info = (BITMAPINFOHEADER*)image.GetDIB();
+        if (!info || image.AlphaIsValid()) {
+            return false;
+        }
+        pos = 0;
+        size = sizeof(file_header) + image.GetSize();
+        file_header.bfType = 0x4d42; // "BM"
+        file_header.bfSize = size;
+        file_header.bfReserved1 = 0;
+        file_header.bfReserved2 = 0;
+        file_header.bfOffBits = sizeof(file_header) + info->biSize + image.GetPaletteSize();
+        return true;
+    }
+
+    static uint32_t read(void* opaque, uint8_t* buf, uint32_t count) {
+        ClipboardBitmap* bitmap = (ClipboardBitmap*)opaque;
+        uint32_t done = 0;
+        count = std::min<uint32_t>(count, bitmap->size - bitmap->pos);
+        if (bitmap->pos < sizeof(bitmap->file_header)) {
+            done = std::min<uint32_t>(count, sizeof(bitmap->file_header) - bitmap->pos);
+            memcpy(buf, (uint8_t*)&bitmap->file_header + bitmap->pos, done);
+            bitmap->pos += done;
+        }
+        memcpy(buf + done, (uint8_t*)bitmap->image.GetDIB() + bitmap->pos -
+               sizeof(bitmap->file_header), count - done);
+        bitmap->pos += count - done;
+        return count;
+    }
+
+    static void release(void* opaque) {
+        delete (ClipboardBitmap*)opaque;
+    }
+};
+
 // If handle_clipboard_request() fails, its caller sends VD_AGENT_CLIPBOARD message with type
 // VD_AGENT_CLIPBOARD_NONE and no data, so the client will know the request failed.
+//
+// The data is only held once: text is converted a slice at a time into the
+// blocks that are streamed and freed as they are written, a BMP is streamed
+// from the bitmap and a PNG is sent from the buffer it is encoded to.
 bool VDAgent::handle_clipboard_request(VDAgentClipboardRequest* clipboard_request)
 {
-    VDAgentMessage* msg;
-    uint32_t msg_size;
+    VDIMessage* msg;
+    ChunkedBuffer* text = NULL;
+    ClipboardBitmap* bitmap = NULL;
     UINT format;
     HANDLE clip_data;
     uint8_t* new_data = NULL;
     long new_size = 0;
     size_t len = 0;
-    CxImage image;
     VDAgentClipboard* clipboard = NULL;
 
     if (_clipboard_owner != owner_guest) {
@@ -1184,7 +1216,11 @@ bool VDAgent::handle_clipboard_request(VDAgentClipboardRequest* clipboard_reques
             break;
         }
         len = wcslen((LPCWSTR)new_data);
-        new_size = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)new_data, (int)len, NULL, 0, NULL, NULL);
+        if (!(text = clipboard_text((LPCWSTR)new_data, len, _max_clipboard))) {
+            vd_printf("No memory for clipboard text");
+            break;
+        }
+        new_size = (long)text->size();
         break;
     case VD_AGENT_CLIPBOARD_IMAGE_PNG:
     case VD_AGENT_CLIPBOARD_IMAGE_BMP: {
@@ -1195,15 +1231,22 @@ bool VDAgent::handle_clipboard_request(VDAgentClipboardRequest* clipboard_reques
         if (IsClipboardFormatAvailable(CF_PALETTE)) {
             pal = (HPALETTE)GetClipboardData(CF_PALETTE);
         }
-        if (!image.CreateFromHBITMAP((HBITMAP)clip_data, pal)) {
+        bitmap = new ClipboardBitmap;
+        if (!bitmap->image.CreateFromHBITMAP((HBITMAP)clip_data, pal)) {
             vd_printf("Image create from handle failed");
             break;
         }
-        if (!image.Encode(new_data, new_size, cximage_format)) {
+        if (cximage_format == CXIMAGE_FORMAT_BMP && bitmap->init()) {
+            new_size = bitmap->size;
+            break;
+        }
+        if (!bitmap->image.Encode(new_data, new_size, cximage_format)) {
             vd_printf("Image encode to type %u failed", clipboard_request->type);
             break;
         }
         vd_printf("Image encoded to %lu bytes", new_size);
+        delete bitmap;
+        bitmap = NULL;
         break;
     }
     }
@@ -1218,36 +1261,34 @@ bool VDAgent::handle_clipboard_request(VDAgentClipboardRequest* clipboard_reques
         goto handle_clipboard_request_fail;
     }
 
-    msg_size = sizeof(VDAgentMessage) + sizeof(VDAgentClipboard) + new_size;
-    msg = (VDAgentMessage*)new uint8_t[msg_size];
-    msg->protocol = VD_AGENT_PROTOCOL;
-    msg->type = VD_AGENT_CLIPBOARD;
-    msg->opaque = 0;
-    msg->size = (uint32_t)(sizeof(VDAgentClipboard) + new_size);
-    clipboard = (VDAgentClipboard*)msg->data;
+    msg = _transport.new_message(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, sizeof(VDAgentClipboard));
+    if (!msg) {
+        goto handle_clipboard_request_fail;
+    }
+    clipboard = (VDAgentClipboard*)msg->payload();
     clipboard->type = clipboard_request->type;
 
-    switch (clipboard_request->type) {
-    case VD_AGENT_CLIPBOARD_UTF8_TEXT:
-        WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)new_data, (int)len, (LPSTR)clipboard->data,
-                            new_size, NULL, NULL);
+    // The transport frees the data once written
+    if (text) {
         GlobalUnlock(clip_data);
-        break;
-    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
-    case VD_AGENT_CLIPBOARD_IMAGE_BMP:
-        memcpy(clipboard->data, new_data, new_size);
-        image.FreeMemory(new_data);
-        break;
+        text->attach(msg);
+    } else if (bitmap) {
+        msg->set_source(bitmap->size, ClipboardBitmap::read, ClipboardBitmap::release, bitmap);
+    } else {
+        msg->set_data(new_data, new_size, free_clipboard_image, new_data);
     }
     CloseClipboard();
-    write_clipboard(msg, msg_size);
-    delete[] (uint8_t *)msg;
+    _transport.enqueue_message(msg);
     return true;
 
 handle_clipboard_request_fail:
     if (clipboard_request->type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
        GlobalUnlock(clip_data);
+    } else if (new_data) {
+        free_clipboard_image(new_data);
     }
+    delete text;
+    delete bitmap;
     CloseClipboard();
     return false;
 }
@@ -1315,13 +1356,7 @@ void VDAgent::set_clipboard_owner(int new_owner)
 
 bool VDAgent::init_vio_serial()
 {
-    _vio_serial = CreateFile(VIOSERIAL_PORT_PATH, GENERIC_READ | GENERIC_WRITE , 0, NULL,
-                             OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-    if (_vio_serial == INVALID_HANDLE_VALUE) {
-        vd_printf("Failed opening %ls, error %lu", VIOSERIAL_PORT_PATH, GetLastError());
-        return false;
-    }
-    return true;
+    return _vio_serial.open(VIOSERIAL_PORT_PATH);
 }
 
 void VDAgent::dispatch_message(VDAgentMessage* msg, uint32_t port)
@@ -1391,7 +1426,8 @@ void VDAgent::dispatch_message(VDAgentMessage* msg, uint32_t port)
     case VD_AGENT_PORT_FORWARD_ACK:
     case VD_AGENT_PORT_FORWARD_LISTEN:
     case VD_AGENT_PORT_FORWARD_SHUTDOWN:
-        if (_pf) res = _pf->dispatch(msg->type, msg->data);
+    case VD_AGENT_PORT_FORWARD_DATA_COMPRESSED:
+        if (_pf) res = _pf->dispatch(msg->type, msg->data, msg->size);
         break;
     default:
         vd_printf("Unsupported message type %u size %u", msg->type, msg->size);
@@ -1402,136 +1438,33 @@ void VDAgent::dispatch_message(VDAgentMessage* msg, uint32_t port)
     }
 }
 
-VOID VDAgent::read_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped)
+void VDAgent::handle_message(VDAgentMessage* msg, uint32_t port)
 {
-    VDAgent* a = _singleton;
-    VDIChunk* chunk = (VDIChunk*)a->_read_buf;
-    DWORD count;
-
-    if (err != 0 && err != ERROR_OPERATION_ABORTED && err != ERROR_NO_SYSTEM_RESOURCES) {
-        vd_printf("vio_serial read completion error %lu", err);
-        a->_running = false;
+    if (port == 0 && msg->type == VD_AGENT_CLIPBOARD && !_clipboard_tick) {
+        vd_printf("Clipboard received but dropped due to timeout");
         return;
     }
-
-    a->_read_pos += bytes;
-    if (a->_read_pos < sizeof(VDIChunk)) {
-        count = sizeof(VDIChunk) - a->_read_pos;
-    } else if (a->_read_pos == sizeof(VDIChunk)) {
-        count = chunk->hdr.size;
-        if (a->_read_pos + count > sizeof(a->_read_buf)) {
-            vd_printf("chunk is too large, size %u port %u", chunk->hdr.size, chunk->hdr.port);
-            a->_running = false;
-            return;
-        }
-    } else if (a->_read_pos == sizeof(VDIChunk) + chunk->hdr.size){
-        a->handle_chunk(chunk);
-        count = sizeof(VDIChunk);
-        a->_read_pos = 0;
-    } else {
-        ASSERT(a->_read_pos < sizeof(VDIChunk) + chunk->hdr.size);
-        count = sizeof(VDIChunk) + chunk->hdr.size - a->_read_pos;
-    }
-
-    if (!ReadFileEx(a->_vio_serial, a->_read_buf + a->_read_pos, count, overlapped,
-                    read_completion) && GetLastError() != ERROR_IO_PENDING) {
-        vd_printf("vio_serial read error %lu", GetLastError());
-        a->_running = false;
-    }
-}
-
-void VDAgent::handle_chunk(VDIChunk* chunk)
-{
-    //FIXME: currently assumes that multi-part msg arrives only from client port
-    if (_in_msg_pos == 0 || chunk->hdr.port == VDP_SERVER_PORT) {
-        if (chunk->hdr.size < sizeof(VDAgentMessage)) {
-            return;
-        }
-        VDAgentMessage* msg = (VDAgentMessage*)chunk->data;
-        if (msg->protocol != VD_AGENT_PROTOCOL) {
-            vd_printf("Invalid protocol %u", msg->protocol);
-            _running = false;
-            return;
-        }
-        uint32_t msg_size = sizeof(VDAgentMessage) + msg->size;
-        if (chunk->hdr.size == msg_size) {
-            dispatch_message(msg, chunk->hdr.port);
-        } else {
-            ASSERT(chunk->hdr.size < msg_size);
-            _in_msg = (VDAgentMessage*)new uint8_t[msg_size];
-            memcpy(_in_msg, chunk->data, chunk->hdr.size);
-            _in_msg_pos = chunk->hdr.size;
-        }
-    } else {
-        memcpy((uint8_t*)_in_msg + _in_msg_pos, chunk->data, chunk->hdr.size);
-        _in_msg_pos += chunk->hdr.size;
-        // update clipboard tick on each clipboard chunk for timeout setting
-        if (_in_msg->type == VD_AGENT_CLIPBOARD && _clipboard_tick) {
-            _clipboard_tick = GetTickCount();
-        }
-        if (_in_msg_pos == sizeof(VDAgentMessage) + _in_msg->size) {
-            if (_in_msg->type == VD_AGENT_CLIPBOARD && !_clipboard_tick) {
-                vd_printf("Clipboard received but dropped due to timeout");
-            } else {
-                dispatch_message(_in_msg, 0);
-            }
-            cleanup_in_msg();
-        }
-    }
+    dispatch_message(msg, port);
 }
 
-void VDAgent::cleanup_in_msg()
+void VDAgent::handle_partial_message(VDAgentMessage* msg)
 {
-    _in_msg_pos = 0;
-    delete[] (uint8_t *)_in_msg;
-    _in_msg = NULL;
-}
-
-void VDAgent::write_completion(DWORD err, DWORD bytes, LPOVERLAPPED overlapped)
-{
-    VDAgent* a = _singleton;
-    VDIChunk* chunk;
-    DWORD count;
-
-    ASSERT(!a->_message_queue.empty());
-    if (err != 0) {
-        vd_printf("vio_serial write completion error %lu", err);
-        a->_running = false;
-        return;
-    }
-    MutexLocker lock(a->_message_mutex);
-    a->_write_pos += bytes;
-    chunk = a->_message_queue.front();
-    count = sizeof(VDIChunk) + chunk->hdr.size - a->_write_pos;
-    if (count == 0) {
-        a->_message_queue.pop();
-        a->_write_pos = 0;
-        delete[] (char *)chunk;
-        if (!a->_message_queue.empty()) {
-            chunk = a->_message_queue.front();
-            count = sizeof(VDIChunk) + chunk->hdr.size;
-        }
-    }
-    if (count) {
-        if (!WriteFileEx(a->_vio_serial, (char*)chunk + a->_write_pos, count, overlapped,
-                         write_completion) && GetLastError() != ERROR_IO_PENDING) {
-            vd_printf("vio_serial write error %lu", GetLastError());
-            a->_running = false;
-        }
+    // update clipboard tick on each clipboard chunk for timeout setting
+    if (msg->type == VD_AGENT_CLIPBOARD && _clipboard_tick) {
+        _clipboard_tick = GetTickCount();
     }
 }
 
-VDIChunk* VDAgent::new_chunk(DWORD bytes)
+void VDAgent::handle_transport_error()
 {
-    return (VDIChunk*)(new char[bytes]);
+    _running = false;
 }
 
-void VDAgent::enqueue_chunk(VDIChunk* chunk)
+// Port forwarding reads resume once the port catches up with them
+void VDAgent::handle_queue_drained(int prio)
 {
-    MutexLocker lock(_message_mutex);
-    _message_queue.push(chunk);
-    if (_message_queue.size() == 1) {
-        write_completion(0, 0, &_write_overlapped);
+    if (prio == ChunkTransport::PRIO_PORT_FORWARD && _pf) {
+        _pf->transport_drained();
     }
 }
 